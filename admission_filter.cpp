@@ -0,0 +1,137 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "admission_filter.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace nssCommand
+{
+	vector<string> splitPatterns(const string& text)
+	{
+		vector<string> patterns;
+		size_t start = 0;
+		while ((start = text.find_first_not_of(" \t\n,", start)) != string::npos)
+		{
+			size_t end = text.find_first_of(" \t\n,", start);
+			if (end == string::npos) end = text.size();
+			patterns.push_back(text.substr(start, end - start));
+			start = end;
+		}
+		return patterns;
+	}
+	/*
+	 Calls visit with each label of name from the last one to the first one, stopping
+	 early if it returns false. Returns false for names with empty labels.
+	*/
+	template <typename Visitor> bool forEachLabelReversed(const string& name, Visitor visit)
+	{
+		size_t end = name.size();
+		if (end > 0 && name[end - 1] == '.') end--;
+		if (end == 0) return false;
+		while (true)
+		{
+			size_t dot = name.rfind('.', end - 1);
+			size_t start = (dot == string::npos) ? 0 : dot + 1;
+			if (start == end) return false;
+			string label = name.substr(start, end - start);
+			for (char& c : label) c = tolower((unsigned char) c);
+			if (!visit(label, start == 0)) return true;
+			if (start == 0) return true;
+			end = dot;
+		}
+	}
+
+	AdmissionFilter::AdmissionFilter(const string& names, const string& networks)
+		: filterNames(false), filterAddresses(false), rejectedCount(0)
+	{
+		for (auto& pattern : splitPatterns(names)) addName(pattern);
+		for (auto& pattern : splitPatterns(networks)) addNetwork(pattern);
+	}
+	void AdmissionFilter::addName(const string& pattern)
+	{
+		bool below = (pattern[0] == '.');
+		Label* node = &root;
+		bool valid = forEachLabelReversed(below ? pattern.substr(1) : pattern, [&](const string& label, bool) {
+			unique_ptr<Label>& child = node->children[label];
+			if (!child) child.reset(new Label());
+			node = child.get();
+			return true;
+		});
+		if (!valid) return;
+		if (below) node->below = true;
+		else node->exact = true;
+		filterNames = true;
+	}
+	void AdmissionFilter::addNetwork(const string& pattern)
+	{
+		Network network;
+		memset(&network, 0, sizeof(network));
+		size_t slash = pattern.find('/');
+		string address = pattern.substr(0, slash);
+		network.family = (address.find(':') == string::npos) ? AF_INET : AF_INET6;
+		unsigned maximumLength = (network.family == AF_INET) ? 32 : 128;
+		if (inet_pton(network.family, address.c_str(), network.prefix) != 1) return;
+		network.length = maximumLength;
+		if (slash != string::npos)
+		{
+			char* end;
+			const char* length = pattern.c_str() + slash + 1;
+			unsigned long parsed = strtoul(length, &end, 10);
+			if (*length == '\0' || *end != '\0' || !isdigit((unsigned char) *length) || parsed > maximumLength) return;
+			network.length = parsed;
+		}
+		networks.push_back(network);
+		filterAddresses = true;
+	}
+	bool AdmissionFilter::admits(QueryKind kind, const string& query)
+	{
+		bool admitted = (kind == QueryKind::byName) ? admitsName(query) : admitsAddress(query);
+		if (!admitted) rejectedCount++;
+		return admitted;
+	}
+	bool AdmissionFilter::admitsName(const string& name) const
+	{
+		if (!filterNames) return true;
+		const Label* node = &root;
+		bool admitted = false;
+		forEachLabelReversed(name, [&](const string& label, bool last) {
+			if (node->below)
+			{
+				admitted = true;
+				return false;
+			}
+			auto child = node->children.find(label);
+			if (child == node->children.end()) return false;
+			node = child->second.get();
+			if (last) admitted = node->exact;
+			return true;
+		});
+		return admitted;
+	}
+	bool AdmissionFilter::admitsAddress(const string& address) const
+	{
+		if (!filterAddresses) return true;
+		uint8_t bytes[16];
+		int family = (address.find(':') == string::npos) ? AF_INET : AF_INET6;
+		if (inet_pton(family, address.c_str(), bytes) != 1) return false;
+		for (auto& network : networks)
+		{
+			if (network.family != family) continue;
+			unsigned fullBytes = network.length / 8;
+			unsigned remainingBits = network.length % 8;
+			if (memcmp(bytes, network.prefix, fullBytes) != 0) continue;
+			if (remainingBits == 0) return true;
+			uint8_t mask = 0xff << (8 - remainingBits);
+			if ((bytes[fullBytes] & mask) == (network.prefix[fullBytes] & mask)) return true;
+		}
+		return false;
+	}
+}
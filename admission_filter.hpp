@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_ADMISSION_FILTER_H
+#define _NSSCOMMAND_ADMISSION_FILTER_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "nss_command.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Decides which queries are worth executing a command for. Names are admitted by a
+	 list of patterns separated by spaces or commas, where `host.example.com` admits only
+	 that name and `.example.com` admits every name below example.com. Addresses are
+	 admitted by a list of networks in CIDR notation, like `10.0.0.0/8` or `fd00::/8`.
+	 Names are compared ignoring case and a trailing dot. An empty list admits everything.
+	*/
+	class AdmissionFilter
+	{
+	public:
+		AdmissionFilter(const string& names, const string& networks);
+		bool admits(QueryKind kind, const string& query);
+		bool admitsName(const string& name) const;
+		bool admitsAddress(const string& address) const;
+		unsigned long rejected() const { return rejectedCount.load(); }
+	private:
+		// Names are stored by their labels in reverse order: com -> example -> host
+		struct Label
+		{
+			bool exact = false;
+			bool below = false;
+			unordered_map<string, unique_ptr<Label>> children;
+		};
+		struct Network
+		{
+			int family;
+			uint8_t prefix[16];
+			unsigned length;
+		};
+		void addName(const string& pattern);
+		void addNetwork(const string& pattern);
+		Label root;
+		bool filterNames;
+		bool filterAddresses;
+		vector<Network> networks;
+		atomic<unsigned long> rejectedCount;
+	};
+
+	AdmissionFilter& admissionFilter();
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Command that costs as little as possible to execute, for lookup_benchmark. A name like
+ host<N>-<anything> resolves to N IPv4 and N IPv6 addresses, and an address resolves
+ to itself. It is written without iostreams so it starts as fast as a C program.
+*/
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) return 3;
+	const char* query = argv[1];
+	string output;
+	char line[64];
+	if (strncmp(query, "host", 4) == 0)
+	{
+		long count = strtol(query + 4, nullptr, 10);
+		output = string("name: ") + query + ".bench.\nalias: " + query + "\n";
+		for (long i = 0; i < count; i++)
+		{
+			snprintf(line, sizeof(line), "ip4: 10.%ld.%ld.%ld\nip6: fd00::%lx\n", (i >> 16) & 255, (i >> 8) & 255, i & 255, i + 1);
+			output += line;
+		}
+	}
+	else
+	{
+		output = string("name: reverse.bench.\n") + (strchr(query, ':') ? "ip6: " : "ip4: ") + query + "\n";
+	}
+	size_t written = 0;
+	while (written < output.size())
+	{
+		ssize_t result = write(1, output.data() + written, output.size() - written);
+		if (result <= 0) return 2;
+		written += result;
+	}
+	return 0;
+}
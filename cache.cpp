@@ -0,0 +1,203 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "cache.hpp"
+#include <thread>
+
+using namespace std;
+
+namespace nssCommand
+{
+	ResultCache::ResultCache(size_t capacity, unsigned positiveTtl, unsigned negativeTtl, unsigned staleWindow)
+		: capacity(capacity), positiveTtl(positiveTtl), negativeTtl(negativeTtl), staleWindow(staleWindow), hitCount(0), missCount(0), staleHitCount(0)
+	{
+	}
+	string ResultCache::makeKey(QueryKind kind, const string& command, const string& query)
+	{
+		string key(1, static_cast<char>(kind));
+		key.append(command);
+		key.push_back('\0');
+		key.append(query);
+		return key;
+	}
+	bool ResultCache::find(const string& key, int& returnCode, HostEntry& entry)
+	{
+		bool refresh;
+		return find(key, returnCode, entry, false, refresh);
+	}
+	bool ResultCache::find(const string& key, int& returnCode, HostEntry& entry, bool& refresh)
+	{
+		return find(key, returnCode, entry, true, refresh);
+	}
+	bool ResultCache::find(const string& key, int& returnCode, HostEntry& entry, bool allowStale, bool& refresh)
+	{
+		refresh = false;
+		lock_guard<mutex> guard(lock);
+		auto found = index.find(key);
+		if (found == index.end())
+		{
+			missCount++;
+			return false;
+		}
+		auto item = found->second;
+		auto now = Clock::now();
+		bool expired = (item->expiration <= now);
+		bool stale = expired && item->returnCode == 0 && now < item->expiration + chrono::seconds(staleWindow);
+		if (expired && !(stale && allowStale))
+		{
+			if (!stale) evict(item);
+			missCount++;
+			return false;
+		}
+		items.splice(items.begin(), items, item);
+		returnCode = item->returnCode;
+		entry = item->entry;
+		if (stale)
+		{
+			if (entry.ttl >= 0)  entry.ttl = 0;
+			refresh = !item->refreshing;
+			item->refreshing = true;
+			staleHitCount++;
+			return true;
+		}
+		if (entry.ttl >= 0)  entry.ttl = int32_t(chrono::duration_cast<chrono::seconds>(item->expiration - now).count());
+		hitCount++;
+		return true;
+	}
+	void ResultCache::insert(const string& key, int returnCode, const HostEntry& entry)
+	{
+		lock_guard<mutex> guard(lock);
+		auto found = index.find(key);
+		if (returnCode == 2)
+		{
+			// Keeps serving a stale entry, and lets the next caller try to refresh it
+			if (found != index.end()) found->second->refreshing = false;
+			return;
+		}
+		if (found != index.end()) evict(found->second);
+		unsigned ttl = (returnCode == 0) ? positiveTtl : negativeTtl;
+		if (ttl == 0 || capacity == 0) return;
+		if (returnCode == 0 && entry.ttl >= 0)  ttl = entry.ttl;
+		if (ttl == 0) return;
+		while (items.size() >= capacity.load()) evict(prev(items.end()));
+		items.push_front(Item{key, returnCode, entry, Clock::now() + chrono::seconds(ttl), false});
+		index[key] = items.begin();
+	}
+	void ResultCache::configure(size_t newCapacity, unsigned newPositiveTtl, unsigned newNegativeTtl, unsigned newStaleWindow)
+	{
+		lock_guard<mutex> guard(lock);
+		staleWindow = newStaleWindow;
+		capacity = newCapacity;
+		positiveTtl = newPositiveTtl;
+		negativeTtl = newNegativeTtl;
+		while (items.size() > capacity.load()) evict(prev(items.end()));
+	}
+	void ResultCache::clear()
+	{
+		lock_guard<mutex> guard(lock);
+		index.clear();
+		items.clear();
+		hitCount = 0;
+		missCount = 0;
+		staleHitCount = 0;
+	}
+	size_t ResultCache::size()
+	{
+		lock_guard<mutex> guard(lock);
+		return items.size();
+	}
+	void ResultCache::resetAfterFork()
+	{
+		// The threads refreshing them don't exist in the child, the next caller refreshes them instead
+		for (auto& item : items) item.refreshing = false;
+		lock.unlock();
+	}
+	void ResultCache::evict(list<Item>::iterator item)
+	{
+		index.erase(item->key);
+		items.erase(item);
+	}
+
+	int RequestCoalescer::run(const string& key, HostEntry& entry, int executionMilliseconds, const function<int(HostEntry&)>& execute)
+	{
+		unique_lock<mutex> guard(lock);
+		auto found = flights.find(key);
+		if (found != flights.end())
+		{
+			shared_ptr<Flight> flight = found->second;
+			coalescedCount++;
+			if (!flight->finished.wait_until(guard, flight->deadline, [&flight]() { return flight->done; })) return 2;
+			entry = flight->entry;
+			return flight->returnCode;
+		}
+		shared_ptr<Flight> flight = make_shared<Flight>();
+		flight->deadline = chrono::steady_clock::now() + chrono::milliseconds(executionMilliseconds);
+		flights[key] = flight;
+		guard.unlock();
+		int returnCode;
+		try
+		{
+			returnCode = execute(entry);
+		}
+		catch (...)
+		{
+			land(key, *flight, 3, HostEntry());
+			throw;
+		}
+		land(key, *flight, returnCode, entry);
+		return returnCode;
+	}
+	void RequestCoalescer::land(const string& key, Flight& flight, int returnCode, const HostEntry& entry)
+	{
+		lock_guard<mutex> guard(lock);
+		flight.returnCode = returnCode;
+		flight.entry = entry;
+		flight.done = true;
+		// Only if it's still this flight, a child may have forgotten it and started another one
+		auto found = flights.find(key);
+		if (found != flights.end() && found->second.get() == &flight) flights.erase(found);
+		flight.finished.notify_all();
+	}
+	void RequestCoalescer::resetAfterFork()
+	{
+		flights.clear();
+		lock.unlock();
+	}
+
+	void BackgroundRefreshes::start(const function<void()>& refresh)
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			running++;
+		}
+		try
+		{
+			thread([this, refresh]() {
+				refresh();
+				finish();
+			}).detach();
+		}
+		catch (...)
+		{
+			finish();
+			throw;
+		}
+	}
+	unsigned BackgroundRefreshes::active()
+	{
+		lock_guard<mutex> guard(lock);
+		return running;
+	}
+	void BackgroundRefreshes::finish()
+	{
+		lock_guard<mutex> guard(lock);
+		running--;
+	}
+	void BackgroundRefreshes::resetAfterFork()
+	{
+		running = 0;
+		lock.unlock();
+	}
+}
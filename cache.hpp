@@ -0,0 +1,143 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_CACHE_H
+#define _NSSCOMMAND_CACHE_H 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "nss_command.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Bounded LRU cache of command results. Successful results (return code 0) are kept
+	 for the ttl given by the command, or positiveTtl seconds if it didn't give one, and
+	 unsuccessful ones for negativeTtl seconds. Temporary failures (return code 2) are
+	 never cached. A ttl of 0 disables that kind of entry. Entries found carry the ttl
+	 they have left. Successful results can also be served for staleWindow seconds after
+	 they expire, while they are refreshed. A child created with fork() forgets the
+	 refreshes its parent had started.
+	*/
+	class ResultCache
+	{
+	public:
+		ResultCache(size_t capacity, unsigned positiveTtl, unsigned negativeTtl, unsigned staleWindow = 0);
+		static string makeKey(QueryKind kind, const string& command, const string& query);
+		bool find(const string& key, int& returnCode, HostEntry& entry);
+		/*
+		 Like find, but expired successful results within the stale window are returned
+		 too. refresh is set for the first caller that gets a stale result, which should
+		 refresh it, and it's set again for another caller if that refresh fails with a
+		 temporary failure.
+		*/
+		bool find(const string& key, int& returnCode, HostEntry& entry, bool& refresh);
+		void insert(const string& key, int returnCode, const HostEntry& entry);
+		void configure(size_t capacity, unsigned positiveTtl, unsigned negativeTtl, unsigned staleWindow = 0);
+		void clear();
+		size_t size();
+		bool enabled() const { return capacity.load(memory_order_relaxed) > 0; }
+		unsigned long hits() const { return hitCount.load(); }
+		unsigned long misses() const { return missCount.load(); }
+		unsigned long staleHits() const { return staleHitCount.load(); }
+		// Called by the fork() handlers, so the child never inherits the lock held by another thread
+		void lockForFork() { lock.lock(); }
+		void unlockAfterFork() { lock.unlock(); }
+		void resetAfterFork();
+	private:
+		typedef chrono::steady_clock Clock;
+		struct Item
+		{
+			string key;
+			int returnCode;
+			HostEntry entry;
+			Clock::time_point expiration;
+			bool refreshing;
+		};
+		bool find(const string& key, int& returnCode, HostEntry& entry, bool allowStale, bool& refresh);
+		void evict(list<Item>::iterator item);
+		atomic<size_t> capacity;
+		unsigned positiveTtl;
+		unsigned negativeTtl;
+		unsigned staleWindow;
+		mutex lock;
+		list<Item> items;
+		unordered_map<string, list<Item>::iterator> index;
+		atomic<unsigned long> hitCount;
+		atomic<unsigned long> missCount;
+		atomic<unsigned long> staleHitCount;
+	};
+
+	/*
+	 Deduplicates concurrent executions for the same key: the first caller executes,
+	 callers arriving while it runs wait for it and get a copy of its result. The first
+	 caller gives the longest its execution may take, and callers wait for it at most
+	 until then, and then get return code 2 so they can try again.
+	 A child created with fork() forgets the executions of its parent, the threads that
+	 would finish them don't exist there.
+	*/
+	class RequestCoalescer
+	{
+	public:
+		RequestCoalescer() : coalescedCount(0) {}
+		int run(const string& key, HostEntry& entry, int executionMilliseconds, const function<int(HostEntry&)>& execute);
+		unsigned long coalesced() const { return coalescedCount.load(); }
+		// Called by the fork() handlers, so the child never inherits the lock held by another thread
+		void lockForFork() { lock.lock(); }
+		void unlockAfterFork() { lock.unlock(); }
+		void resetAfterFork();
+	private:
+		struct Flight
+		{
+			bool done = false;
+			int returnCode = 3;
+			chrono::steady_clock::time_point deadline;
+			HostEntry entry;
+			condition_variable finished;
+		};
+		void land(const string& key, Flight& flight, int returnCode, const HostEntry& entry);
+		mutex lock;
+		unordered_map<string, shared_ptr<Flight>> flights;
+		atomic<unsigned long> coalescedCount;
+	};
+
+	/*
+	 Refreshes running in detached background threads. Nothing waits for them, so what
+	 they use must outlive them. A child created with fork() has none of them running.
+	*/
+	class BackgroundRefreshes
+	{
+	public:
+		BackgroundRefreshes() : running(0) {}
+		BackgroundRefreshes(const BackgroundRefreshes&) = delete;
+		BackgroundRefreshes& operator = (const BackgroundRefreshes&) = delete;
+		void start(const function<void()>& refresh);
+		unsigned active();
+		void lockForFork() { lock.lock(); }
+		void unlockAfterFork() { lock.unlock(); }
+		void resetAfterFork();
+	private:
+		void finish();
+		mutex lock;
+		unsigned running;
+	};
+
+	ResultCache& resultCache();
+	ResultCache& reverseIndex();
+	RequestCoalescer& requestCoalescer();
+	BackgroundRefreshes& backgroundRefreshes();
+	int lookup(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned = nullptr);
+}
+
+#endif
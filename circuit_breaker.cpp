@@ -0,0 +1,169 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "circuit_breaker.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+
+using namespace std;
+
+namespace nssCommand
+{
+	const size_t BREAKER_SLOTS = 64;
+
+	struct BreakerSlot
+	{
+		atomic<uint64_t> commandHash;
+		atomic<uint32_t> failures;
+		atomic<int32_t> lastReturnCode;
+		atomic<int64_t> openUntil;
+		atomic<int64_t> probeUntil;
+	};
+	static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t) && ATOMIC_LLONG_LOCK_FREE == 2, "shared slots need address free atomics");
+
+	uint64_t hashCommand(const string& command)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for (unsigned char c : command) hash = (hash ^ c) * 1099511628211ULL;
+		return hash | 1; // 0 marks free slots
+	}
+	int64_t monotonicMilliseconds()
+	{
+		// CLOCK_MONOTONIC is the same for every process, so it can be shared
+		timespec current;
+		clock_gettime(CLOCK_MONOTONIC, &current);
+		return int64_t(current.tv_sec) * 1000 + current.tv_nsec / 1000000;
+	}
+	bool isFailure(int returnCode)
+	{
+		return returnCode != 0 && returnCode != 1 && returnCode != 4;
+	}
+
+	CircuitBreaker::CircuitBreaker()
+		: mapping(nullptr), mappingSize(0), writable(true), slots(new BreakerSlot[BREAKER_SLOTS]()), sharedSlots(nullptr), rejectedCount(0)
+	{
+	}
+	CircuitBreaker::CircuitBreaker(void* mapping, size_t mappingSize, bool writable)
+		: mapping(mapping), mappingSize(mappingSize), writable(writable),
+		slots(writable ? (BreakerSlot*) mapping : new BreakerSlot[BREAKER_SLOTS]()), sharedSlots((BreakerSlot*) mapping), rejectedCount(0)
+	{
+	}
+	unique_ptr<CircuitBreaker> CircuitBreaker::open(const string& path, uid_t owner)
+	{
+		bool writable = (geteuid() == owner);
+		size_t mappingSize = BREAKER_SLOTS * sizeof(BreakerSlot);
+		int fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0 && errno == ENOENT && writable)
+		{
+			// Created under a temporary name with its final size, so nobody maps it short
+			string temporaryPath = path + "." + to_string(getpid());
+			fd = ::open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+			if (fd < 0) return nullptr;
+			if (fchmod(fd, 0644) != 0 || ftruncate(fd, mappingSize) != 0 || link(temporaryPath.c_str(), path.c_str()) != 0)
+			{
+				close(fd);
+				unlink(temporaryPath.c_str());
+				fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC); // someone else created it first
+				if (fd < 0) return nullptr;
+			}
+			else
+			{
+				unlink(temporaryPath.c_str());
+			}
+		}
+		if (fd < 0) return nullptr;
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0
+			|| size_t(properties.st_size) != mappingSize)
+		{
+			close(fd);
+			return nullptr;
+		}
+		void* mapping = mmap(nullptr, mappingSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return nullptr;
+		return unique_ptr<CircuitBreaker>(new CircuitBreaker(mapping, mappingSize, writable));
+	}
+	CircuitBreaker::~CircuitBreaker()
+	{
+		if (mapping != nullptr) munmap(mapping, mappingSize);
+		if (slots != sharedSlots) delete[] slots;
+	}
+	// Slot of the command in slots, taking a free one for it if claim is set
+	BreakerSlot* findSlot(BreakerSlot* slots, const string& command, bool claim)
+	{
+		uint64_t hash = hashCommand(command);
+		for (size_t probe = 0; probe < BREAKER_SLOTS; probe++)
+		{
+			BreakerSlot& current = slots[(hash + probe) % BREAKER_SLOTS];
+			uint64_t found = current.commandHash.load(memory_order_acquire);
+			if (found == hash) return &current;
+			if (found == 0 && !claim) return nullptr;
+			if (found == 0 && (current.commandHash.compare_exchange_strong(found, hash) || found == hash)) return &current;
+		}
+		return nullptr;
+	}
+	// Deadlines further away than a cool-down can only come from a corrupted shared file
+	bool isOpen(const BreakerSlot& state, unsigned threshold, unsigned cooldownMs, int64_t now)
+	{
+		int64_t openUntil = state.openUntil.load();
+		return state.failures.load(memory_order_acquire) >= threshold && now < openUntil && openUntil - now <= cooldownMs;
+	}
+	int rejectionCode(const BreakerSlot& state)
+	{
+		int returnCode = state.lastReturnCode.load();
+		return isFailure(returnCode) ? returnCode : 2;
+	}
+	bool CircuitBreaker::allow(const string& command, unsigned threshold, unsigned cooldownMs, int& returnCode)
+	{
+		if (threshold == 0) return true;
+		if (!writable)
+		{
+			// Fails fast while the owner of the file keeps the breaker open, it probes for everybody
+			BreakerSlot* shared = findSlot(sharedSlots, command, false);
+			if (shared != nullptr && isOpen(*shared, threshold, cooldownMs, monotonicMilliseconds()))
+			{
+				returnCode = rejectionCode(*shared);
+				rejectedCount++;
+				return false;
+			}
+		}
+		BreakerSlot* state = findSlot(slots, command, true);
+		if (state == nullptr || state->failures.load(memory_order_acquire) < threshold) return true;
+		int64_t now = monotonicMilliseconds();
+		if (!isOpen(*state, threshold, cooldownMs, now))
+		{
+			int64_t probeUntil = state->probeUntil.load();
+			bool probing = (now < probeUntil && probeUntil - now <= cooldownMs);
+			if (!probing && state->probeUntil.compare_exchange_strong(probeUntil, now + cooldownMs)) return true;
+		}
+		returnCode = rejectionCode(*state);
+		rejectedCount++;
+		return false;
+	}
+	void CircuitBreaker::record(const string& command, unsigned threshold, unsigned cooldownMs, int returnCode)
+	{
+		if (threshold == 0) return;
+		BreakerSlot* state = findSlot(slots, command, true);
+		if (state == nullptr) return;
+		if (!isFailure(returnCode))
+		{
+			if (state->failures.load(memory_order_relaxed) != 0) state->failures.store(0, memory_order_release);
+			if (state->probeUntil.load(memory_order_relaxed) != 0) state->probeUntil.store(0);
+			return;
+		}
+		state->lastReturnCode.store(returnCode);
+		if (state->failures.fetch_add(1, memory_order_acq_rel) + 1 >= threshold)
+		{
+			state->openUntil.store(monotonicMilliseconds() + cooldownMs);
+			state->probeUntil.store(0);
+		}
+	}
+}
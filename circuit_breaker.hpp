@@ -0,0 +1,57 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_CIRCUIT_BREAKER_H
+#define _NSSCOMMAND_CIRCUIT_BREAKER_H 1
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	struct BreakerSlot;
+
+	/*
+	 Tracks the health of each command to stop executing it while it keeps failing. After
+	 threshold consecutive failures (return codes other than 0, 1 and 4) the breaker opens
+	 and lookups fail right away with the last return code for cooldownMs milliseconds.
+	 Then a single lookup is let through as a probe: if it succeeds the breaker closes,
+	 otherwise it stays open for another cool-down. The state lives in a small table of
+	 atomics, either private to the process or in a file mapped by every process. Only
+	 processes running as the owner of the file write to it, the rest fail fast while it's
+	 open and keep their own private state besides. The file is ignored unless it's owned
+	 by that user and not writable by others.
+	*/
+	class CircuitBreaker
+	{
+	public:
+		CircuitBreaker();
+		static unique_ptr<CircuitBreaker> open(const string& path, uid_t owner);
+		CircuitBreaker(const CircuitBreaker&) = delete;
+		CircuitBreaker& operator = (const CircuitBreaker&) = delete;
+		~CircuitBreaker();
+		bool allow(const string& command, unsigned threshold, unsigned cooldownMs, int& returnCode);
+		void record(const string& command, unsigned threshold, unsigned cooldownMs, int returnCode);
+		unsigned long rejected() const { return rejectedCount.load(); }
+		bool isWritable() const { return writable; }
+	private:
+		CircuitBreaker(void* mapping, size_t mappingSize, bool writable);
+		void* mapping;
+		size_t mappingSize;
+		bool writable;
+		// The table updated by this process: the mapped one when it's writable, otherwise its own
+		BreakerSlot* slots;
+		BreakerSlot* sharedSlots;
+		atomic<unsigned long> rejectedCount;
+	};
+
+	CircuitBreaker& circuitBreaker();
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "concurrency_limiter.hpp"
+#include "metrics.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+namespace nssCommand
+{
+	// Slot of an execution limited by the process itself
+	const int LOCAL_SLOT = -2;
+
+	int openLockFile(const string& path, uid_t owner)
+	{
+		int fd = open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0 && errno == ENOENT)
+		{
+			fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+			// Whatever the umask of its creator, so the check below doesn't refuse it
+			if (fd >= 0) fchmod(fd, 0644);
+			else if (errno == EEXIST) fd = open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+		}
+		struct stat properties;
+		if (fd >= 0 && (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0))
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	bool lockSlot(int fd, unsigned slot)
+	{
+		struct flock range;
+		memset(&range, 0, sizeof(range));
+		range.l_type = F_WRLCK;
+		range.l_whence = SEEK_SET;
+		range.l_start = slot;
+		range.l_len = 1;
+		return fcntl(fd, F_OFD_SETLK, &range) == 0;
+	}
+
+	ConcurrencyLimiter::ConcurrencyLimiter()
+		: localUsed(0), acquiredCount(0), waitedCount(0), timedOutCount(0), waitingCount(0), maxWaitingCount(0), totalWaitMicroseconds(0), longestWaitMicroseconds(0)
+	{
+	}
+	bool ConcurrencyLimiter::acquire(const string& path, uid_t owner, unsigned limit, int timeoutMs, int& slot)
+	{
+		slot = -1;
+		if (limit == 0) return true;
+		// Other users couldn't take the locks without being able to hold every slot forever
+		int fd = (geteuid() == owner) ? openLockFile(path, owner) : -1;
+		// Start at a different slot in each thread, so they don't all fight for the first ones
+		unsigned first = hash<thread::id>()(this_thread::get_id()) % limit;
+		auto start = chrono::steady_clock::now();
+		auto deadline = start + chrono::milliseconds(timeoutMs);
+		auto pause = chrono::microseconds(500);
+		bool waiting = false;
+		// The same metrics count the end of the wait, even if the configuration changes meanwhile
+		Metrics* stats = nullptr;
+		while (true)
+		{
+			if (fd >= 0)
+			{
+				for (unsigned i = 0; i < limit && slot == -1; i++)
+				{
+					if (lockSlot(fd, (first + i) % limit)) slot = fd;
+				}
+				if (slot == -1 && errno != EAGAIN && errno != EACCES && errno != EINTR)
+				{
+					// Locks not supported there, limit the executions of this process instead
+					close(fd);
+					fd = -1;
+					continue;
+				}
+			}
+			else if (takeLocalSlot(limit))
+			{
+				slot = LOCAL_SLOT;
+			}
+			if (slot != -1)
+			{
+				if (waiting)
+				{
+					waitingCount--;
+					stats->subtract(Counter::concurrencyWaiting);
+					recordWait(*stats, chrono::steady_clock::now() - start);
+				}
+				acquiredCount++;
+				return true;
+			}
+			auto now = chrono::steady_clock::now();
+			if (!waiting)
+			{
+				waiting = true;
+				waitedCount++;
+				unsigned long depth = ++waitingCount;
+				unsigned long deepest = maxWaitingCount.load();
+				while (depth > deepest && !maxWaitingCount.compare_exchange_weak(deepest, depth));
+				stats = &metrics();
+				stats->add(Counter::concurrencyWaiting);
+				stats->raise(Counter::concurrencyMaxWaiting, stats->total(Counter::concurrencyWaiting));
+			}
+			if (now >= deadline)
+			{
+				waitingCount--;
+				timedOutCount++;
+				stats->subtract(Counter::concurrencyWaiting);
+				recordWait(*stats, now - start);
+				if (fd >= 0) close(fd);
+				return false;
+			}
+			this_thread::sleep_for(min<chrono::steady_clock::duration>(pause, deadline - now));
+			pause = min<chrono::microseconds>(pause * 2, chrono::milliseconds(10));
+		}
+	}
+	void ConcurrencyLimiter::release(int slot)
+	{
+		if (slot >= 0) close(slot);
+		else if (slot == LOCAL_SLOT) localUsed--;
+	}
+	bool ConcurrencyLimiter::takeLocalSlot(unsigned limit)
+	{
+		unsigned used = localUsed.load();
+		while (used < limit)
+		{
+			if (localUsed.compare_exchange_weak(used, used + 1)) return true;
+		}
+		return false;
+	}
+	void ConcurrencyLimiter::recordWait(Metrics& stats, chrono::steady_clock::duration waited)
+	{
+		stats.record(Histogram::concurrencyWaitTime, chrono::duration_cast<chrono::nanoseconds>(waited).count());
+		unsigned long long microseconds = chrono::duration_cast<chrono::microseconds>(waited).count();
+		totalWaitMicroseconds += microseconds;
+		unsigned long long longest = longestWaitMicroseconds.load();
+		while (microseconds > longest && !longestWaitMicroseconds.compare_exchange_weak(longest, microseconds));
+	}
+}
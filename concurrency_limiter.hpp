@@ -0,0 +1,81 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_CONCURRENCY_LIMITER_H
+#define _NSSCOMMAND_CONCURRENCY_LIMITER_H 1
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <sys/types.h>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	class Metrics;
+
+	/*
+	 Limits how many commands are executed at the same time by every process in the host.
+	 Each execution holds a lock on one of the first limit bytes of a lock file shared by
+	 all of them. The locks are open file description locks, so they belong to the slot
+	 and not to the process, and they are released when the slot is closed or the process
+	 holding it dies. Only processes run by the owner of the file use it, and only if it's
+	 owned by the owner and not writable by others; the rest of them, or all of them when
+	 the file can't be used, limit their own executions instead. The waits are also
+	 counted in metrics(), where the number of waiting executions is shared by the host.
+	*/
+	class ConcurrencyLimiter
+	{
+	public:
+		ConcurrencyLimiter();
+		/*
+		 Takes a free slot, waiting up to timeoutMs milliseconds for one. Returns false if
+		 none got free in time. The slot must be given back with release. When the limit is
+		 0 the execution isn't limited, and slot is set to -1.
+		*/
+		bool acquire(const string& path, uid_t owner, unsigned limit, int timeoutMs, int& slot);
+		void release(int slot);
+		// Called in the child after fork(), the executions of the parent don't run there
+		void resetAfterFork() { localUsed = 0; }
+		unsigned long acquired() const { return acquiredCount.load(); }
+		unsigned long waited() const { return waitedCount.load(); }
+		unsigned long timedOut() const { return timedOutCount.load(); }
+		unsigned long waiting() const { return waitingCount.load(); }
+		unsigned long maxWaiting() const { return maxWaitingCount.load(); }
+		unsigned long long waitMicroseconds() const { return totalWaitMicroseconds.load(); }
+		unsigned long long maxWaitMicroseconds() const { return longestWaitMicroseconds.load(); }
+	private:
+		bool takeLocalSlot(unsigned limit);
+		void recordWait(Metrics& stats, chrono::steady_clock::duration waited);
+		atomic<unsigned> localUsed;
+		atomic<unsigned long> acquiredCount;
+		atomic<unsigned long> waitedCount;
+		atomic<unsigned long> timedOutCount;
+		atomic<unsigned long> waitingCount;
+		atomic<unsigned long> maxWaitingCount;
+		atomic<unsigned long long> totalWaitMicroseconds;
+		atomic<unsigned long long> longestWaitMicroseconds;
+	};
+
+	/*
+	 Gives the slot back to the limiter when it goes out of scope.
+	*/
+	class ConcurrencySlot
+	{
+	public:
+		ConcurrencySlot(ConcurrencyLimiter& limiter, int slot) : limiter(limiter), slot(slot) {}
+		ConcurrencySlot(const ConcurrencySlot&) = delete;
+		ConcurrencySlot& operator = (const ConcurrencySlot&) = delete;
+		~ConcurrencySlot() { limiter.release(slot); }
+	private:
+		ConcurrencyLimiter& limiter;
+		int slot;
+	};
+
+	ConcurrencyLimiter& concurrencyLimiter();
+}
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "configuration.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+namespace nssCommand
+{
+	string trimBlanks(const string& text)
+	{
+		size_t start = text.find_first_not_of(" \t\r");
+		if (start == string::npos) return string();
+		size_t end = text.find_last_not_of(" \t\r");
+		return text.substr(start, end - start + 1);
+	}
+	bool parseSetting(const string& value, string& setting)
+	{
+		setting = value;
+		return true;
+	}
+	bool parseSetting(const string& value, bool& setting)
+	{
+		if (value == "true" || value == "yes" || value == "1") setting = true;
+		else if (value == "false" || value == "no" || value == "0") setting = false;
+		else return false;
+		return true;
+	}
+	template <typename Number> bool parseSetting(const string& value, Number& setting)
+	{
+		if (value.empty() || value[0] < '0' || value[0] > '9') return false;
+		char* end;
+		errno = 0;
+		unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+		if (errno != 0 || *end != '\0' || parsed > (unsigned long long) numeric_limits<Number>::max()) return false;
+		setting = parsed;
+		return true;
+	}
+	bool applySetting(const string& key, const string& value, Configuration& configuration)
+	{
+		if (key == "gethostbyname_command") return parseSetting(value, configuration.gethostbynameCommand);
+		if (key == "gethostbyaddr_command") return parseSetting(value, configuration.gethostbyaddrCommand);
+		if (key == "coprocess_command") return parseSetting(value, configuration.coprocessCommand);
+		if (key == "coprocess_mode") return parseSetting(value, configuration.coprocessMode);
+		if (key == "spawner_command") return parseSetting(value, configuration.spawnerCommand);
+		if (key == "spawner_mode") return parseSetting(value, configuration.spawnerMode);
+		if (key == "socket_path") return parseSetting(value, configuration.socketPath);
+		if (key == "socket_mode") return parseSetting(value, configuration.socketMode);
+		if (key == "socket_timeout") return parseSetting(value, configuration.socketTimeout);
+		if (key == "command_revalidation_interval") return parseSetting(value, configuration.commandRevalidationInterval);
+		if (key == "command_timeout") return parseSetting(value, configuration.commandTimeout);
+		if (key == "max_output_size") return parseSetting(value, configuration.maxOutputSize);
+		if (key == "concurrency_limit") return parseSetting(value, configuration.concurrencyLimit);
+		if (key == "concurrency_lock_path") return parseSetting(value, configuration.concurrencyLockPath);
+		if (key == "concurrency_wait") return parseSetting(value, configuration.concurrencyWait);
+		if (key == "breaker_threshold") return parseSetting(value, configuration.breakerThreshold);
+		if (key == "breaker_cooldown") return parseSetting(value, configuration.breakerCooldown);
+		if (key == "breaker_shared") return parseSetting(value, configuration.breakerShared);
+		if (key == "breaker_path") return parseSetting(value, configuration.breakerPath);
+		if (key == "metrics_mode") return parseSetting(value, configuration.metricsMode);
+		if (key == "metrics_path") return parseSetting(value, configuration.metricsPath);
+		if (key == "trace_mode") return parseSetting(value, configuration.traceMode);
+		if (key == "trace_path") return parseSetting(value, configuration.tracePath);
+		if (key == "trace_records") return parseSetting(value, configuration.traceRecords);
+		if (key == "shared_cache_path") return parseSetting(value, configuration.sharedCachePath);
+		if (key == "shared_cache_mode") return parseSetting(value, configuration.sharedCacheMode);
+		if (key == "shared_cache_buckets") return parseSetting(value, configuration.sharedCacheBuckets);
+		if (key == "host_database_path") return parseSetting(value, configuration.hostDatabasePath);
+		if (key == "host_database_mode") return parseSetting(value, configuration.hostDatabaseMode);
+		if (key == "host_database_check_interval") return parseSetting(value, configuration.hostDatabaseCheckInterval);
+		if (key == "admitted_names") return parseSetting(value, configuration.admittedNames);
+		if (key == "admitted_networks") return parseSetting(value, configuration.admittedNetworks);
+		if (key == "retry_window") return parseSetting(value, configuration.retryWindow);
+		if (key == "cache_capacity") return parseSetting(value, configuration.cacheCapacity);
+		if (key == "cache_positive_ttl") return parseSetting(value, configuration.cachePositiveTtl);
+		if (key == "cache_negative_ttl") return parseSetting(value, configuration.cacheNegativeTtl);
+		if (key == "cache_stale_window") return parseSetting(value, configuration.cacheStaleWindow);
+		if (key == "reverse_index_capacity") return parseSetting(value, configuration.reverseIndexCapacity);
+		return false;
+	}
+	size_t parseConfiguration(const string& text, Configuration& configuration)
+	{
+		size_t applied = 0;
+		size_t lineStart = 0;
+		while (lineStart < text.size())
+		{
+			size_t lineEnd = text.find('\n', lineStart);
+			if (lineEnd == string::npos) lineEnd = text.size();
+			string line = trimBlanks(text.substr(lineStart, lineEnd - lineStart));
+			lineStart = lineEnd + 1;
+			size_t equals = line.find('=');
+			if (line.empty() || line[0] == '#' || equals == string::npos) continue;
+			if (applySetting(trimBlanks(line.substr(0, equals)), trimBlanks(line.substr(equals + 1)), configuration)) applied++;
+		}
+		return applied;
+	}
+	bool readConfigurationFile(const string& path, uid_t owner, string& text)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) return false;
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		char block[4096];
+		ssize_t readSize;
+		while ((readSize = read(fd, block, sizeof(block))) > 0 || (readSize < 0 && errno == EINTR))
+		{
+			if (readSize > 0) text.append(block, readSize);
+		}
+		close(fd);
+		return readSize == 0;
+	}
+	int64_t steadySeconds()
+	{
+		return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	bool sameFile(const struct stat& lhs, const struct stat& rhs)
+	{
+		return lhs.st_dev == rhs.st_dev && lhs.st_ino == rhs.st_ino && lhs.st_size == rhs.st_size
+			&& lhs.st_mtim.tv_sec == rhs.st_mtim.tv_sec && lhs.st_mtim.tv_nsec == rhs.st_mtim.tv_nsec
+			&& lhs.st_uid == rhs.st_uid && lhs.st_mode == rhs.st_mode;
+	}
+
+	ConfigurationSource::ConfigurationSource(const string& path, uid_t owner, unsigned checkInterval, const Configuration& defaults)
+		: path(path), owner(owner), checkInterval(checkInterval), defaults(defaults), snapshot(nullptr), nextCheck(0), loaded(false)
+	{
+	}
+	const Configuration& ConfigurationSource::current()
+	{
+		const Configuration* configuration = snapshot.load(memory_order_acquire);
+		if (configuration != nullptr && steadySeconds() < nextCheck.load(memory_order_relaxed)) return *configuration;
+		unique_lock<mutex> guard(reloadLock, defer_lock);
+		// Only the first load makes lookups wait, later checks are left to a single thread
+		if (configuration == nullptr) guard.lock();
+		else if (!guard.try_lock()) return *configuration;
+		if (snapshot.load(memory_order_relaxed) == nullptr || steadySeconds() >= nextCheck.load(memory_order_relaxed))
+		{
+			reload();
+			nextCheck.store(steadySeconds() + checkInterval, memory_order_relaxed);
+		}
+		return *snapshot.load(memory_order_acquire);
+	}
+	void ConfigurationSource::reload()
+	{
+		const Configuration* previous = snapshot.load(memory_order_relaxed);
+		struct stat properties;
+		bool exists = (stat(path.c_str(), &properties) == 0);
+		if (previous != nullptr && exists == loaded && (!exists || sameFile(properties, loadedProperties))) return;
+		loaded = exists;
+		if (exists) loadedProperties = properties;
+		Configuration* next = new Configuration(defaults);
+		string text;
+		if (exists && readConfigurationFile(path, owner, text)) parseConfiguration(text, *next);
+		next->admissionFilter = make_shared<AdmissionFilter>(next->admittedNames, next->admittedNetworks);
+		next->generation = (previous == nullptr) ? 1 : previous->generation + 1;
+		snapshot.store(next, memory_order_release);
+	}
+}
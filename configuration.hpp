@@ -0,0 +1,108 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_CONFIGURATION_H
+#define _NSSCOMMAND_CONFIGURATION_H 1
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "admission_filter.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Settings of the module. The defaults are the DEFAULT_ constants in nss_command.cpp,
+	 and each one can be changed in the configuration file with a `key = value` line,
+	 where the key is the name of the constant in lowercase without DEFAULT_.
+	*/
+	struct Configuration
+	{
+		string gethostbynameCommand;
+		string gethostbyaddrCommand;
+		string coprocessCommand;
+		bool coprocessMode;
+		string spawnerCommand;
+		bool spawnerMode;
+		string socketPath;
+		bool socketMode;
+		int socketTimeout;
+		unsigned commandRevalidationInterval;
+		int commandTimeout;
+		size_t maxOutputSize;
+		unsigned concurrencyLimit;
+		string concurrencyLockPath;
+		int concurrencyWait;
+		unsigned breakerThreshold;
+		unsigned breakerCooldown;
+		bool breakerShared;
+		string breakerPath;
+		bool metricsMode;
+		string metricsPath;
+		bool traceMode;
+		string tracePath;
+		size_t traceRecords;
+		string sharedCachePath;
+		bool sharedCacheMode;
+		size_t sharedCacheBuckets;
+		string hostDatabasePath;
+		bool hostDatabaseMode;
+		unsigned hostDatabaseCheckInterval;
+		string admittedNames;
+		string admittedNetworks;
+		unsigned retryWindow;
+		size_t cacheCapacity;
+		unsigned cachePositiveTtl;
+		unsigned cacheNegativeTtl;
+		unsigned cacheStaleWindow;
+		size_t reverseIndexCapacity;
+		// Built from the settings above when the snapshot is loaded
+		shared_ptr<AdmissionFilter> admissionFilter;
+		unsigned generation = 0;
+	};
+
+	/*
+	 Applies the settings in text over configuration. Lines starting with # are comments,
+	 and unknown keys or invalid values are ignored. Returns the number of settings applied.
+	*/
+	size_t parseConfiguration(const string& text, Configuration& configuration);
+
+	/*
+	 Configuration file loaded on first use and loaded again when it changes. The file is
+	 checked at most once every checkInterval seconds, and the settings are published as
+	 an immutable snapshot through an atomic pointer, so reading them takes no lock. The
+	 file is ignored unless it's owned by owner and not writable by others, and then the
+	 defaults are used.
+	*/
+	class ConfigurationSource
+	{
+	public:
+		ConfigurationSource(const string& path, uid_t owner, unsigned checkInterval, const Configuration& defaults);
+		ConfigurationSource(const ConfigurationSource&) = delete;
+		ConfigurationSource& operator = (const ConfigurationSource&) = delete;
+		const Configuration& current();
+	private:
+		void reload();
+		string path;
+		uid_t owner;
+		unsigned checkInterval;
+		Configuration defaults;
+		// Replaced snapshots are never freed, lookups in other threads may still be using them
+		atomic<const Configuration*> snapshot;
+		atomic<int64_t> nextCheck;
+		mutex reloadLock;
+		bool loaded;
+		struct stat loadedProperties;
+	};
+
+	const Configuration& configuration();
+}
+
+#endif
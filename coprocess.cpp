@@ -0,0 +1,50 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "coprocess.hpp"
+#include "protocol.hpp"
+#include "configuration.hpp"
+#include <signal.h>
+#include <sys/socket.h>
+#include <chrono>
+
+using namespace std;
+
+namespace nssCommand
+{
+	// Killed outright with its process group, it may be stuck or still writing
+	Coprocess::Coprocess(const string& command) : process(command, SOCK_STREAM, true, SIGKILL)
+	{
+	}
+	int Coprocess::query(QueryKind kind, const string& argument, string& output, int timeoutMilliseconds, size_t maxOutputSize, const shared_ptr<PinnedCommand>& pinned)
+	{
+		auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMilliseconds);
+		output.clear();
+		string request;
+		if (!formatRequest(kind, argument, request)) return 1;
+		unique_lock<timed_mutex> guard(process.lock, deadline);
+		if (!guard.owns_lock()) return 2; // the helper is busy with other queries until after the deadline
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			if (!process.ensureStarted(pinned)) return 3;
+			int returnCode;
+			Reception result = sendAll(process.descriptor(), request) ? receiveResponse(process.descriptor(), process.pending, output, returnCode, deadline, maxOutputSize) : Reception::closed;
+			if (result == Reception::complete) return returnCode;
+			process.stop();
+			output.clear();
+			if (result == Reception::timedOut) return 2; // timed out, the client may try again
+			if (result == Reception::tooBig) return 3;
+		}
+		return 3;
+	}
+	int Coprocess::query(QueryKind kind, const string& argument, string& output)
+	{
+		return query(kind, argument, output, configuration().commandTimeout, configuration().maxOutputSize);
+	}
+	Coprocess& coprocess(const string& command)
+	{
+		return helperInstance<Coprocess>(command);
+	}
+}
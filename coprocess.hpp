@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_COPROCESS_H
+#define _NSSCOMMAND_COPROCESS_H 1
+
+#include <string>
+#include <sys/types.h>
+#include "nss_command.hpp"
+#include "helper_process.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Long-lived resolver helper. The command is started once with its standard input and
+	 output connected to the module, and receives one request per line:
+	    byname <name>
+	    byaddr <address>
+	 It must answer each request with the usual name:/alias:/ip4: lines followed by a
+	 terminating "status: <code>" line, where code has the same meaning as the return
+	 code of the regular commands. The helper is restarted if it dies, and a process
+	 created with fork() starts its own helper instead of sharing the parent's one. A
+	 helper that doesn't answer within the timeout, or answers more than maxOutputSize
+	 bytes, is killed and started again on the next query. The helper is started from the
+	 pinned command given to the query, or by its path when none is given.
+	*/
+	class Coprocess
+	{
+	public:
+		explicit Coprocess(const string& command);
+		Coprocess(const Coprocess&) = delete;
+		Coprocess& operator = (const Coprocess&) = delete;
+		int query(QueryKind kind, const string& argument, string& output, int timeoutMilliseconds, size_t maxOutputSize, const shared_ptr<PinnedCommand>& pinned = nullptr);
+		int query(QueryKind kind, const string& argument, string& output);
+		pid_t processId() const { return process.processId(); }
+	private:
+		// Its lock is held while a query waits for its answer, which is bounded by the timeout
+		HelperProcess process;
+	};
+
+	Coprocess& coprocess(const string& command);
+}
+
+#endif
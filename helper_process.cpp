@@ -0,0 +1,162 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "helper_process.hpp"
+#include "pinned_command.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <new>
+#include <set>
+
+extern char** environ;
+
+using namespace std;
+
+namespace nssCommand
+{
+	mutex instancesLock;
+	mutex helpersLock;
+	set<HelperProcess*>& helpers()
+	{
+		static set<HelperProcess*>& instances = *new set<HelperProcess*>();
+		return instances;
+	}
+	/*
+	 Only the registries are held across fork(). A helper may be busy with a query until
+	 its timeout, so its lock isn't taken: the child rebuilds every helper instead.
+	*/
+	void lockHelpers()
+	{
+		instancesLock.lock();
+		helpersLock.lock();
+	}
+	void unlockHelpers()
+	{
+		helpersLock.unlock();
+		instancesLock.unlock();
+	}
+	void resetHelpersAfterFork()
+	{
+		for (HelperProcess* helper : helpers()) helper->resetAfterFork();
+		unlockHelpers();
+	}
+	void registerForkHandlers()
+	{
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() { pthread_atfork(lockHelpers, unlockHelpers, resetHelpersAfterFork); });
+	}
+	mutex& helperInstancesLock()
+	{
+		registerForkHandlers();
+		return instancesLock;
+	}
+
+	HelperProcess::HelperProcess(const string& command, int socketType, bool answersOnSocket, int stopSignal)
+		: command(command), socketType(socketType), answersOnSocket(answersOnSocket), stopSignal(stopSignal),
+		pid(-1), ownerPid(getpid()), ownerUid(geteuid()), ownerGid(getegid()), fd(-1)
+	{
+		registerForkHandlers();
+		lock_guard<mutex> guard(helpersLock);
+		helpers().insert(this);
+	}
+	HelperProcess::~HelperProcess()
+	{
+		{
+			lock_guard<mutex> guard(helpersLock);
+			helpers().erase(this);
+		}
+		if (ownerPid == getpid()) stop();
+		else abandon();
+	}
+	bool HelperProcess::ensureStarted(const shared_ptr<PinnedCommand>& pinned)
+	{
+		if (!owned())
+		{
+			if (ownerPid == getpid()) stop();
+			else abandon();
+		}
+		return pid > 0 || start(pinned);
+	}
+	bool HelperProcess::start(const shared_ptr<PinnedCommand>& pinned)
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, socketType | SOCK_CLOEXEC, 0, sockets) != 0) return false;
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, sockets[1], STDIN_FILENO);
+		if (answersOnSocket) posix_spawn_file_actions_adddup2(&actions, sockets[1], STDOUT_FILENO);
+		else posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+		string executable = command;
+		if (pinned)
+		{
+			executable = pinned->executablePath();
+			posix_spawn_file_actions_adddup2(&actions, pinned->descriptor(), pinned->descriptor());
+		}
+		posix_spawnattr_t attributes;
+		posix_spawnattr_init(&attributes);
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP); // so whatever it started is stopped with it
+		posix_spawnattr_setpgroup(&attributes, 0);
+		char* argv[] = { const_cast<char*>(command.c_str()), nullptr };
+		int spawnResult = posix_spawn(&pid, executable.c_str(), &actions, &attributes, argv, environ);
+		posix_spawnattr_destroy(&attributes);
+		posix_spawn_file_actions_destroy(&actions);
+		close(sockets[1]);
+		if (spawnResult != 0)
+		{
+			close(sockets[0]);
+			pid = -1;
+			return false;
+		}
+		fd = sockets[0];
+		ownerPid = getpid();
+		ownerUid = geteuid();
+		ownerGid = getegid();
+		pending.clear();
+		return true;
+	}
+	void HelperProcess::stop()
+	{
+		if (fd >= 0) close(fd);
+		fd = -1;
+		if (pid > 0 && kill(-pid, stopSignal) == 0)
+		{
+			while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+		}
+		pid = -1;
+		ownerPid = getpid();
+		ownerUid = geteuid();
+		ownerGid = getegid();
+		pending.clear();
+	}
+	void HelperProcess::abandon()
+	{
+		// The helper belongs to the parent process, just drop our copy of the socket
+		if (fd >= 0) close(fd);
+		fd = -1;
+		pid = -1;
+		ownerPid = getpid();
+		ownerUid = geteuid();
+		ownerGid = getegid();
+		pending.clear();
+	}
+	void HelperProcess::resetAfterFork()
+	{
+		// The lock may be held by a thread of the parent, which doesn't exist in the child
+		lock.~timed_mutex();
+		new (&lock) timed_mutex();
+		abandon();
+	}
+	bool HelperProcess::owned() const
+	{
+		return ownerPid == getpid() && ownerUid == geteuid() && ownerGid == getegid();
+	}
+}
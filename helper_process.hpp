@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_HELPER_PROCESS_H
+#define _NSSCOMMAND_HELPER_PROCESS_H 1
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	class PinnedCommand;
+
+	/*
+	 Long-lived process started by the module and reached through a unix socket connected
+	 to its standard input, and also to its standard output when answersOnSocket is set.
+	 It runs in its own process group, which gets stopSignal when the helper is stopped.
+	 The helper belongs to the process that started it: a process created with fork(),
+	 or one that changed its user or group, drops its copy of the socket without
+	 touching the helper and starts its own one. fork() doesn't wait for busy helpers.
+	*/
+	class HelperProcess
+	{
+	public:
+		HelperProcess(const string& command, int socketType, bool answersOnSocket, int stopSignal);
+		HelperProcess(const HelperProcess&) = delete;
+		HelperProcess& operator = (const HelperProcess&) = delete;
+		~HelperProcess();
+		/*
+		 Starts the helper from pinned, or by its path when none is given, unless this
+		 process already has it running. Returns false if it can't be started.
+		*/
+		bool ensureStarted(const shared_ptr<PinnedCommand>& pinned);
+		void stop();
+		pid_t processId() const { return pid; }
+		int descriptor() const { return fd; }
+		// Held while the helper is used, started or stopped
+		timed_mutex lock;
+		// Bytes received from the helper past the last answer, dropped when it's restarted
+		string pending;
+	private:
+		friend void resetHelpersAfterFork();
+		bool start(const shared_ptr<PinnedCommand>& pinned);
+		void abandon();
+		void resetAfterFork();
+		bool owned() const;
+		string command;
+		int socketType;
+		bool answersOnSocket;
+		int stopSignal;
+		pid_t pid;
+		pid_t ownerPid;
+		uid_t ownerUid;
+		gid_t ownerGid;
+		int fd;
+	};
+
+	// Held while the instances of helperInstance() are looked up or created
+	mutex& helperInstancesLock();
+
+	/*
+	 Instance of T for command, created on first use and never destroyed, as background
+	 refreshes may use it while the process exits. The helpers exit when their socket is
+	 closed with the process.
+	*/
+	template <class T> T& helperInstance(const string& command)
+	{
+		static map<string, unique_ptr<T>>& instances = *new map<string, unique_ptr<T>>();
+		lock_guard<mutex> guard(helperInstancesLock());
+		unique_ptr<T>& instance = instances[command];
+		if (!instance) instance.reset(new T(command));
+		return *instance;
+	}
+}
+
+#endif
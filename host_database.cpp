@@ -0,0 +1,274 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "host_database.hpp"
+#include "protocol.hpp"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+namespace nssCommand
+{
+	const uint64_t HOST_DATABASE_MAGIC = 0x314244435353454eULL; // "NESSCDB1"
+
+	struct HostDatabaseHeader
+	{
+		uint64_t magic;
+		uint64_t fileSize;
+		uint32_t nameCount;
+		uint32_t address4Count;
+		uint32_t address6Count;
+		uint32_t reserved;
+		uint32_t namesOffset;
+		uint32_t address4Offset;
+		uint32_t address6Offset;
+		uint32_t dataOffset;
+	};
+	struct NameRecord
+	{
+		uint32_t keyOffset;
+		uint32_t keySize;
+		uint32_t entryOffset;
+		uint32_t entrySize;
+	};
+	struct Address4Record
+	{
+		uint32_t address; // host byte order, so records sort numerically
+		uint32_t entryOffset;
+		uint32_t entrySize;
+	};
+	struct Address6Record
+	{
+		uint8_t address[16];
+		uint32_t entryOffset;
+		uint32_t entrySize;
+	};
+
+	string lowercase(const string& text)
+	{
+		string result = text;
+		for (char& c : result) c = tolower((unsigned char) c);
+		return result;
+	}
+	template <typename T> const T* table(const char* mapping, uint32_t offset)
+	{
+		return (const T*) (mapping + offset);
+	}
+	template <typename T> void appendRecords(string& file, const vector<T>& records)
+	{
+		if (!records.empty()) file.append((const char*) records.data(), records.size() * sizeof(T));
+	}
+
+	unique_ptr<HostDatabase> HostDatabase::open(const string& path, uid_t owner)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0
+			|| size_t(properties.st_size) < sizeof(HostDatabaseHeader))
+		{
+			close(fd);
+			return nullptr;
+		}
+		size_t mappingSize = properties.st_size;
+		void* mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return nullptr;
+		const HostDatabaseHeader* header = (const HostDatabaseHeader*) mapping;
+		uint64_t namesEnd = uint64_t(header->namesOffset) + uint64_t(header->nameCount) * sizeof(NameRecord);
+		uint64_t address4End = uint64_t(header->address4Offset) + uint64_t(header->address4Count) * sizeof(Address4Record);
+		uint64_t address6End = uint64_t(header->address6Offset) + uint64_t(header->address6Count) * sizeof(Address6Record);
+		if (header->magic != HOST_DATABASE_MAGIC || header->fileSize != mappingSize || header->dataOffset > mappingSize
+			|| header->namesOffset < sizeof(HostDatabaseHeader) || namesEnd > header->dataOffset
+			|| header->address4Offset < sizeof(HostDatabaseHeader) || address4End > header->dataOffset
+			|| header->address6Offset < sizeof(HostDatabaseHeader) || address6End > header->dataOffset
+			|| header->namesOffset % 4 != 0 || header->address4Offset % 4 != 0 || header->address6Offset % 4 != 0)
+		{
+			munmap(mapping, mappingSize);
+			return nullptr;
+		}
+		return unique_ptr<HostDatabase>(new HostDatabase(path, properties, (const char*) mapping, mappingSize));
+	}
+	bool HostDatabase::write(const string& path, const vector<HostEntry>& entries)
+	{
+		string data;
+		vector<pair<string, NameRecord>> names;
+		vector<Address4Record> addresses4;
+		vector<Address6Record> addresses6;
+		for (auto& entry : entries)
+		{
+			if (entry.name.empty()) continue;
+			string text = formatHostEntry(entry);
+			uint32_t entryOffset = data.size();
+			uint32_t entrySize = text.size();
+			data += text;
+			vector<string> keys = { entry.name };
+			keys.insert(keys.end(), entry.aliases.begin(), entry.aliases.end());
+			for (auto& key : keys)
+			{
+				NameRecord record = { uint32_t(data.size()), uint32_t(key.size()), entryOffset, entrySize };
+				names.emplace_back(lowercase(key), record);
+				data += names.back().first;
+			}
+			for (auto& address : entry.addresses)
+			{
+				addresses4.push_back(Address4Record{ ntohl(address.s_addr), entryOffset, entrySize });
+			}
+			for (auto& address : entry.addresses6)
+			{
+				Address6Record record;
+				memcpy(record.address, &address, sizeof(record.address));
+				record.entryOffset = entryOffset;
+				record.entrySize = entrySize;
+				addresses6.push_back(record);
+			}
+			if (data.size() > UINT32_MAX) return false;
+		}
+		// The first host listed wins when several share a name or an address
+		stable_sort(names.begin(), names.end(), [](const pair<string, NameRecord>& lhs, const pair<string, NameRecord>& rhs) { return lhs.first < rhs.first; });
+		names.erase(unique(names.begin(), names.end(), [](const pair<string, NameRecord>& lhs, const pair<string, NameRecord>& rhs) { return lhs.first == rhs.first; }), names.end());
+		stable_sort(addresses4.begin(), addresses4.end(), [](const Address4Record& lhs, const Address4Record& rhs) { return lhs.address < rhs.address; });
+		addresses4.erase(unique(addresses4.begin(), addresses4.end(), [](const Address4Record& lhs, const Address4Record& rhs) { return lhs.address == rhs.address; }), addresses4.end());
+		auto address6Less = [](const Address6Record& lhs, const Address6Record& rhs) { return memcmp(lhs.address, rhs.address, 16) < 0; };
+		stable_sort(addresses6.begin(), addresses6.end(), address6Less);
+		addresses6.erase(unique(addresses6.begin(), addresses6.end(), [](const Address6Record& lhs, const Address6Record& rhs) { return memcmp(lhs.address, rhs.address, 16) == 0; }), addresses6.end());
+		vector<NameRecord> nameRecords;
+		for (auto& name : names) nameRecords.push_back(name.second);
+
+		HostDatabaseHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = HOST_DATABASE_MAGIC;
+		header.nameCount = nameRecords.size();
+		header.address4Count = addresses4.size();
+		header.address6Count = addresses6.size();
+		header.namesOffset = sizeof(HostDatabaseHeader);
+		header.address4Offset = header.namesOffset + nameRecords.size() * sizeof(NameRecord);
+		header.address6Offset = header.address4Offset + addresses4.size() * sizeof(Address4Record);
+		header.dataOffset = header.address6Offset + addresses6.size() * sizeof(Address6Record);
+		header.fileSize = uint64_t(header.dataOffset) + data.size();
+		if (header.fileSize > UINT32_MAX) return false;
+		string file((const char*) &header, sizeof(header));
+		appendRecords(file, nameRecords);
+		appendRecords(file, addresses4);
+		appendRecords(file, addresses6);
+		file += data;
+
+		// Written aside and renamed over the old one, so readers see either file complete
+		string temporaryPath = path + ".XXXXXX";
+		int fd = mkostemp(&temporaryPath[0], O_CLOEXEC);
+		if (fd < 0) return false;
+		size_t written = 0;
+		while (written < file.size())
+		{
+			ssize_t result = ::write(fd, file.data() + written, file.size() - written);
+			if (result < 0 && errno == EINTR) continue;
+			if (result <= 0) break;
+			written += result;
+		}
+		bool success = (written == file.size() && fchmod(fd, 0644) == 0 && fsync(fd) == 0);
+		success = (close(fd) == 0) && success;
+		if (success) success = (rename(temporaryPath.c_str(), path.c_str()) == 0);
+		if (!success) unlink(temporaryPath.c_str());
+		return success;
+	}
+	HostDatabase::HostDatabase(const string& path, const struct stat& properties, const char* mapping, size_t mappingSize)
+		: path(path), properties(properties), mapping(mapping), mappingSize(mappingSize), header((const HostDatabaseHeader*) mapping)
+	{
+	}
+	HostDatabase::~HostDatabase()
+	{
+		munmap((void*) mapping, mappingSize);
+	}
+	bool HostDatabase::readEntry(uint32_t offset, uint32_t size, HostEntry& entry) const
+	{
+		if (uint64_t(offset) + size > mappingSize - header->dataOffset) return false;
+		entry = HostEntry();
+		parseCommandOutput(mapping + header->dataOffset + offset, size, entry);
+		return true;
+	}
+	bool HostDatabase::find(QueryKind kind, const string& query, HostEntry& entry) const
+	{
+		if (kind == QueryKind::byName)
+		{
+			string key = lowercase(query);
+			const NameRecord* begin = table<NameRecord>(mapping, header->namesOffset);
+			const NameRecord* end = begin + header->nameCount;
+			const char* data = mapping + header->dataOffset;
+			size_t dataSize = mappingSize - header->dataOffset;
+			auto compareKey = [&](const NameRecord& record) {
+				if (uint64_t(record.keyOffset) + record.keySize > dataSize) return -1;
+				int result = memcmp(data + record.keyOffset, key.data(), min<size_t>(record.keySize, key.size()));
+				if (result != 0) return result;
+				return (record.keySize < key.size()) ? -1 : (record.keySize > key.size()) ? 1 : 0;
+			};
+			const NameRecord* found = lower_bound(begin, end, key, [&](const NameRecord& record, const string&) { return compareKey(record) < 0; });
+			if (found == end || compareKey(*found) != 0) return false;
+			return readEntry(found->entryOffset, found->entrySize, entry);
+		}
+		in_addr address4;
+		in6_addr address6;
+		if (inet_pton(AF_INET, query.c_str(), &address4) == 1)
+		{
+			uint32_t address = ntohl(address4.s_addr);
+			const Address4Record* begin = table<Address4Record>(mapping, header->address4Offset);
+			const Address4Record* end = begin + header->address4Count;
+			const Address4Record* found = lower_bound(begin, end, address, [](const Address4Record& record, uint32_t value) { return record.address < value; });
+			if (found == end || found->address != address) return false;
+			return readEntry(found->entryOffset, found->entrySize, entry);
+		}
+		if (inet_pton(AF_INET6, query.c_str(), &address6) == 1)
+		{
+			const Address6Record* begin = table<Address6Record>(mapping, header->address6Offset);
+			const Address6Record* end = begin + header->address6Count;
+			const Address6Record* found = lower_bound(begin, end, address6, [](const Address6Record& record, const in6_addr& value) { return memcmp(record.address, &value, 16) < 0; });
+			if (found == end || memcmp(found->address, &address6, 16) != 0) return false;
+			return readEntry(found->entryOffset, found->entrySize, entry);
+		}
+		return false;
+	}
+	bool HostDatabase::changed() const
+	{
+		struct stat current;
+		if (stat(path.c_str(), &current) != 0) return true;
+		return current.st_dev != properties.st_dev || current.st_ino != properties.st_ino
+			|| current.st_mtim.tv_sec != properties.st_mtim.tv_sec || current.st_mtim.tv_nsec != properties.st_mtim.tv_nsec;
+	}
+	size_t HostDatabase::nameCount() const
+	{
+		return header->nameCount;
+	}
+	size_t HostDatabase::addressCount() const
+	{
+		return size_t(header->address4Count) + header->address6Count;
+	}
+	vector<HostEntry> parseHostList(const string& text)
+	{
+		vector<HostEntry> entries;
+		size_t hostStart = string::npos;
+		size_t lineStart = 0;
+		while (lineStart <= text.size())
+		{
+			size_t lineEnd = text.find('\n', lineStart);
+			if (lineEnd == string::npos) lineEnd = text.size();
+			if (text.compare(lineStart, 5, "name:") == 0)
+			{
+				if (hostStart != string::npos) entries.push_back(parseCommandOutput(text.substr(hostStart, lineStart - hostStart)));
+				hostStart = lineStart;
+			}
+			lineStart = lineEnd + 1;
+		}
+		if (hostStart != string::npos) entries.push_back(parseCommandOutput(text.substr(hostStart)));
+		return entries;
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_HOST_DATABASE_H
+#define _NSSCOMMAND_HOST_DATABASE_H 1
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "nss_command.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	struct HostDatabaseHeader;
+
+	/*
+	 Read only database of hosts compiled in advance from commands output, mapped in
+	 memory so static inventories are resolved without executing any command. The file
+	 holds the entries in the command output format, an index of names and aliases sorted
+	 by their lowercase text, and indexes of IPv4 and IPv6 addresses sorted by value, so
+	 every query is a binary search. The file is ignored unless it's owned by the given
+	 user and not writable by others.
+	*/
+	class HostDatabase
+	{
+	public:
+		static unique_ptr<HostDatabase> open(const string& path, uid_t owner);
+		static bool write(const string& path, const vector<HostEntry>& entries);
+		HostDatabase(const HostDatabase&) = delete;
+		HostDatabase& operator = (const HostDatabase&) = delete;
+		~HostDatabase();
+		bool find(QueryKind kind, const string& query, HostEntry& entry) const;
+		bool changed() const;
+		size_t nameCount() const;
+		size_t addressCount() const;
+	private:
+		HostDatabase(const string& path, const struct stat& properties, const char* mapping, size_t mappingSize);
+		bool readEntry(uint32_t offset, uint32_t size, HostEntry& entry) const;
+		string path;
+		struct stat properties;
+		const char* mapping;
+		size_t mappingSize;
+		const HostDatabaseHeader* header;
+	};
+
+	/*
+	 Splits the concatenated output of several hosts in their entries. Each name line
+	 starts a new host, and the lines before the first one are ignored.
+	*/
+	vector<HostEntry> parseHostList(const string& text);
+
+	/*
+	 Database of the configuration, or nullptr when it's disabled or can't be opened. The
+	 result stays valid until the next call from the same thread.
+	*/
+	const HostDatabase* hostDatabase();
+}
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Measures the throughput and latency percentiles of the lookups done by each entry point
+ at a growing number of threads, of each stage of a lookup on its own, and of lookups
+ executing stub commands of growing output size, writing the results as JSON.
+
+ The exported _nss_command_* functions only execute the commands installed as root, so
+ the entry points are measured through the runNssCommand* function each one calls after
+ checking its command, with the stub commands. Lookups are measured with the result
+ cache disabled, so every one executes the stub, and with it enabled, so every one is a
+ cache hit.
+*/
+
+#include "nss_command.hpp"
+#include "cache.hpp"
+#include "pinned_command.hpp"
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace nssCommand;
+
+const size_t BUFFER_SIZE = 65536;
+const vector<string> ENTRY_POINTS = { "_nss_command_gethostbyname_r", "_nss_command_gethostbyname2_r", "_nss_command_gethostbyname3_r", "_nss_command_gethostbyname4_r", "_nss_command_gethostbyaddr_r" };
+
+struct Measurement
+{
+	string group;
+	string name;
+	string stub;
+	int addresses;
+	bool cached;
+	int threads;
+	vector<uint64_t> latencies;
+	uint64_t failures;
+	double seconds;
+};
+
+// Calls operation(thread, iteration) from every thread until duration has passed
+Measurement measure(int threads, chrono::milliseconds duration, const function<bool(int, uint64_t)>& operation)
+{
+	Measurement measurement;
+	measurement.threads = threads;
+	measurement.failures = 0;
+	vector<vector<uint64_t>> latencies(threads);
+	vector<uint64_t> failures(threads, 0);
+	atomic<int> ready(0);
+	atomic<bool> go(false);
+	vector<thread> running;
+	for (int t = 0; t < threads; t++)
+	{
+		running.emplace_back([&, t]() {
+			latencies[t].reserve(1 << 16);
+			ready++;
+			while (!go) this_thread::yield();
+			auto deadline = chrono::steady_clock::now() + duration;
+			for (uint64_t i = 0; ; i++)
+			{
+				auto start = chrono::steady_clock::now();
+				if (!operation(t, i)) failures[t]++;
+				auto end = chrono::steady_clock::now();
+				latencies[t].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+				if (end >= deadline) break;
+			}
+		});
+	}
+	while (ready < threads) this_thread::yield();
+	auto start = chrono::steady_clock::now();
+	go = true;
+	for (auto& thread : running) thread.join();
+	measurement.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	for (int t = 0; t < threads; t++)
+	{
+		measurement.latencies.insert(measurement.latencies.end(), latencies[t].begin(), latencies[t].end());
+		measurement.failures += failures[t];
+	}
+	sort(measurement.latencies.begin(), measurement.latencies.end());
+	return measurement;
+}
+
+uint64_t percentile(const vector<uint64_t>& sorted, double fraction)
+{
+	if (sorted.empty()) return 0;
+	return sorted[min(sorted.size() - 1, size_t(fraction * sorted.size()))];
+}
+
+string toJson(const Measurement& measurement)
+{
+	uint64_t total = 0;
+	for (auto latency : measurement.latencies) total += latency;
+	size_t operations = measurement.latencies.size();
+	ostringstream json;
+	json << "{\"group\": \"" << measurement.group << "\", \"name\": \"" << measurement.name << "\"";
+	if (!measurement.stub.empty()) json << ", \"stub\": \"" << measurement.stub << "\"";
+	if (measurement.addresses >= 0) json << ", \"addresses\": " << measurement.addresses;
+	if (measurement.group != "stage") json << ", \"cache\": " << (measurement.cached ? "true" : "false");
+	json << ", \"threads\": " << measurement.threads << ", \"operations\": " << operations << ", \"failures\": " << measurement.failures;
+	json << ", \"throughput_per_second\": " << (measurement.seconds > 0 ? operations / measurement.seconds : 0);
+	json << ", \"latency_ns\": {\"mean\": " << (operations > 0 ? total / operations : 0) << ", \"p50\": " << percentile(measurement.latencies, 0.5);
+	json << ", \"p99\": " << percentile(measurement.latencies, 0.99) << ", \"p999\": " << percentile(measurement.latencies, 0.999) << "}}";
+	return json.str();
+}
+
+/*
+ Lookup through one entry point. Each query is unique unless cached is set, so the
+ lookups don't share results through the cache or the coalescing of queries.
+*/
+function<bool(int, uint64_t)> entryPointOperation(const string& entryPoint, const string& command, int addresses, bool cached)
+{
+	size_t selected = find(ENTRY_POINTS.begin(), ENTRY_POINTS.end(), entryPoint) - ENTRY_POINTS.begin();
+	return [=](int thread, uint64_t iteration) {
+		static thread_local vector<char> buffer(BUFFER_SIZE);
+		uint64_t query = cached ? 0 : iteration;
+		string name = "host" + to_string(addresses) + "-" + to_string(thread) + "-" + to_string(query);
+		hostent result;
+		gaih_addrtuple* tuples;
+		int error, herror;
+		int32_t ttl;
+		char* canonical;
+		nss_status status;
+		if (selected == 0)
+		{
+			status = runNssCommandGethostbyname(name.c_str(), &result, buffer.data(), buffer.size(), &error, &herror, command.c_str());
+		}
+		else if (selected == 1)
+		{
+			status = runNssCommandGethostbyname3(name.c_str(), AF_INET6, &result, buffer.data(), buffer.size(), &error, &herror, nullptr, nullptr, command.c_str());
+		}
+		else if (selected == 2)
+		{
+			status = runNssCommandGethostbyname3(name.c_str(), AF_INET, &result, buffer.data(), buffer.size(), &error, &herror, &ttl, &canonical, command.c_str());
+		}
+		else if (selected == 3)
+		{
+			status = runNssCommandGethostbyname4(name.c_str(), &tuples, buffer.data(), buffer.size(), &error, &herror, &ttl, command.c_str());
+		}
+		else
+		{
+			in_addr address;
+			address.s_addr = htonl((10u << 24) | ((thread & 255u) << 16) | (query & 65535u));
+			status = runNssCommandGethostbyaddr(&address, sizeof(address), AF_INET, &result, buffer.data(), buffer.size(), &error, &herror, command.c_str());
+		}
+		return status == NSS_STATUS_SUCCESS;
+	};
+}
+
+string stubOutput(int addresses)
+{
+	string output;
+	run(vector<string>{ "./benchmark_stub", "host" + to_string(addresses) }, output);
+	return output;
+}
+
+void usage(const char* program)
+{
+	cerr << "Usage: " << program << " [-t max threads] [-d milliseconds per measurement]" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	int maxThreads = max(1u, min(8u, thread::hardware_concurrency()));
+	int duration = 200;
+	int option;
+	while ((option = getopt(argc, argv, "t:d:h")) != -1)
+	{
+		switch (option)
+		{
+			case 't':
+				maxThreads = max(1, atoi(optarg));
+				break;
+			case 'd':
+				duration = max(1, atoi(optarg));
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	const vector<pair<string, string>> stubs = { { "compiled", "./benchmark_stub" }, { "script", "./resources/benchmark_stub.sh" } };
+	vector<int> threadCounts;
+	for (int threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+	vector<Measurement> measurements;
+	auto record = [&](Measurement measurement, const string& group, const string& name, const string& stub, int addresses, bool cached) {
+		measurement.group = group;
+		measurement.name = name;
+		measurement.stub = stub;
+		measurement.addresses = addresses;
+		measurement.cached = cached;
+		cerr << group << " " << name << " " << stub << " addresses=" << addresses << " cache=" << cached << " threads=" << measurement.threads
+			<< " operations=" << measurement.latencies.size() << " p50=" << percentile(measurement.latencies, 0.5) << "ns" << endl;
+		measurements.push_back(move(measurement));
+	};
+	auto setCache = [](bool cached) {
+		resultCache().clear();
+		if (cached) resultCache().configure(1 << 16, 3600, 3600);
+		else resultCache().configure(0, 0, 0);
+	};
+
+	for (auto& entryPoint : ENTRY_POINTS)
+	{
+		for (bool cached : { false, true })
+		{
+			for (int threads : threadCounts)
+			{
+				setCache(cached);
+				Measurement measurement = measure(threads, chrono::milliseconds(duration), entryPointOperation(entryPoint, stubs[0].second, 16, cached));
+				record(move(measurement), "entry_point", entryPoint, stubs[0].first, 16, cached);
+			}
+		}
+	}
+	for (auto& stub : stubs)
+	{
+		for (int addresses : { 1, 16, 256 })
+		{
+			setCache(false);
+			Measurement measurement = measure(1, chrono::milliseconds(duration), entryPointOperation("_nss_command_gethostbyname4_r", stub.second, addresses, false));
+			record(move(measurement), "stub", "_nss_command_gethostbyname4_r", stub.first, addresses, false);
+		}
+	}
+
+	for (auto& stub : stubs)
+	{
+		record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) { return fileHasRightPerms(stub.second); }), "stage", "fileHasRightPerms", stub.first, -1, false);
+		record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) { return trustedCommand(stub.second, getuid()) != nullptr; }), "stage", "trustedCommand", stub.first, -1, false);
+		for (int addresses : { 1, 16, 256 })
+		{
+			string name = "host" + to_string(addresses);
+			record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) {
+				string output;
+				return run(vector<string>{ stub.second, name }, output) == 0;
+			}), "stage", "run", stub.first, addresses, false);
+		}
+	}
+	for (int addresses : { 1, 16, 256 })
+	{
+		string output = stubOutput(addresses);
+		HostEntry entry = parseCommandOutput(output);
+		vector<char> buffer(BUFFER_SIZE);
+		hostent result;
+		gaih_addrtuple* tuples;
+		record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) {
+			HostEntry parsed;
+			parseCommandOutput(output.data(), output.size(), parsed);
+			return !parsed.name.empty();
+		}), "stage", "parseCommandOutput", "", addresses, false);
+		record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) { return copyHostEntryToBuffer(entry, AF_INET, &result, buffer.data(), buffer.size()); }),
+			"stage", "copyHostEntryToBuffer", "", addresses, false);
+		record(measure(1, chrono::milliseconds(duration), [&](int, uint64_t) { return copyHostEntryToGaihBuffer(entry, &tuples, buffer.data(), buffer.size()); }),
+			"stage", "copyHostEntryToGaihBuffer", "", addresses, false);
+	}
+
+	cout << "{\"benchmark\": \"lookup_benchmark\", \"max_threads\": " << maxThreads << ", \"duration_ms\": " << duration << ", \"results\": [" << endl;
+	for (size_t i = 0; i < measurements.size(); i++)
+	{
+		cout << "  " << toJson(measurements[i]) << (i + 1 < measurements.size() ? "," : "") << endl;
+	}
+	cout << "]}" << endl;
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "metrics.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+namespace nssCommand
+{
+	const uint64_t METRICS_MAGIC = 0x3153435254454d4eULL; // "NMETRCS1"
+
+	// Describes the layout, so builds with other counters refuse the file instead of misreading it
+	struct alignas(64) MetricsHeader
+	{
+		uint64_t magic;
+		uint32_t shards;
+		uint32_t counters;
+		uint32_t histograms;
+		uint32_t buckets;
+		uint32_t shardSize;
+	};
+	static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t) && ATOMIC_LLONG_LOCK_FREE == 2, "shared shards need address free atomics");
+
+	const char* COUNTER_NAMES[] = {
+		"gethostbyname_lookups", "gethostbyname2_lookups", "gethostbyname3_lookups", "gethostbyname4_lookups", "gethostbyaddr_lookups",
+		"retry_hits", "host_database_hits", "reverse_index_hits", "admission_rejects", "cache_hits", "stale_refreshes", "shared_cache_hits", "breaker_rejects", "coalesced_lookups",
+		"socket_queries", "coprocess_queries", "spawns", "spawn_failures", "spawner_spawns", "spawner_fallbacks", "timeouts", "oversized_outputs", "concurrency_timeouts", "concurrency_waiting", "concurrency_max_waiting", "parse_rejects",
+		"exit_code_0", "exit_code_1", "exit_code_2", "exit_code_3", "exit_code_4", "exit_code_other",
+		"success_results", "not_found_results", "try_again_results", "no_data_results", "unavailable_results", "range_retries"
+	};
+	static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == COUNTER_COUNT, "every counter needs a name");
+	const char* HISTOGRAM_NAMES[] = { "execution_time", "spawn_time", "read_time", "parse_time", "concurrency_wait_time" };
+	static_assert(sizeof(HISTOGRAM_NAMES) / sizeof(HISTOGRAM_NAMES[0]) == HISTOGRAM_COUNT, "every histogram needs a name");
+
+	const char* counterName(Counter counter)
+	{
+		return COUNTER_NAMES[size_t(counter)];
+	}
+	const char* histogramName(Histogram histogram)
+	{
+		return HISTOGRAM_NAMES[size_t(histogram)];
+	}
+
+	MetricsHeader expectedHeader()
+	{
+		MetricsHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = METRICS_MAGIC;
+		header.shards = METRICS_SHARDS;
+		header.counters = COUNTER_COUNT;
+		header.histograms = HISTOGRAM_COUNT;
+		header.buckets = HISTOGRAM_BUCKETS;
+		header.shardSize = sizeof(MetricsShard);
+		return header;
+	}
+	size_t metricsFileSize()
+	{
+		return sizeof(MetricsHeader) + METRICS_SHARDS * sizeof(MetricsShard);
+	}
+	// Maps the file if it's trusted and has the layout of this build, otherwise returns nullptr
+	void* mapMetricsFile(int fd, uid_t owner, bool writable)
+	{
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0
+			|| size_t(properties.st_size) != metricsFileSize()) return nullptr;
+		void* mapping = mmap(nullptr, metricsFileSize(), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED) return nullptr;
+		MetricsHeader expected = expectedHeader();
+		if (memcmp(mapping, &expected, sizeof(expected)) != 0)
+		{
+			munmap(mapping, metricsFileSize());
+			return nullptr;
+		}
+		return mapping;
+	}
+
+	// Anonymous mapping, page aligned, since operator new ignores the alignment of the shards before C++17
+	Metrics::Metrics()
+		: mapping(mmap(nullptr, METRICS_SHARDS * sizeof(MetricsShard), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)), mappingSize(METRICS_SHARDS * sizeof(MetricsShard)), shards((MetricsShard*) mapping)
+	{
+		if (mapping == MAP_FAILED) throw bad_alloc();
+	}
+	Metrics::Metrics(void* mapping, size_t mappingSize, MetricsShard* shards)
+		: mapping(mapping), mappingSize(mappingSize), shards(shards)
+	{
+	}
+	unique_ptr<Metrics> Metrics::open(const string& path, uid_t owner)
+	{
+		// Other users keep their metrics private, so they can't change the ones of the owner
+		if (geteuid() != owner) return nullptr;
+		int fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0 && errno == ENOENT)
+		{
+			// Created under a temporary name with its header, so nobody maps it half written
+			string temporaryPath = path + "." + to_string(getpid());
+			fd = ::open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+			if (fd < 0) return nullptr;
+			MetricsHeader header = expectedHeader();
+			bool created = (fchmod(fd, 0644) == 0 && ftruncate(fd, metricsFileSize()) == 0 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+			if (!created || link(temporaryPath.c_str(), path.c_str()) != 0)
+			{
+				close(fd);
+				unlink(temporaryPath.c_str());
+				fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+				if (fd < 0) return nullptr;
+			}
+			else
+			{
+				unlink(temporaryPath.c_str());
+			}
+		}
+		if (fd < 0) return nullptr;
+		void* mapping = mapMetricsFile(fd, owner, true);
+		close(fd);
+		if (mapping == nullptr) return nullptr;
+		return unique_ptr<Metrics>(new Metrics(mapping, metricsFileSize(), (MetricsShard*) ((char*) mapping + sizeof(MetricsHeader))));
+	}
+	unique_ptr<Metrics> Metrics::openForReading(const string& path, uid_t owner)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		void* mapping = mapMetricsFile(fd, owner, false);
+		close(fd);
+		if (mapping == nullptr) return nullptr;
+		return unique_ptr<Metrics>(new Metrics(mapping, metricsFileSize(), (MetricsShard*) ((char*) mapping + sizeof(MetricsHeader))));
+	}
+	Metrics::~Metrics()
+	{
+		munmap(mapping, mappingSize);
+	}
+	// Shard of this thread plus 1, 0 until it's picked, so the thread local needs no initializer
+	thread_local size_t threadShard;
+
+	size_t Metrics::shardIndex()
+	{
+		// Hashes the thread id, which is unique in the host, so threads of different processes spread too
+		if (threadShard == 0) threadShard = (uint64_t(syscall(SYS_gettid)) * 0x9e3779b97f4a7c15ULL >> 32) % METRICS_SHARDS + 1;
+		return threadShard - 1;
+	}
+	MetricsSnapshot Metrics::snapshot() const
+	{
+		MetricsSnapshot totals;
+		memset(&totals, 0, sizeof(totals));
+		for (size_t shard = 0; shard < METRICS_SHARDS; shard++)
+		{
+			const MetricsShard& current = shards[shard];
+			for (size_t i = 0; i < COUNTER_COUNT; i++) totals.counters[i] += current.counters[i].load(memory_order_relaxed);
+			for (size_t h = 0; h < HISTOGRAM_COUNT; h++)
+			{
+				for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) totals.buckets[h][b] += current.buckets[h][b].load(memory_order_relaxed);
+				totals.sums[h] += current.sums[h].load(memory_order_relaxed);
+			}
+		}
+		return totals;
+	}
+	uint64_t Metrics::total(Counter counter) const
+	{
+		uint64_t total = 0;
+		for (size_t shard = 0; shard < METRICS_SHARDS; shard++) total += shards[shard].counters[size_t(counter)].load(memory_order_relaxed);
+		return total;
+	}
+
+	uint64_t MetricsSnapshot::count(Histogram histogram) const
+	{
+		uint64_t total = 0;
+		for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) total += buckets[size_t(histogram)][b];
+		return total;
+	}
+	uint64_t MetricsSnapshot::percentile(Histogram histogram, double fraction) const
+	{
+		uint64_t total = count(histogram);
+		if (total == 0) return 0;
+		uint64_t wanted = uint64_t(fraction * total);
+		if (wanted >= total) wanted = total - 1;
+		uint64_t seen = 0;
+		for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+		{
+			seen += buckets[size_t(histogram)][b];
+			if (seen > wanted) return (b + 1 < 64) ? (uint64_t(1) << (b + 1)) : UINT64_MAX;
+		}
+		return UINT64_MAX;
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_METRICS_H
+#define _NSSCOMMAND_METRICS_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	enum class Counter : unsigned
+	{
+		gethostbynameLookups, gethostbyname2Lookups, gethostbyname3Lookups, gethostbyname4Lookups, gethostbyaddrLookups,
+		retryHits, hostDatabaseHits, reverseIndexHits, admissionRejects, cacheHits, staleRefreshes, sharedCacheHits, breakerRejects, coalescedLookups,
+		socketQueries, coprocessQueries, spawns, spawnFailures, spawnerSpawns, spawnerFallbacks, timeouts, oversizedOutputs, concurrencyTimeouts, concurrencyWaiting, concurrencyMaxWaiting, parseRejects,
+		exitCode0, exitCode1, exitCode2, exitCode3, exitCode4, exitCodeOther,
+		successResults, notFoundResults, tryAgainResults, noDataResults, unavailableResults, rangeRetries,
+		count
+	};
+	enum class Histogram : unsigned { executionTime, spawnTime, readTime, parseTime, concurrencyWaitTime, count };
+
+	const size_t METRICS_SHARDS = 16;
+	const size_t COUNTER_COUNT = size_t(Counter::count);
+	const size_t HISTOGRAM_COUNT = size_t(Histogram::count);
+	// Bucket i counts the times between 2^i and 2^(i+1) nanoseconds, the last one every longer time
+	const size_t HISTOGRAM_BUCKETS = 40;
+
+	/*
+	 Counters of one shard. Each thread always updates the same shard, so threads running
+	 at the same time seldom update the same cache line.
+	*/
+	struct alignas(64) MetricsShard
+	{
+		atomic<uint64_t> counters[COUNTER_COUNT];
+		atomic<uint64_t> buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+		atomic<uint64_t> sums[HISTOGRAM_COUNT];
+	};
+
+	/*
+	 Totals of every shard, read without stopping the writers, so they may be a few updates
+	 behind each other.
+	*/
+	struct MetricsSnapshot
+	{
+		uint64_t counters[COUNTER_COUNT];
+		uint64_t buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+		uint64_t sums[HISTOGRAM_COUNT];
+		uint64_t counter(Counter counter) const { return counters[size_t(counter)]; }
+		uint64_t count(Histogram histogram) const;
+		// Upper bound in nanoseconds of the bucket holding the given fraction of the times
+		uint64_t percentile(Histogram histogram, double fraction) const;
+	};
+
+	/*
+	 Counters and log-bucketed latency histograms of the lookups. Updates are relaxed atomic
+	 additions to the shard of the calling thread, which live either in memory private to
+	 the process or in a file mapped by the processes of its owner, so the totals of the
+	 host can be read from the file without attaching to any of them. The file is ignored
+	 unless it's owned by the owner and not writable by others.
+	*/
+	class Metrics
+	{
+	public:
+		Metrics();
+		// Maps the file for updating, creating it if it doesn't exist. Returns nullptr unless run by owner
+		static unique_ptr<Metrics> open(const string& path, uid_t owner);
+		static unique_ptr<Metrics> openForReading(const string& path, uid_t owner);
+		Metrics(const Metrics&) = delete;
+		Metrics& operator = (const Metrics&) = delete;
+		~Metrics();
+		void add(Counter counter, uint64_t amount = 1)
+		{
+			shards[shardIndex()].counters[size_t(counter)].fetch_add(amount, memory_order_relaxed);
+		}
+		// For counters of things in progress, the totals wrap around to the right value
+		void subtract(Counter counter, uint64_t amount = 1)
+		{
+			shards[shardIndex()].counters[size_t(counter)].fetch_sub(amount, memory_order_relaxed);
+		}
+		// Raises the counter to value if it's lower. Kept in the first shard, so its total is the highest value
+		void raise(Counter counter, uint64_t value)
+		{
+			atomic<uint64_t>& highest = shards[0].counters[size_t(counter)];
+			uint64_t current = highest.load(memory_order_relaxed);
+			while (value > current && !highest.compare_exchange_weak(current, value, memory_order_relaxed));
+		}
+		uint64_t total(Counter counter) const;
+		void record(Histogram histogram, uint64_t nanoseconds)
+		{
+			MetricsShard& shard = shards[shardIndex()];
+			shard.buckets[size_t(histogram)][bucket(nanoseconds)].fetch_add(1, memory_order_relaxed);
+			shard.sums[size_t(histogram)].fetch_add(nanoseconds, memory_order_relaxed);
+		}
+		MetricsSnapshot snapshot() const;
+		static size_t bucket(uint64_t nanoseconds)
+		{
+			size_t log = 63 - __builtin_clzll(nanoseconds | 1);
+			return (log < HISTOGRAM_BUCKETS) ? log : HISTOGRAM_BUCKETS - 1;
+		}
+	private:
+		Metrics(void* mapping, size_t mappingSize, MetricsShard* shards);
+		static size_t shardIndex();
+		void* mapping;
+		size_t mappingSize;
+		MetricsShard* shards;
+	};
+
+	const char* counterName(Counter counter);
+	const char* histogramName(Histogram histogram);
+
+	Metrics& metrics();
+}
+
+#endif
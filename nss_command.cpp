@@ -9,16 +9,80 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "nss_command.hpp"
+#include "cache.hpp"
+#include "coprocess.hpp"
+#include "resolver_socket.hpp"
+#include "pinned_command.hpp"
+#include "shared_cache.hpp"
+#include "host_database.hpp"
+#include "admission_filter.hpp"
+#include "configuration.hpp"
+#include "concurrency_limiter.hpp"
+#include "circuit_breaker.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "spawner.hpp"
+#include <cstdint>
 #include <cstring>
-#include <regex>
-#include <sstream>
-#include <iostream>
+#include <stdexcept>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <system_error>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 
+extern char** environ;
+
+const char* DEFAULT_CONFIGURATION_PATH = "/etc/nss_command.conf";
+const unsigned DEFAULT_CONFIGURATION_CHECK_INTERVAL = 5;
 const char* DEFAULT_GETHOSTBYNAME_COMMAND = "/usr/local/sbin/nsscommand_gethostbyname";
 const char* DEFAULT_GETHOSTBYADDR_COMMAND = "/usr/local/sbin/nsscommand_gethostbyaddr";
+const char* DEFAULT_COPROCESS_COMMAND = "/usr/local/sbin/nsscommand_coprocess";
+const bool DEFAULT_COPROCESS_MODE = false;
+const char* DEFAULT_SPAWNER_COMMAND = "/usr/local/sbin/nsscommand_spawner";
+const bool DEFAULT_SPAWNER_MODE = false;
+const char* DEFAULT_SOCKET_PATH = "/run/nsscommand.sock";
+const bool DEFAULT_SOCKET_MODE = false;
+const int DEFAULT_SOCKET_TIMEOUT = 100;
+const unsigned DEFAULT_COMMAND_REVALIDATION_INTERVAL = 5;
+const int DEFAULT_COMMAND_TIMEOUT = 5000;
+const size_t DEFAULT_MAX_OUTPUT_SIZE = 1024 * 1024;
+const unsigned DEFAULT_CONCURRENCY_LIMIT = 0;
+const char* DEFAULT_CONCURRENCY_LOCK_PATH = "/dev/shm/nsscommand.slots";
+const int DEFAULT_CONCURRENCY_WAIT = 1000;
+const unsigned DEFAULT_BREAKER_THRESHOLD = 0;
+const unsigned DEFAULT_BREAKER_COOLDOWN = 10;
+const bool DEFAULT_BREAKER_SHARED = false;
+const char* DEFAULT_BREAKER_PATH = "/dev/shm/nsscommand.breaker";
+const bool DEFAULT_METRICS_MODE = false;
+const char* DEFAULT_METRICS_PATH = "/dev/shm/nsscommand.metrics";
+const bool DEFAULT_TRACE_MODE = false;
+const char* DEFAULT_TRACE_PATH = "/dev/shm/nsscommand.trace";
+const size_t DEFAULT_TRACE_RECORDS = 1024;
+const char* DEFAULT_SHARED_CACHE_PATH = "/dev/shm/nsscommand.cache";
+const bool DEFAULT_SHARED_CACHE_MODE = false;
+const size_t DEFAULT_SHARED_CACHE_BUCKETS = 8192;
+const unsigned DEFAULT_SHARED_FILE_RETRY_INTERVAL = 10;
+const char* DEFAULT_HOST_DATABASE_PATH = "/var/lib/nsscommand_hosts.db";
+const bool DEFAULT_HOST_DATABASE_MODE = false;
+const unsigned DEFAULT_HOST_DATABASE_CHECK_INTERVAL = 1;
+const char* DEFAULT_ADMITTED_NAMES = "";
+const char* DEFAULT_ADMITTED_NETWORKS = "";
+const unsigned DEFAULT_RETRY_WINDOW = 2;
+const size_t DEFAULT_CACHE_CAPACITY = 1024;
+const unsigned DEFAULT_CACHE_STALE_WINDOW = 0;
+const size_t DEFAULT_REVERSE_INDEX_CAPACITY = 0;
+const unsigned DEFAULT_CACHE_POSITIVE_TTL = 10;
+const unsigned DEFAULT_CACHE_NEGATIVE_TTL = 2;
 
 using namespace std;
 
@@ -28,6 +92,11 @@ bool operator == (const in_addr& lhs, const in_addr& rhs)
 	return lhs.s_addr == rhs.s_addr;
 }
 
+bool operator == (const in6_addr& lhs, const in6_addr& rhs)
+{
+	return memcmp(&lhs, &rhs, sizeof(in6_addr)) == 0;
+}
+
 namespace nssCommand
 {
 	bool fileHasRightPerms(const string& filename)
@@ -39,31 +108,130 @@ namespace nssCommand
 		if (fileProperties.st_uid != 0) return false;
 		return true;
 	}
-	const regex namere("^name:\\s*([a-zA-Z0-9\\-\\.]+)$");
-	const regex aliasre("^alias:\\s*([a-zA-Z0-9\\-\\.]+)$");
-	const regex ip4re("^ip4:\\s*([0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+)$");
-	HostEntry parseCommandOutput(const string& text)
+	inline bool isBlank(char c)
 	{
-		stringstream textStream(text);
-		HostEntry result;
-		string currentLine;
-		while (getline( textStream, currentLine))
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+	}
+	inline bool isDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+	inline bool isHostNameChar(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) || c == '-' || c == '.';
+	}
+	// Matches "<prefix>\s*<host name characters>" spanning the whole line
+	bool scanField(const char* line, const char* end, const char* prefix, size_t prefixSize, const char*& value)
+	{
+		if (size_t(end - line) <= prefixSize || memcmp(line, prefix, prefixSize) != 0) return false;
+		const char* current = line + prefixSize;
+		while (current < end && isBlank(*current)) current++;
+		value = current;
+		while (current < end && isHostNameChar(*current)) current++;
+		return current == end && value != end;
+	}
+	// Converts a dotted quad the same way inet_aton does, leading zeros meaning octal
+	bool scanIp4(const char* current, const char* end, in_addr& address)
+	{
+		uint32_t result = 0;
+		for (int part = 0; part < 4; part++)
+		{
+			if (part > 0)
+			{
+				if (current == end || *current != '.') return false;
+				current++;
+			}
+			if (current == end || !isDigit(*current)) return false;
+			uint32_t base = (*current == '0') ? 8 : 10;
+			uint32_t value = 0;
+			for (; current < end && isDigit(*current); current++)
+			{
+				uint32_t digit = *current - '0';
+				if (digit >= base) return false;
+				value = value * base + digit;
+				if (value > 0xff) return false;
+			}
+			result = (result << 8) | value;
+		}
+		if (current != end) return false;
+		address.s_addr = htonl(result);
+		return true;
+	}
+	inline bool isIp6Char(char c)
+	{
+		return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || c == ':' || c == '.';
+	}
+	// Matches "ip6:\s*<address>" spanning the whole line, and converts the address without allocating
+	bool scanIp6Field(const char* line, const char* end, in6_addr& address)
+	{
+		if (size_t(end - line) <= 4 || memcmp(line, "ip6:", 4) != 0) return false;
+		const char* current = line + 4;
+		while (current < end && isBlank(*current)) current++;
+		const char* value = current;
+		while (current < end && isIp6Char(*current)) current++;
+		if (current != end || value == end || size_t(end - value) >= INET6_ADDRSTRLEN) return false;
+		char text[INET6_ADDRSTRLEN];
+		memcpy(text, value, end - value);
+		text[end - value] = '\0';
+		return inet_pton(AF_INET6, text, &address) == 1;
+	}
+	bool scanTtl(const char* current, const char* end, int32_t& ttl)
+	{
+		int64_t value = 0;
+		for (; current < end; current++)
+		{
+			if (!isDigit(*current)) return false;
+			value = value * 10 + (*current - '0');
+			if (value > INT32_MAX) value = INT32_MAX;
+		}
+		ttl = int32_t(value);
+		return true;
+	}
+	size_t parseCommandOutput(const char* text, size_t size, HostEntry& result)
+	{
+		size_t rejectedLines = 0;
+		const char* end = text + size;
+		const char* line = text;
+		while (line < end)
 		{
-			smatch matchResult;
-			if (regex_match(currentLine, matchResult, namere))
+			const char* lineEnd = (const char*) memchr(line, '\n', end - line);
+			if (lineEnd == nullptr) lineEnd = end;
+			const char* value;
+			in6_addr ip6;
+			if (scanField(line, lineEnd, "name:", 5, value))
 			{
-				result.name = matchResult[1];
+				result.name.assign(value, lineEnd - value);
 			}
-			else if (regex_match(currentLine, matchResult, aliasre))
+			else if (scanField(line, lineEnd, "alias:", 6, value))
 			{
-				result.aliases.emplace_back(matchResult[1]);
+				result.aliases.emplace_back(value, lineEnd - value);
 			}
-			else if (regex_match(currentLine, matchResult, ip4re))
+			else if (scanField(line, lineEnd, "ip4:", 4, value))
 			{
 				in_addr ip;
-				if ( 0 != inet_aton(matchResult[1].str().c_str(), &ip))  result.addresses.emplace_back(ip);
+				if (scanIp4(value, lineEnd, ip))  result.addresses.emplace_back(ip);
+				else  rejectedLines++;
+			}
+			else if (scanIp6Field(line, lineEnd, ip6))
+			{
+				result.addresses6.emplace_back(ip6);
+			}
+			else if (scanField(line, lineEnd, "ttl:", 4, value))
+			{
+				if (!scanTtl(value, lineEnd, result.ttl))  rejectedLines++;
+			}
+			else if (lineEnd != line)
+			{
+				rejectedLines++;
 			}
+			line = lineEnd + 1;
 		}
+		return rejectedLines;
+	}
+	HostEntry parseCommandOutput(const string& text)
+	{
+		HostEntry result;
+		parseCommandOutput(text.data(), text.size(), result);
 		return result;
 	}
 	string getErrorDescription(int errorcode)
@@ -73,71 +241,676 @@ namespace nssCommand
 		strerror_r(errorcode, buffer, sizeof(buffer));
 		return string(buffer);
 	}
-	int run(const string& cmd, string& output)
+	int millisecondsLeft(chrono::steady_clock::time_point deadline)
+	{
+		auto left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now()).count();
+		return (left > 0) ? int((left + 999) / 1000) : 0;
+	}
+	uint64_t nanosecondsSince(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+	// Reads the child output until it closes it. Returns 0, or the command return code to report if it couldn't
+	int readOutput(int fd, string& output, chrono::steady_clock::time_point deadline, size_t maxOutputSize, uint64_t& readTime)
+	{
+		char buffer[16384];
+		bool traced = tracing.load(memory_order_relaxed);
+		while (true)
+		{
+			auto readStart = traced ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+			ssize_t received = read(fd, buffer, sizeof(buffer));
+			if (traced)  readTime += nanosecondsSince(readStart);
+			if (received == 0) return 0;
+			if (received > 0)
+			{
+				if (output.size() + received > maxOutputSize) return 3; // output too big, there's something wrong with the command
+				output.append(buffer, received);
+				continue;
+			}
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) return 0;
+			int timeout = millisecondsLeft(deadline);
+			if (timeout == 0) return 2; // timed out, the client may try again
+			pollfd waiting = { fd, POLLIN, 0 };
+			poll(&waiting, 1, timeout);
+		}
+	}
+	// Waits for the child to exit, it should be immediate once its output has been closed
+	bool waitExit(pid_t pid, int& status, chrono::steady_clock::time_point deadline)
 	{
-		char line[256];
-		memset(line,0,256);
-		FILE* p = popen(cmd.c_str(),"r");
-		if (p == NULL) throw runtime_error("No memory left");
+		useconds_t pause = 20;
+		while (true)
+		{
+			pid_t waited = waitpid(pid, &status, WNOHANG);
+			if (waited == pid) return true;
+			if (waited == -1 && errno != EINTR) throw runtime_error(getErrorDescription(errno));
+			if (millisecondsLeft(deadline) == 0) return false;
+			usleep(pause);
+			if (pause < 10000) pause *= 2;
+		}
+	}
+	void killProcessGroup(pid_t pid)
+	{
+		kill(-pid, SIGKILL);
+		while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+	}
+	// Spawns the command from this process. Returns 0 or the errno of the failure
+	int spawnCommand(const vector<string>& args, const shared_ptr<PinnedCommand>& pinned, int outputFd, pid_t& pid)
+	{
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+		posix_spawnattr_t attributes;
+		posix_spawnattr_init(&attributes);
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP); // so the whole group can be killed on timeout
+		posix_spawnattr_setpgroup(&attributes, 0);
+		string executable = args[0];
+		if (pinned)
+		{
+			executable = pinned->executablePath();
+			posix_spawn_file_actions_adddup2(&actions, pinned->descriptor(), pinned->descriptor()); // keeps it open for interpreted scripts
+		}
+		vector<char*> argv;
+		for (auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+		argv.push_back(nullptr);
+		int spawnResult = posix_spawn(&pid, executable.c_str(), &actions, &attributes, argv.data(), environ);
+		posix_spawnattr_destroy(&attributes);
+		posix_spawn_file_actions_destroy(&actions);
+		return spawnResult;
+	}
+	int run(const vector<string>& args, string& output, int timeoutMilliseconds, size_t maxOutputSize, const shared_ptr<PinnedCommand>& pinned)
+	{
+		const Configuration& settings = configuration();
+		Metrics& stats = metrics();
+		auto start = chrono::steady_clock::now();
+		auto deadline = start + chrono::milliseconds(timeoutMilliseconds);
+		int pipeEnds[2];
+		if (pipe2(pipeEnds, O_CLOEXEC) != 0) throw runtime_error(getErrorDescription(errno));
+		// Started by the spawner helper when it's enabled and usable, otherwise from here
+		unique_ptr<SpawnedCommand> spawned;
+		pid_t pid = -1;
+		int spawnResult = -1;
+		shared_ptr<PinnedCommand> helper = settings.spawnerMode ? trustedCommand(settings.spawnerCommand) : nullptr;
+		if (helper)
+		{
+			spawnResult = spawner(settings.spawnerCommand).spawn(args, pinned ? pinned->descriptor() : -1, pipeEnds[1], deadline, spawned, helper);
+			if (spawned) pid = spawned->processId();
+			stats.add((spawnResult < 0) ? Counter::spawnerFallbacks : Counter::spawnerSpawns);
+		}
+		if (spawnResult < 0)  spawnResult = spawnCommand(args, pinned, pipeEnds[1], pid);
+		close(pipeEnds[1]);
+		output.clear();
+		stats.record(Histogram::spawnTime, nanosecondsSince(start));
+		if (spawnResult != 0)
+		{
+			stats.add(Counter::spawnFailures);
+			close(pipeEnds[0]);
+			if (spawnResult == ENOENT || spawnResult == EACCES || spawnResult == ENOEXEC) return 127; // same as the shell would return
+			throw runtime_error(getErrorDescription(spawnResult));
+		}
+		stats.add(Counter::spawns);
+		traceStage(TraceStage::spawned);
+		auto readStart = chrono::steady_clock::now();
+		uint64_t readTime = 0;
+		fcntl(pipeEnds[0], F_SETFL, O_NONBLOCK);
+		int readFailure = readOutput(pipeEnds[0], output, deadline, maxOutputSize, readTime);
+		close(pipeEnds[0]);
+		traceStage(TraceStage::outputRead);
+		traceOutput(output.size(), readTime);
+		int returnValue;
+		bool exited = (readFailure == 0 && (spawned ? spawned->waitExit(returnValue, deadline) : waitExit(pid, returnValue, deadline)));
+		traceStage(TraceStage::exited);
+		stats.record(Histogram::readTime, nanosecondsSince(readStart));
+		if (exited)
+		{
+			if (WIFEXITED(returnValue)) returnValue = WEXITSTATUS(returnValue);
+			return returnValue;
+		}
+		stats.add((readFailure == 3) ? Counter::oversizedOutputs : Counter::timeouts);
+		if (spawned) spawned.reset(); // the helper kills the process group when its reply socket is closed
+		else killProcessGroup(pid);
 		output.clear();
-		while (fgets(line,255,p)) output.append(line);
-		int returnValue = pclose(p);
-		if (returnValue == -1) throw runtime_error(getErrorDescription(errno));
-		if (WIFEXITED(returnValue)) returnValue = WEXITSTATUS(returnValue);
-		return returnValue;
+		return (readFailure != 0) ? readFailure : 2;
 	}
-	size_t calculateBufferSize(const HostEntry& entry)
+	int run(const vector<string>& args, string& output)
+	{
+		return run(args, output, configuration().commandTimeout, configuration().maxOutputSize);
+	}
+	int run(const string& cmd, string& output)
+	{
+		return run(vector<string>{ "/bin/sh", "-c", cmd }, output);
+	}
+	void parseExecutionOutput(const string& output, HostEntry& entry)
+	{
+		Metrics& stats = metrics();
+		auto start = chrono::steady_clock::now();
+		entry = HostEntry();
+		size_t rejectedLines = parseCommandOutput(output.data(), output.size(), entry);
+		stats.record(Histogram::parseTime, nanosecondsSince(start));
+		traceStage(TraceStage::parsed);
+		if (rejectedLines != 0)  stats.add(Counter::parseRejects, rejectedLines);
+	}
+	int runCommand(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned)
+	{
+		const Configuration& settings = configuration();
+		ConcurrencyLimiter& limiter = concurrencyLimiter();
+		int slot;
+		if (!limiter.acquire(settings.concurrencyLockPath, 0, settings.concurrencyLimit, settings.concurrencyWait, slot))
+		{
+			metrics().add(Counter::concurrencyTimeouts);
+			return 2;
+		}
+		ConcurrencySlot executing(limiter, slot);
+		string commandOutput;
+		int commandReturnCode;
+		if (settings.coprocessMode)
+		{
+			metrics().add(Counter::coprocessQueries);
+			commandReturnCode = coprocess(command).query(kind, argument, commandOutput, settings.commandTimeout, settings.maxOutputSize, pinned);
+			traceOutput(commandOutput.size(), 0);
+		}
+		else
+		{
+			commandReturnCode = run(vector<string>{ command, argument }, commandOutput, settings.commandTimeout, settings.maxOutputSize, pinned);
+		}
+		if (commandReturnCode == 0)  parseExecutionOutput(commandOutput, entry);
+		return commandReturnCode;
+	}
+	ConcurrencyLimiter& concurrencyLimiter()
+	{
+		static ConcurrencyLimiter& limiter = *new ConcurrencyLimiter();
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() { pthread_atfork(nullptr, nullptr, []() { concurrencyLimiter().resetAfterFork(); }); });
+		return limiter;
+	}
+	Counter exitCodeCounter(int commandReturnCode)
+	{
+		switch (commandReturnCode)
+		{
+			case 0: return Counter::exitCode0;
+			case 1: return Counter::exitCode1;
+			case 2: return Counter::exitCode2;
+			case 3: return Counter::exitCode3;
+			case 4: return Counter::exitCode4;
+			default: return Counter::exitCodeOther;
+		}
+	}
+	int execute(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned)
+	{
+		const Configuration& settings = configuration();
+		Metrics& stats = metrics();
+		auto start = chrono::steady_clock::now();
+		traceStage(TraceStage::executing);
+		int commandReturnCode;
+		string daemonOutput;
+		if (settings.socketMode && querySocket(settings.socketPath, 0, settings.socketTimeout, settings.socketTimeout + settings.commandTimeout, settings.maxOutputSize, kind, argument, daemonOutput, commandReturnCode))
+		{
+			stats.add(Counter::socketQueries);
+			traceOutput(daemonOutput.size(), 0);
+			if (commandReturnCode == 0)  parseExecutionOutput(daemonOutput, entry);
+		}
+		else
+		{
+			commandReturnCode = runCommand(kind, command, argument, entry, pinned);
+		}
+		stats.record(Histogram::executionTime, nanosecondsSince(start));
+		stats.add(exitCodeCounter(commandReturnCode));
+		return commandReturnCode;
+	}
+	Configuration defaultConfiguration()
+	{
+		Configuration defaults;
+		defaults.gethostbynameCommand = DEFAULT_GETHOSTBYNAME_COMMAND;
+		defaults.gethostbyaddrCommand = DEFAULT_GETHOSTBYADDR_COMMAND;
+		defaults.coprocessCommand = DEFAULT_COPROCESS_COMMAND;
+		defaults.coprocessMode = DEFAULT_COPROCESS_MODE;
+		defaults.spawnerCommand = DEFAULT_SPAWNER_COMMAND;
+		defaults.spawnerMode = DEFAULT_SPAWNER_MODE;
+		defaults.socketPath = DEFAULT_SOCKET_PATH;
+		defaults.socketMode = DEFAULT_SOCKET_MODE;
+		defaults.socketTimeout = DEFAULT_SOCKET_TIMEOUT;
+		defaults.commandRevalidationInterval = DEFAULT_COMMAND_REVALIDATION_INTERVAL;
+		defaults.commandTimeout = DEFAULT_COMMAND_TIMEOUT;
+		defaults.maxOutputSize = DEFAULT_MAX_OUTPUT_SIZE;
+		defaults.concurrencyLimit = DEFAULT_CONCURRENCY_LIMIT;
+		defaults.concurrencyLockPath = DEFAULT_CONCURRENCY_LOCK_PATH;
+		defaults.concurrencyWait = DEFAULT_CONCURRENCY_WAIT;
+		defaults.breakerThreshold = DEFAULT_BREAKER_THRESHOLD;
+		defaults.breakerCooldown = DEFAULT_BREAKER_COOLDOWN;
+		defaults.breakerShared = DEFAULT_BREAKER_SHARED;
+		defaults.breakerPath = DEFAULT_BREAKER_PATH;
+		defaults.metricsMode = DEFAULT_METRICS_MODE;
+		defaults.metricsPath = DEFAULT_METRICS_PATH;
+		defaults.traceMode = DEFAULT_TRACE_MODE;
+		defaults.tracePath = DEFAULT_TRACE_PATH;
+		defaults.traceRecords = DEFAULT_TRACE_RECORDS;
+		defaults.sharedCachePath = DEFAULT_SHARED_CACHE_PATH;
+		defaults.sharedCacheMode = DEFAULT_SHARED_CACHE_MODE;
+		defaults.sharedCacheBuckets = DEFAULT_SHARED_CACHE_BUCKETS;
+		defaults.hostDatabasePath = DEFAULT_HOST_DATABASE_PATH;
+		defaults.hostDatabaseMode = DEFAULT_HOST_DATABASE_MODE;
+		defaults.hostDatabaseCheckInterval = DEFAULT_HOST_DATABASE_CHECK_INTERVAL;
+		defaults.admittedNames = DEFAULT_ADMITTED_NAMES;
+		defaults.admittedNetworks = DEFAULT_ADMITTED_NETWORKS;
+		defaults.retryWindow = DEFAULT_RETRY_WINDOW;
+		defaults.cacheCapacity = DEFAULT_CACHE_CAPACITY;
+		defaults.cachePositiveTtl = DEFAULT_CACHE_POSITIVE_TTL;
+		defaults.cacheNegativeTtl = DEFAULT_CACHE_NEGATIVE_TTL;
+		defaults.cacheStaleWindow = DEFAULT_CACHE_STALE_WINDOW;
+		defaults.reverseIndexCapacity = DEFAULT_REVERSE_INDEX_CAPACITY;
+		return defaults;
+	}
+	// Generation of the last configuration seen, and the settings read on every counter update
+	atomic<unsigned> configurationGeneration(0);
+	atomic<bool> metricsShared(false);
+	const Configuration& configuration()
+	{
+		static ConfigurationSource& source = *new ConfigurationSource(DEFAULT_CONFIGURATION_PATH, 0, DEFAULT_CONFIGURATION_CHECK_INTERVAL, defaultConfiguration());
+		const Configuration& settings = source.current();
+		if (configurationGeneration.load(memory_order_relaxed) != settings.generation)
+		{
+			tracing.store(settings.traceMode, memory_order_relaxed);
+			metricsShared.store(settings.metricsMode, memory_order_relaxed);
+			configurationGeneration.store(settings.generation, memory_order_relaxed);
+		}
+		return settings;
+	}
+	ResultCache& resultCache()
+	{
+		const Configuration& settings = configuration();
+		static ResultCache& cache = *new ResultCache(settings.cacheCapacity, settings.cachePositiveTtl, settings.cacheNegativeTtl, settings.cacheStaleWindow);
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() {
+			pthread_atfork([]() { resultCache().lockForFork(); }, []() { resultCache().unlockAfterFork(); }, []() { resultCache().resetAfterFork(); });
+		});
+		static atomic<unsigned> generation(settings.generation);
+		if (generation.load(memory_order_relaxed) != settings.generation)
+		{
+			generation.store(settings.generation, memory_order_relaxed);
+			cache.configure(settings.cacheCapacity, settings.cachePositiveTtl, settings.cacheNegativeTtl, settings.cacheStaleWindow);
+		}
+		return cache;
+	}
+	ResultCache& reverseIndex()
+	{
+		const Configuration& settings = configuration();
+		static ResultCache& index = *new ResultCache(settings.reverseIndexCapacity, settings.cachePositiveTtl, 0);
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() {
+			pthread_atfork([]() { reverseIndex().lockForFork(); }, []() { reverseIndex().unlockAfterFork(); }, []() { reverseIndex().resetAfterFork(); });
+		});
+		static atomic<unsigned> generation(settings.generation);
+		if (generation.load(memory_order_relaxed) != settings.generation)
+		{
+			generation.store(settings.generation, memory_order_relaxed);
+			index.configure(settings.reverseIndexCapacity, settings.cachePositiveTtl, 0);
+		}
+		return index;
+	}
+	string addressToString(const void* address, int family)
+	{
+		char buffer[INET6_ADDRSTRLEN];
+		if (inet_ntop(family, address, buffer, sizeof(buffer)) == nullptr) return string();
+		return string(buffer);
+	}
+	string reverseIndexKey(const string& addressText)
+	{
+		return ResultCache::makeKey(QueryKind::byAddress, string(), addressText);
+	}
+	/*
+	 Remembers the entry of a successful forward lookup for each of its addresses, so
+	 reverse lookups of them are answered without executing the gethostbyaddr command.
+	*/
+	void indexAddresses(const HostEntry& entry)
+	{
+		ResultCache& index = reverseIndex();
+		if (!index.enabled() || entry.name.empty())  return;
+		for (auto& address : entry.addresses)  index.insert(reverseIndexKey(addressToString(&address, AF_INET)), 0, entry);
+		for (auto& address : entry.addresses6)  index.insert(reverseIndexKey(addressToString(&address, AF_INET6)), 0, entry);
+	}
+	/*
+	 Result of the last lookup of this thread that didn't fit in the caller's buffer. glibc
+	 calls again right away with a bigger buffer, so it is served from here instead of
+	 executing the command again.
+	*/
+	struct PendingRetry
+	{
+		string key;
+		HostEntry entry;
+		chrono::steady_clock::time_point expiration;
+	};
+	thread_local PendingRetry pendingRetry;
+	void keepForRetry(QueryKind kind, const char* command, const string& argument, HostEntry& entry)
+	{
+		pendingRetry.key = ResultCache::makeKey(kind, command, argument);
+		pendingRetry.entry = move(entry);
+		pendingRetry.expiration = chrono::steady_clock::now() + chrono::seconds(configuration().retryWindow);
+	}
+	bool takePendingRetry(const string& key, HostEntry& entry)
+	{
+		if (pendingRetry.key.empty())  return false;
+		bool found = (pendingRetry.key == key && chrono::steady_clock::now() < pendingRetry.expiration);
+		if (found)  entry = move(pendingRetry.entry);
+		pendingRetry.key.clear();
+		pendingRetry.entry = HostEntry();
+		return found;
+	}
+	SharedCache* sharedCache()
+	{
+		static atomic<SharedCache*> instance(nullptr);
+		static mutex openLock;
+		static chrono::steady_clock::time_point nextAttempt;
+		const Configuration& settings = configuration();
+		if (!settings.sharedCacheMode) return nullptr;
+		SharedCache* cache = instance.load(memory_order_acquire);
+		if (cache != nullptr) return cache;
+		// Until root creates the file other processes keep trying, but not on every lookup.
+		// The file opened first is used until the process ends, even if the settings change.
+		lock_guard<mutex> guard(openLock);
+		cache = instance.load(memory_order_relaxed);
+		if (cache != nullptr || chrono::steady_clock::now() < nextAttempt) return cache;
+		nextAttempt = chrono::steady_clock::now() + chrono::seconds(DEFAULT_SHARED_FILE_RETRY_INTERVAL);
+		cache = SharedCache::open(settings.sharedCachePath, settings.sharedCacheBuckets, 0, settings.cachePositiveTtl, settings.cacheNegativeTtl).release();
+		instance.store(cache, memory_order_release);
+		return cache;
+	}
+	/*
+	 The database is published with a generation number. Each thread keeps its own
+	 reference to the last one it used and only takes the lock to pick up a new one, and
+	 a single thread checks the file once the check interval has elapsed. A replaced
+	 database stays mapped until every thread using it has picked up the new one.
+	*/
+	const HostDatabase* hostDatabase()
+	{
+		static mutex databaseLock;
+		static shared_ptr<HostDatabase> database;
+		static string databasePath;
+		static atomic<unsigned> generation(0);
+		static atomic<unsigned> checkedConfiguration(0);
+		static atomic<int64_t> nextCheck(0);
+		static thread_local shared_ptr<HostDatabase> used;
+		static thread_local unsigned usedGeneration = 0;
+		const Configuration& settings = configuration();
+		if (!settings.hostDatabaseMode) return nullptr;
+		int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		if (now >= nextCheck.load(memory_order_relaxed) || checkedConfiguration.load(memory_order_relaxed) != settings.generation)
+		{
+			unique_lock<mutex> guard(databaseLock, defer_lock);
+			// Only the first check makes lookups wait, later ones are left to a single thread
+			if (checkedConfiguration.load(memory_order_acquire) == 0) guard.lock();
+			else guard.try_lock();
+			if (guard.owns_lock() && (now >= nextCheck.load(memory_order_relaxed) || checkedConfiguration.load(memory_order_relaxed) != settings.generation))
+			{
+				if (!database || databasePath != settings.hostDatabasePath || database->changed())
+				{
+					shared_ptr<HostDatabase> previous = database;
+					databasePath = settings.hostDatabasePath;
+					database = HostDatabase::open(databasePath, 0);
+					if (database || previous) generation.fetch_add(1, memory_order_release);
+				}
+				nextCheck.store(now + settings.hostDatabaseCheckInterval, memory_order_relaxed);
+				checkedConfiguration.store(settings.generation, memory_order_release);
+			}
+		}
+		if (usedGeneration != generation.load(memory_order_acquire))
+		{
+			lock_guard<mutex> guard(databaseLock);
+			used = database;
+			usedGeneration = generation.load(memory_order_relaxed);
+		}
+		return used.get();
+	}
+	AdmissionFilter& admissionFilter()
+	{
+		return *configuration().admissionFilter;
+	}
+	CircuitBreaker& circuitBreaker()
+	{
+		static CircuitBreaker& local = *new CircuitBreaker();
+		static atomic<CircuitBreaker*> shared(nullptr);
+		static mutex openLock;
+		static chrono::steady_clock::time_point nextAttempt;
+		const Configuration& settings = configuration();
+		if (!settings.breakerShared) return local;
+		CircuitBreaker* breaker = shared.load(memory_order_acquire);
+		if (breaker != nullptr) return *breaker;
+		lock_guard<mutex> guard(openLock);
+		breaker = shared.load(memory_order_relaxed);
+		if (breaker == nullptr && chrono::steady_clock::now() >= nextAttempt)
+		{
+			nextAttempt = chrono::steady_clock::now() + chrono::seconds(DEFAULT_SHARED_FILE_RETRY_INTERVAL);
+			breaker = CircuitBreaker::open(settings.breakerPath, 0).release();
+			shared.store(breaker, memory_order_release);
+		}
+		return (breaker != nullptr) ? *breaker : local;
+	}
+	Metrics& metrics()
+	{
+		static Metrics& local = *new Metrics();
+		static atomic<Metrics*> shared(nullptr);
+		static mutex openLock;
+		// Configuration generation the file last failed to open with, it's tried again after a change
+		static atomic<unsigned> failedGeneration(0);
+		// Follows the configuration loaded by the lookups instead of checking it on every update
+		if (configurationGeneration.load(memory_order_relaxed) == 0) configuration();
+		if (!metricsShared.load(memory_order_relaxed)) return local;
+		Metrics* mapped = shared.load(memory_order_acquire);
+		if (mapped != nullptr) return *mapped;
+		unsigned generation = configurationGeneration.load(memory_order_relaxed);
+		if (failedGeneration.load(memory_order_relaxed) == generation) return local;
+		lock_guard<mutex> guard(openLock);
+		mapped = shared.load(memory_order_relaxed);
+		if (mapped == nullptr && failedGeneration.load(memory_order_relaxed) != generation)
+		{
+			// Only root maps the file, other users count in their private shards
+			mapped = Metrics::open(configuration().metricsPath, 0).release();
+			if (mapped != nullptr) shared.store(mapped, memory_order_release);
+			else failedGeneration.store(generation, memory_order_relaxed);
+		}
+		return (mapped != nullptr) ? *mapped : local;
+	}
+	/*
+	 The buffer is created on the first traced lookup, in the trace path followed by the pid,
+	 and again in a child after a fork so it doesn't write into the buffer of its parent.
+	*/
+	TraceBuffer* traceBuffer()
+	{
+		static atomic<TraceBuffer*> instance(nullptr);
+		static mutex openLock;
+		static chrono::steady_clock::time_point nextAttempt;
+		TraceBuffer* buffer = instance.load(memory_order_acquire);
+		pid_t pid = getpid();
+		if (buffer != nullptr && buffer->pid() == pid) return buffer;
+		const Configuration& settings = configuration();
+		lock_guard<mutex> guard(openLock);
+		buffer = instance.load(memory_order_relaxed);
+		if (buffer != nullptr && buffer->pid() == pid) return buffer;
+		if (buffer != nullptr) nextAttempt = chrono::steady_clock::time_point();
+		if (chrono::steady_clock::now() < nextAttempt) return nullptr;
+		nextAttempt = chrono::steady_clock::now() + chrono::seconds(DEFAULT_SHARED_FILE_RETRY_INTERVAL);
+		// The buffer of the parent stays mapped, other threads could be writing to it
+		buffer = TraceBuffer::create(settings.tracePath + "." + to_string(pid), settings.traceRecords).release();
+		if (buffer != nullptr) instance.store(buffer, memory_order_release);
+		return buffer;
+	}
+	RequestCoalescer& requestCoalescer()
+	{
+		static RequestCoalescer& coalescer = *new RequestCoalescer();
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() {
+			pthread_atfork([]() { requestCoalescer().lockForFork(); }, []() { requestCoalescer().unlockAfterFork(); }, []() { requestCoalescer().resetAfterFork(); });
+		});
+		return coalescer;
+	}
+	int executeAndStore(QueryKind kind, const char* command, const string& argument, const string& key, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned)
+	{
+		const Configuration& settings = configuration();
+		CircuitBreaker& breaker = circuitBreaker();
+		unsigned cooldown = settings.breakerCooldown * 1000;
+		int commandReturnCode;
+		if (!breaker.allow(command, settings.breakerThreshold, cooldown, commandReturnCode))
+		{
+			metrics().add(Counter::breakerRejects);
+			resultCache().insert(key, 2, HostEntry()); // lets a stale entry be refreshed later
+			return commandReturnCode;
+		}
+		SharedCache* shared = sharedCache();
+		bool executedHere = false;
+		// The longest execute() may take, a query to the daemon and then the command
+		int executionTimeout = settings.concurrencyWait + settings.commandTimeout;
+		if (settings.socketMode)  executionTimeout += 2 * settings.socketTimeout + settings.commandTimeout;
+		commandReturnCode = requestCoalescer().run(key, entry, executionTimeout, [&](HostEntry& executed) {
+			executedHere = true;
+			int executedReturnCode = execute(kind, command, argument, executed, pinned);
+			breaker.record(command, settings.breakerThreshold, cooldown, executedReturnCode);
+			resultCache().insert(key, executedReturnCode, executed);
+			if (kind == QueryKind::byName && executedReturnCode == 0)  indexAddresses(executed);
+			if (shared != nullptr)  shared->insert(key, executedReturnCode, executed);
+			return executedReturnCode;
+		});
+		if (!executedHere)  metrics().add(Counter::coalescedLookups);
+		return commandReturnCode;
+	}
+	BackgroundRefreshes& backgroundRefreshes()
+	{
+		// Never destroyed, like everything a refresh uses, so exit() doesn't wait for the refreshes
+		static BackgroundRefreshes& refreshes = *new BackgroundRefreshes();
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() {
+			pthread_atfork([]() { backgroundRefreshes().lockForFork(); }, []() { backgroundRefreshes().unlockAfterFork(); }, []() { backgroundRefreshes().resetAfterFork(); });
+		});
+		return refreshes;
+	}
+	void refreshInBackground(QueryKind kind, const char* command, const string& argument, const string& key, const shared_ptr<PinnedCommand>& pinned)
+	{
+		string commandCopy = command;
+		try
+		{
+			backgroundRefreshes().start([=]() {
+				HostEntry refreshed;
+				try
+				{
+					executeAndStore(kind, commandCopy.c_str(), argument, key, refreshed, pinned);
+				}
+				catch (const exception&)
+				{
+					resultCache().insert(key, 2, HostEntry());
+				}
+			});
+		}
+		catch (const system_error&)
+		{
+			resultCache().insert(key, 2, HostEntry());
+		}
+	}
+	int lookup(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned)
+	{
+		ResultCache& cache = resultCache();
+		string key = ResultCache::makeKey(kind, command, argument);
+		int commandReturnCode;
+		bool refresh;
+		Metrics& stats = metrics();
+		if (takePendingRetry(key, entry))
+		{
+			stats.add(Counter::retryHits);
+			return 0;
+		}
+		const HostDatabase* database = hostDatabase();
+		if (database && database->find(kind, argument, entry))
+		{
+			stats.add(Counter::hostDatabaseHits);
+			return 0;
+		}
+		if (kind == QueryKind::byAddress && reverseIndex().enabled() && reverseIndex().find(reverseIndexKey(argument), commandReturnCode, entry))
+		{
+			stats.add(Counter::reverseIndexHits);
+			return 0;
+		}
+		if (!admissionFilter().admits(kind, argument))
+		{
+			stats.add(Counter::admissionRejects);
+			return 1;
+		}
+		if (cache.find(key, commandReturnCode, entry, refresh))
+		{
+			stats.add(Counter::cacheHits);
+			if (refresh)
+			{
+				stats.add(Counter::staleRefreshes);
+				refreshInBackground(kind, command, argument, key, pinned);
+			}
+			return commandReturnCode;
+		}
+		SharedCache* shared = sharedCache();
+		if (shared != nullptr && shared->find(key, commandReturnCode, entry))
+		{
+			stats.add(Counter::sharedCacheHits);
+			return commandReturnCode;
+		}
+		return executeAndStore(kind, command, argument, key, entry, pinned);
+	}
+	size_t addressLength(int family)
+	{
+		return (family == AF_INET6) ? sizeof(in6_addr) : sizeof(in_addr);
+	}
+	size_t addressCount(const HostEntry& entry, int family)
+	{
+		return (family == AF_INET6) ? entry.addresses6.size() : entry.addresses.size();
+	}
+	size_t calculateBufferSize(const HostEntry& entry, int family)
 	{
 		size_t result = 0;
 		result = entry.name.size() +1; // size for h_name
 		for (auto& alias : entry.aliases) result += (alias.size() +1); // size for each entry in h_aliases
-		result += (entry.addresses.size() * sizeof(in_addr));  //size for each entry in h_addr_list
+		result += (addressCount(entry, family) * addressLength(family));  //size for each entry in h_addr_list
 		result += ((entry.aliases.size()+1) * sizeof(char*)); // size of the h_aliases vector itself
-		result += ((entry.addresses.size()+1) * sizeof(char*)); //size of the h_addr_list itself
+		result += ((addressCount(entry, family)+1) * sizeof(char*)); //size of the h_addr_list itself
 		return result;
 	}
+	size_t calculateBufferSize(const HostEntry& entry)
+	{
+		return calculateBufferSize(entry, AF_INET);
+	}
 	size_t calculateGaihBufferSize(const HostEntry& entry)
 	{
 		size_t result = 0;
 		result = entry.name.size() +1;
-		result += sizeof(gaih_addrtuple) * entry.addresses.size();
+		result += sizeof(gaih_addrtuple) * (entry.addresses.size() + entry.addresses6.size());
 		return result;
 	}
+	// Every lookup result goes through here, so it's counted and traced
+	nss_status lookupExit(Counter result, nss_status status, int errorNumber, int hostError, int* errnop, int* herrorp)
+	{
+		metrics().add(result);
+		traceResult(status, errorNumber, hostError);
+		*errnop = errorNumber;
+		*herrorp = hostError;
+		return status;
+	}
 	nss_status smallBufferExit(int* errnop, int* herrorp)
 	{
-			*errnop = ERANGE;
-			*herrorp = NETDB_INTERNAL;
-			return NSS_STATUS_TRYAGAIN;
+		return lookupExit(Counter::rangeRetries, NSS_STATUS_TRYAGAIN, ERANGE, NETDB_INTERNAL, errnop, herrorp);
 	}
 	nss_status noDataExit(int* errnop, int* herrorp)
 	{
-			*errnop = 0;
-			*herrorp = NO_DATA;
-			return NSS_STATUS_UNAVAIL;
+		return lookupExit(Counter::noDataResults, NSS_STATUS_UNAVAIL, 0, NO_DATA, errnop, herrorp);
 	}
 	nss_status notFoundExit(int* errnop, int* herrorp)
 	{
-			*errnop = 0;
-			*herrorp = HOST_NOT_FOUND;
-			return NSS_STATUS_NOTFOUND;
+		return lookupExit(Counter::notFoundResults, NSS_STATUS_NOTFOUND, 0, HOST_NOT_FOUND, errnop, herrorp);
 	}
 	nss_status tryAgainExit(int* errnop, int* herrorp)
 	{
-			*errnop = 0;
-			*herrorp = TRY_AGAIN;
-			return NSS_STATUS_TRYAGAIN;
+		return lookupExit(Counter::tryAgainResults, NSS_STATUS_TRYAGAIN, 0, TRY_AGAIN, errnop, herrorp);
 	}
 	nss_status notAvailableExit(int* errnop, int* herrorp)
 	{
-			*errnop = 0;
-			*herrorp = NO_RECOVERY;
-			return NSS_STATUS_UNAVAIL;
+		return lookupExit(Counter::unavailableResults, NSS_STATUS_UNAVAIL, 0, NO_RECOVERY, errnop, herrorp);
 	}
 	nss_status successfulExit(int* errnop, int* herrorp)
 	{
-		*errnop=0;
-		*herrorp=NETDB_SUCCESS;
-		return NSS_STATUS_SUCCESS;
+		return lookupExit(Counter::successResults, NSS_STATUS_SUCCESS, 0, NETDB_SUCCESS, errnop, herrorp);
 	}
 	nss_status unsuccessfulCommandExit(int commandReturnCode, int* errnop, int* herrorp)
 	{
@@ -154,140 +927,221 @@ namespace nssCommand
 				return notAvailableExit(errnop, herrorp);
 		}
 	}
-	void copyHostEntryToBuffer(const HostEntry& parsedEntry, hostent* result, char* buffer, size_t bufferSize)
+	size_t alignmentPadding(const char* buffer, size_t alignment)
 	{
-		memset(buffer, 0, bufferSize);
-		hostent* resultInBuffer = (hostent*) buffer;
-		resultInBuffer->h_addrtype = AF_INET;
-		resultInBuffer->h_length = sizeof(in_addr);
-		resultInBuffer->h_aliases = (char**) resultInBuffer + sizeof(hostent);
-		resultInBuffer->h_addr_list = (char**) resultInBuffer->h_aliases + ((parsedEntry.aliases.size() +1) * sizeof(char*));
-		resultInBuffer->h_name = (char*) resultInBuffer->h_addr_list + ((parsedEntry.addresses.size() +1) * sizeof(char*));
-		strncpy(resultInBuffer->h_name, parsedEntry.name.c_str(), parsedEntry.name.size());
-		char* lastPointer = resultInBuffer->h_name + (parsedEntry.name.size() +1);
-		for (int i = 0; i<parsedEntry.aliases.size(); i++)
+		return (alignment - (reinterpret_cast<uintptr_t>(buffer) % alignment)) % alignment;
+	}
+	/*
+	 Layout in buffer, after the padding needed to align the pointers:
+	 h_aliases vector, h_addr_list vector, addresses, h_name, aliases.
+	*/
+	bool copyHostEntryToBuffer(const HostEntry& parsedEntry, int family, hostent* result, char* buffer, size_t bufferSize)
+	{
+		size_t padding = alignmentPadding(buffer, alignof(char*));
+		if (padding + calculateBufferSize(parsedEntry, family) > bufferSize)  return false;
+		size_t count = addressCount(parsedEntry, family);
+		size_t length = addressLength(family);
+		const char* addresses = (family == AF_INET6) ? (const char*) parsedEntry.addresses6.data() : (const char*) parsedEntry.addresses.data();
+		char** aliases = (char**) (buffer + padding);
+		char** addressList = aliases + (parsedEntry.aliases.size() + 1);
+		char* lastPointer = (char*) (addressList + (count + 1));
+		for (size_t i = 0; i < count; i++)
 		{
-			auto& alias = parsedEntry.aliases[i];
-			strncpy(lastPointer, alias.c_str(), alias.size());
-			resultInBuffer->h_aliases[i] = lastPointer;
-			lastPointer += (alias.size() + 1);
+			memcpy(lastPointer, addresses + (i * length), length);
+			addressList[i] = lastPointer;
+			lastPointer += length;
 		}
-		for (int i = 0; i<parsedEntry.addresses.size(); i++)
+		addressList[count] = nullptr;
+		result->h_name = lastPointer;
+		memcpy(lastPointer, parsedEntry.name.c_str(), parsedEntry.name.size() + 1);
+		lastPointer += (parsedEntry.name.size() + 1);
+		for (size_t i = 0; i < parsedEntry.aliases.size(); i++)
 		{
-			auto& address = parsedEntry.addresses[i];
-			in_addr* addressPointer = (in_addr*) lastPointer;
-			*addressPointer = address;
-			resultInBuffer->h_addr_list[i] = lastPointer;
-			lastPointer += sizeof(in_addr);
+			auto& alias = parsedEntry.aliases[i];
+			memcpy(lastPointer, alias.c_str(), alias.size() + 1);
+			aliases[i] = lastPointer;
+			lastPointer += (alias.size() + 1);
 		}
-		memcpy(result, buffer, sizeof(hostent));
+		aliases[parsedEntry.aliases.size()] = nullptr;
+		result->h_aliases = aliases;
+		result->h_addr_list = addressList;
+		result->h_addrtype = family;
+		result->h_length = length;
+		return true;
 	}
-	void copyHostEntryToGaihBuffer(const HostEntry& parsedEntry, gaih_addrtuple** result, char* buffer, size_t bufferSize)
+	bool copyHostEntryToBuffer(const HostEntry& parsedEntry, hostent* result, char* buffer, size_t bufferSize)
 	{
-		memset(buffer, 0, bufferSize);
-		gaih_addrtuple* resultsBuffer = (gaih_addrtuple*) buffer;
-		char* hostnamePointer = buffer + (sizeof(gaih_addrtuple) * parsedEntry.addresses.size());
-		strncpy(hostnamePointer, parsedEntry.name.c_str(), parsedEntry.name.size());
-		for (int i=0; i< parsedEntry.addresses.size(); i++)
+		return copyHostEntryToBuffer(parsedEntry, AF_INET, result, buffer, bufferSize);
+	}
+	bool copyHostEntryToGaihBuffer(const HostEntry& parsedEntry, gaih_addrtuple** result, char* buffer, size_t bufferSize)
+	{
+		size_t padding = alignmentPadding(buffer, alignof(gaih_addrtuple));
+		if (padding + calculateGaihBufferSize(parsedEntry) > bufferSize)  return false;
+		size_t count = parsedEntry.addresses.size() + parsedEntry.addresses6.size();
+		gaih_addrtuple* resultsBuffer = (gaih_addrtuple*) (buffer + padding);
+		char* hostnamePointer = (char*) (resultsBuffer + count);
+		memcpy(hostnamePointer, parsedEntry.name.c_str(), parsedEntry.name.size() + 1);
+		for (size_t i = 0; i < count; i++)
 		{
-			resultsBuffer[i].next = (resultsBuffer + i +1);
-			resultsBuffer[i].family = AF_INET;
+			resultsBuffer[i].next = (i + 1 < count) ? (resultsBuffer + i + 1) : nullptr;
 			resultsBuffer[i].name = hostnamePointer;
 			resultsBuffer[i].scopeid = 0;
-			resultsBuffer[i].addr[0] = parsedEntry.addresses[i].s_addr;
+			if (i < parsedEntry.addresses.size())
+			{
+				resultsBuffer[i].family = AF_INET;
+				resultsBuffer[i].addr[0] = parsedEntry.addresses[i].s_addr;
+				resultsBuffer[i].addr[1] = 0;
+				resultsBuffer[i].addr[2] = 0;
+				resultsBuffer[i].addr[3] = 0;
+			}
+			else
+			{
+				resultsBuffer[i].family = AF_INET6;
+				memcpy(resultsBuffer[i].addr, &parsedEntry.addresses6[i - parsedEntry.addresses.size()], sizeof(in6_addr));
+			}
 		}
-		resultsBuffer[parsedEntry.addresses.size()-1].next = nullptr;
 		*result = resultsBuffer;
+		return true;
 	}
-	nss_status runNssCommandGethostbyname(const char* name, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, const char* command)
+	nss_status runNssCommandGethostbyname3(const char* name, int addressFamily, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, char** canonp, const char* command, const shared_ptr<PinnedCommand>& pinned)
 	{
-		string commandAndArgs = string(command) + " \'" + string(name) + "\' 2>/dev/null";
-		string commandOutput;
-		int commandReturnCode = run(commandAndArgs, commandOutput);
+		LookupTrace trace(TraceEntryPoint::gethostbyname3, name);
+		if (addressFamily != AF_INET && addressFamily != AF_INET6)  return notFoundExit(errnop, herrorp);
+		HostEntry parsedEntry;
+		int commandReturnCode = lookup(QueryKind::byName, command, name, parsedEntry, pinned);
+		traceReturnCode(commandReturnCode);
 		if (commandReturnCode != 0)  return unsuccessfulCommandExit(commandReturnCode, errnop, herrorp);
-		HostEntry parsedEntry = parseCommandOutput(commandOutput);
-		if (parsedEntry.addresses.empty())  return noDataExit(errnop, herrorp);
-		size_t necessaryBuffer = sizeof(hostent) + calculateBufferSize(parsedEntry);
-		if (necessaryBuffer > bufferSize)  return smallBufferExit(errnop, herrorp);
-		copyHostEntryToBuffer(parsedEntry, result, buffer, bufferSize);
+		if (addressCount(parsedEntry, addressFamily) == 0)  return noDataExit(errnop, herrorp);
+		bool copied = copyHostEntryToBuffer(parsedEntry, addressFamily, result, buffer, bufferSize);
+		traceStage(TraceStage::copied);
+		if (!copied)
+		{
+			keepForRetry(QueryKind::byName, command, name, parsedEntry);
+			return smallBufferExit(errnop, herrorp);
+		}
+		if (ttlp != nullptr && parsedEntry.ttl >= 0)  *ttlp = parsedEntry.ttl;
+		if (canonp != nullptr)  *canonp = result->h_name;
 		return successfulExit(errnop, herrorp);
 	}
-	nss_status runNssCommandGethostbyname4(const char* name, gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, const char* command)
+	nss_status runNssCommandGethostbyname(const char* name, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, const char* command, const shared_ptr<PinnedCommand>& pinned)
 	{
-		string commandAndArgs = string(command) + " \'" + string(name) + "\' 2>/dev/null";
-		string commandOutput;
-		int commandReturnCode = run(commandAndArgs, commandOutput);
-		if (commandReturnCode != 0)  return unsuccessfulCommandExit(commandReturnCode, errnop, herrorp);
-		HostEntry parsedEntry = parseCommandOutput(commandOutput);
-		if (parsedEntry.addresses.empty())  return noDataExit(errnop, herrorp);
-		size_t necessaryBuffer = calculateGaihBufferSize(parsedEntry);
-		if (necessaryBuffer > bufferSize)  return smallBufferExit(errnop, herrorp);
-		copyHostEntryToGaihBuffer(parsedEntry, pat, buffer, bufferSize);
-		return successfulExit(errnop, herrorp);
+		LookupTrace trace(TraceEntryPoint::gethostbyname, name);
+		return runNssCommandGethostbyname3(name, AF_INET, result, buffer, bufferSize, errnop, herrorp, nullptr, nullptr, command, pinned);
 	}
-	string ip4ToString(const void* address)
+	nss_status runNssCommandGethostbyname4(const char* name, gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, const char* command, const shared_ptr<PinnedCommand>& pinned)
 	{
-		socklen_t bufferSize = 512;
-		char* buffer = new char[bufferSize];
-		while(inet_ntop(AF_INET, address, buffer, bufferSize) == nullptr && errno == ENOSPC)
+		LookupTrace trace(TraceEntryPoint::gethostbyname4, name);
+		HostEntry parsedEntry;
+		int commandReturnCode = lookup(QueryKind::byName, command, name, parsedEntry, pinned);
+		traceReturnCode(commandReturnCode);
+		if (commandReturnCode != 0)  return unsuccessfulCommandExit(commandReturnCode, errnop, herrorp);
+		if (parsedEntry.addresses.empty() && parsedEntry.addresses6.empty())  return noDataExit(errnop, herrorp);
+		bool copied = copyHostEntryToGaihBuffer(parsedEntry, pat, buffer, bufferSize);
+		traceStage(TraceStage::copied);
+		if (!copied)
 		{
-			bufferSize *= 2;
-			delete[] buffer;
-			buffer = new char[bufferSize];
+			keepForRetry(QueryKind::byName, command, name, parsedEntry);
+			return smallBufferExit(errnop, herrorp);
 		}
-		string result(buffer);
-		delete[] buffer;
-		return result;
+		if (ttlp != nullptr && parsedEntry.ttl >= 0)  *ttlp = parsedEntry.ttl;
+		return successfulExit(errnop, herrorp);
 	}
-	nss_status runNssCommandGethostbyaddr(const void* address, socklen_t addressSize, int addressFamily, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop, const char* command)
+	nss_status runNssCommandGethostbyaddr(const void* address, socklen_t addressSize, int addressFamily, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop, const char* command, const shared_ptr<PinnedCommand>& pinned)
 	{
-		if (addressFamily == AF_INET6) return notFoundExit(errnop, herrnop);
-		string commandAndArgs = string(command) + " \'" + ip4ToString(address) + "\' 2>/dev/null";
-		string commandOutput;
-		int commandReturnCode = run(commandAndArgs, commandOutput);
+		if (addressFamily != AF_INET && addressFamily != AF_INET6)  return notFoundExit(errnop, herrnop);
+		if (addressSize < addressLength(addressFamily))  return notFoundExit(errnop, herrnop);
+		HostEntry parsedEntry;
+		string addressText = addressToString(address, addressFamily);
+		LookupTrace trace(TraceEntryPoint::gethostbyaddr, addressText.c_str());
+		int commandReturnCode = lookup(QueryKind::byAddress, command, addressText, parsedEntry, pinned);
+		traceReturnCode(commandReturnCode);
 		if (commandReturnCode != 0)  return unsuccessfulCommandExit(commandReturnCode, errnop, herrnop);
-		HostEntry parsedEntry = parseCommandOutput(commandOutput);
 		if (parsedEntry.name.empty())  return noDataExit(errnop, herrnop);
-		size_t necessaryBuffer = sizeof(hostent) + calculateBufferSize(parsedEntry);
-		if (necessaryBuffer > bufferSize)  return smallBufferExit(errnop, herrnop);
-		copyHostEntryToBuffer(parsedEntry, result, buffer, bufferSize);
+		if (addressCount(parsedEntry, addressFamily) == 0)
+		{
+			// the queried address is the address of the entry when the command doesn't give any
+			if (addressFamily == AF_INET6)  parsedEntry.addresses6.push_back(*(const in6_addr*) address);
+			else  parsedEntry.addresses.push_back(*(const in_addr*) address);
+		}
+		bool copied = copyHostEntryToBuffer(parsedEntry, addressFamily, result, buffer, bufferSize);
+		traceStage(TraceStage::copied);
+		if (!copied)
+		{
+			keepForRetry(QueryKind::byAddress, command, addressText, parsedEntry);
+			return smallBufferExit(errnop, herrnop);
+		}
 		return successfulExit(errnop, herrnop);
 	}
 }
 
 using namespace nssCommand;
 
+static const char* gethostbynameCommand()
+{
+	const Configuration& settings = configuration();
+	return settings.coprocessMode ? settings.coprocessCommand.c_str() : settings.gethostbynameCommand.c_str();
+}
+
+static const char* gethostbyaddrCommand()
+{
+	const Configuration& settings = configuration();
+	return settings.coprocessMode ? settings.coprocessCommand.c_str() : settings.gethostbyaddrCommand.c_str();
+}
+
 enum nss_status  _nss_command_gethostbyname_r(const char* name, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop)
 {
-	if (! fileHasRightPerms(DEFAULT_GETHOSTBYNAME_COMMAND)) return notAvailableExit(errnop, herrnop);
-	return nssCommand::runNssCommandGethostbyname(name, result, buffer, bufferSize, errnop, herrnop, DEFAULT_GETHOSTBYNAME_COMMAND);
+	metrics().add(Counter::gethostbynameLookups);
+	LookupTrace trace(TraceEntryPoint::gethostbyname, name);
+	const char* command = gethostbynameCommand();
+	shared_ptr<PinnedCommand> pinned = trustedCommand(command);
+	traceStage(TraceStage::permissionChecked);
+	if (!pinned) return notAvailableExit(errnop, herrnop);
+	return nssCommand::runNssCommandGethostbyname(name, result, buffer, bufferSize, errnop, herrnop, command, pinned);
 }
 
 enum nss_status _nss_command_gethostbyname2_r(const char* name, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop)
 {
-	if (addressFamily != AF_INET) return nssCommand::notFoundExit(errnop, herrnop);
-	if (! fileHasRightPerms(DEFAULT_GETHOSTBYNAME_COMMAND)) return notAvailableExit(errnop, herrnop);
-	return nssCommand::runNssCommandGethostbyname(name, result, buffer, bufferSize, errnop, herrnop, DEFAULT_GETHOSTBYNAME_COMMAND);
+	metrics().add(Counter::gethostbyname2Lookups);
+	LookupTrace trace(TraceEntryPoint::gethostbyname2, name);
+	if (addressFamily != AF_INET && addressFamily != AF_INET6) return nssCommand::notFoundExit(errnop, herrnop);
+	const char* command = gethostbynameCommand();
+	shared_ptr<PinnedCommand> pinned = trustedCommand(command);
+	traceStage(TraceStage::permissionChecked);
+	if (!pinned) return notAvailableExit(errnop, herrnop);
+	return nssCommand::runNssCommandGethostbyname3(name, addressFamily, result, buffer, bufferSize, errnop, herrnop, nullptr, nullptr, command, pinned);
 }
 
 enum nss_status _nss_command_gethostbyname3_r(const char* name, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp, char** canonp)
 {
-	if (addressFamily != AF_INET) return nssCommand::notFoundExit(errnop, herrnop);
-	if (! fileHasRightPerms(DEFAULT_GETHOSTBYNAME_COMMAND)) return notAvailableExit(errnop, herrnop);
-	nss_status ret = nssCommand::runNssCommandGethostbyname(name, result, buffer, bufferSize, errnop, herrnop, DEFAULT_GETHOSTBYNAME_COMMAND);
-	if (canonp != nullptr) *canonp = result->h_name;
-	return ret;
+	metrics().add(Counter::gethostbyname3Lookups);
+	LookupTrace trace(TraceEntryPoint::gethostbyname3, name);
+	if (addressFamily != AF_INET && addressFamily != AF_INET6) return nssCommand::notFoundExit(errnop, herrnop);
+	const char* command = gethostbynameCommand();
+	shared_ptr<PinnedCommand> pinned = trustedCommand(command);
+	traceStage(TraceStage::permissionChecked);
+	if (!pinned) return notAvailableExit(errnop, herrnop);
+	return nssCommand::runNssCommandGethostbyname3(name, addressFamily, result, buffer, bufferSize, errnop, herrnop, ttlp, canonp, command, pinned);
 }
 enum nss_status _nss_command_gethostbyname4_r(const char* name, struct gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp)
 {
-	if (! fileHasRightPerms(DEFAULT_GETHOSTBYNAME_COMMAND)) return notAvailableExit(errnop, herrnop);
-	return nssCommand::runNssCommandGethostbyname4(name, pat, buffer, bufferSize, errnop, herrnop, ttlp, DEFAULT_GETHOSTBYNAME_COMMAND);
+	metrics().add(Counter::gethostbyname4Lookups);
+	LookupTrace trace(TraceEntryPoint::gethostbyname4, name);
+	const char* command = gethostbynameCommand();
+	shared_ptr<PinnedCommand> pinned = trustedCommand(command);
+	traceStage(TraceStage::permissionChecked);
+	if (!pinned) return notAvailableExit(errnop, herrnop);
+	return nssCommand::runNssCommandGethostbyname4(name, pat, buffer, bufferSize, errnop, herrnop, ttlp, command, pinned);
 }
 
 enum nss_status _nss_command_gethostbyaddr_r(const void* address, socklen_t addressSize, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop)
 {
-	if (! fileHasRightPerms(DEFAULT_GETHOSTBYADDR_COMMAND)) return notAvailableExit(errnop, herrnop);
-	return nssCommand::runNssCommandGethostbyaddr(address, addressSize, addressFamily, result, buffer, bufferSize, errnop, herrnop, DEFAULT_GETHOSTBYADDR_COMMAND);
+	metrics().add(Counter::gethostbyaddrLookups);
+	LookupTrace trace(TraceEntryPoint::gethostbyaddr, nullptr);
+	const char* command = gethostbyaddrCommand();
+	shared_ptr<PinnedCommand> pinned = trustedCommand(command);
+	traceStage(TraceStage::permissionChecked);
+	if (!pinned) return notAvailableExit(errnop, herrnop);
+	return nssCommand::runNssCommandGethostbyaddr(address, addressSize, addressFamily, result, buffer, bufferSize, errnop, herrnop, command, pinned);
 }
 
 //enum nss_status _nss_command_gethostbyaddr2_r(const void* addr, socklen_t len, int af, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* h_errhop, int32_t* ttlp)
@@ -9,50 +9,82 @@
 #include <nss.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <memory>
 #include <string>
 #include <vector>
 
+// The module is built with hidden visibility, so the entry points are the only symbols it exports
+#define NSS_COMMAND_EXPORT __attribute__((visibility("default")))
+
 extern "C" {
-	enum nss_status  _nss_command_gethostbyname_r(const char* name, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
-	enum nss_status _nss_command_gethostbyname2_r(const char* name, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
-	enum nss_status _nss_command_gethostbyname3_r(const char* name, int af, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp, char** canonp);
-	enum nss_status _nss_command_gethostbyname4_r(const char* name, struct gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp);
-	enum nss_status _nss_command_gethostbyaddr_r(const void* address, socklen_t addressSize, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
+	NSS_COMMAND_EXPORT enum nss_status  _nss_command_gethostbyname_r(const char* name, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
+	NSS_COMMAND_EXPORT enum nss_status _nss_command_gethostbyname2_r(const char* name, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
+	NSS_COMMAND_EXPORT enum nss_status _nss_command_gethostbyname3_r(const char* name, int af, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp, char** canonp);
+	NSS_COMMAND_EXPORT enum nss_status _nss_command_gethostbyname4_r(const char* name, struct gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrnop, int32_t* ttlp);
+	NSS_COMMAND_EXPORT enum nss_status _nss_command_gethostbyaddr_r(const void* address, socklen_t addressSize, int addressFamily, struct hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrnop);
 }
 
 bool operator == (const in_addr& lhs, const in_addr& rhs);
+bool operator == (const in6_addr& lhs, const in6_addr& rhs);
 
 namespace nssCommand
 {
 	using namespace std;
 
+	enum class QueryKind : char { byName = 'n', byAddress = 'a' };
+
 	class HostEntry
 	{
 	public:
 		HostEntry() = default;
 		HostEntry(const HostEntry&) = default;
 		HostEntry(HostEntry&&) = default;
-		bool operator == (const HostEntry& rho)
+		HostEntry& operator = (const HostEntry&) = default;
+		HostEntry& operator = (HostEntry&&) = default;
+		bool operator == (const HostEntry& rho) const
 		{
 			if (name != rho.name) return false;
 			if (aliases != rho.aliases) return false;
 			if (addresses != rho.addresses) return false;
+			if (addresses6 != rho.addresses6) return false;
+			if (ttl != rho.ttl) return false;
 			return true;
 		}
 		string name;
 		vector<string> aliases;
 		vector<in_addr> addresses;
+		vector<in6_addr> addresses6;
+		int32_t ttl = -1; // seconds the entry is valid for, -1 if the command didn't tell
 	};
 
+	class PinnedCommand;
+
 	bool fileHasRightPerms(const string& filename);
+	// Returns the number of lines that were not understood, or had invalid values
+	size_t parseCommandOutput(const char* text, size_t size, HostEntry& result);
 	HostEntry parseCommandOutput(const string& text);
+	/*
+	 The functions executing a command take the pinned command checked by the caller and
+	 execute the file it holds open. Without one the command is executed by its path, which
+	 is only meant for commands that don't come from the configuration, like the ones of the
+	 tests and tools. The entry points never execute a command they haven't pinned.
+	*/
+	int run(const vector<string>& args, string& output, int timeoutMilliseconds, size_t maxOutputSize, const shared_ptr<PinnedCommand>& pinned = nullptr);
+	int run(const vector<string>& args, string& output);
 	int run(const string& cmd, string& output);
+	int runCommand(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned = nullptr);
+	int execute(QueryKind kind, const char* command, const string& argument, HostEntry& entry, const shared_ptr<PinnedCommand>& pinned = nullptr);
+	size_t calculateBufferSize(const HostEntry& entry, int family);
 	size_t calculateBufferSize(const HostEntry& entry);
 	size_t calculateGaihBufferSize(const HostEntry& entry);
-	nss_status runNssCommandGethostbyname(const char* name, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, const char* command);
+	bool copyHostEntryToBuffer(const HostEntry& parsedEntry, int family, hostent* result, char* buffer, size_t bufferSize);
+	bool copyHostEntryToBuffer(const HostEntry& parsedEntry, hostent* result, char* buffer, size_t bufferSize);
+	bool copyHostEntryToGaihBuffer(const HostEntry& parsedEntry, gaih_addrtuple** result, char* buffer, size_t bufferSize);
+	nss_status runNssCommandGethostbyname3(const char* name, int addressFamily, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, char** canonp, const char* command, const shared_ptr<PinnedCommand>& pinned = nullptr);
+	nss_status runNssCommandGethostbyname(const char* name, hostent* result, char* buffer, size_t bufferSize, int* errnop, int* herrorp, const char* command, const shared_ptr<PinnedCommand>& pinned = nullptr);
 	nss_status runNssCommandGethostbyaddr(const void* address, socklen_t addressSize, int addressFamily, hostent* result, char* buffer, size_t
-bufferSize, int* errnop, int* herrnop, const char* command);
-	nss_status runNssCommandGethostbyname4(const char* name, gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, const char* command);
+bufferSize, int* errnop, int* herrnop, const char* command, const shared_ptr<PinnedCommand>& pinned = nullptr);
+	nss_status runNssCommandGethostbyname4(const char* name, gaih_addrtuple** pat, char* buffer, size_t bufferSize, int* errnop, int* herrorp, int32_t* ttlp, const char* command, const shared_ptr<PinnedCommand>& pinned = nullptr);
 }
 
 #endif
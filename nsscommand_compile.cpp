@@ -0,0 +1,77 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "nss_command.hpp"
+#include "host_database.hpp"
+#include "configuration.hpp"
+#include <errno.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+using namespace std;
+using namespace nssCommand;
+
+void usage(const char* program)
+{
+	cerr << "Usage: " << program << " [-o database] [file...]" << endl;
+	cerr << "Compiles the hosts in the files, or in the standard input, written in the commands output format." << endl;
+}
+
+bool readInput(istream& input, string& text)
+{
+	text.append(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+	text += '\n';
+	return !input.bad();
+}
+
+int main(int argc, char** argv)
+{
+	string databasePath = configuration().hostDatabasePath;
+	int option;
+	while ((option = getopt(argc, argv, "o:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'o':
+				databasePath = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	string text;
+	if (optind == argc && !readInput(cin, text))
+	{
+		cerr << "Can't read the standard input" << endl;
+		return 1;
+	}
+	for (int i = optind; i < argc; i++)
+	{
+		ifstream input(argv[i], ios::binary);
+		if (!input || !readInput(input, text))
+		{
+			cerr << "Can't read " << argv[i] << ": " << strerror(errno) << endl;
+			return 1;
+		}
+	}
+	vector<HostEntry> entries = parseHostList(text);
+	if (!HostDatabase::write(databasePath, entries))
+	{
+		cerr << "Can't write " << databasePath << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	unique_ptr<HostDatabase> database = HostDatabase::open(databasePath, geteuid());
+	if (database)
+	{
+		cout << entries.size() << " hosts, " << database->nameCount() << " names and " << database->addressCount() << " addresses written to " << databasePath << endl;
+	}
+	return 0;
+}
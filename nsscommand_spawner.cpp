@@ -0,0 +1,192 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Helper started by the module when spawner_mode is enabled. It receives the requests of
+ the module through its standard input and forks and executes the commands from its own
+ small address space, reporting their pid and later their wait status. The messages are
+ described in spawner.hpp. It exits once the module closes the socket and the commands it
+ started have ended.
+*/
+
+#include "spawner.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+extern char** environ;
+
+using namespace std;
+using namespace nssCommand;
+
+struct RunningCommand
+{
+	int replyFd;
+	bool killed;
+};
+
+void sendReply(int fd, SpawnReplyKind kind, int32_t value)
+{
+	SpawnReply reply = { kind, value };
+	send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+// Receives the next request. Returns false once the module has closed the socket
+bool receiveRequest(int fd, vector<string>& args, vector<int>& descriptors, bool& valid)
+{
+	static char buffer[MAX_SPAWN_REQUEST_SIZE];
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	iovec data = { buffer, sizeof(buffer) };
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	valid = false;
+	ssize_t received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+	if (received < 0) return errno == EINTR || errno == EAGAIN;
+	if (received == 0) return false;
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+		size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++)
+		{
+			int descriptor;
+			memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+			descriptors.push_back(descriptor);
+		}
+	}
+	if ((message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 || size_t(received) < sizeof(SpawnRequest)) return true;
+	SpawnRequest request;
+	memcpy(&request, buffer, sizeof(request));
+	if (request.arguments == 0 || descriptors.size() != (request.hasExecutable ? 3u : 2u)) return true;
+	const char* current = buffer + sizeof(request);
+	const char* end = buffer + received;
+	while (current < end)
+	{
+		const char* terminator = (const char*) memchr(current, '\0', end - current);
+		if (terminator == nullptr) return true;
+		args.emplace_back(current, terminator);
+		current = terminator + 1;
+	}
+	valid = (args.size() == request.arguments);
+	return true;
+}
+
+// Forks the command in its own process group, with the standard output given by the module
+pid_t startCommand(const vector<string>& args, int outputFd, int executableFd)
+{
+	string executable = (executableFd >= 0) ? "/proc/self/fd/" + to_string(executableFd) : args[0];
+	vector<char*> argv;
+	for (auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, nullptr);
+	setpgid(0, 0);
+	int nullFd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	dup2(nullFd, STDIN_FILENO);
+	dup2(outputFd, STDOUT_FILENO);
+	dup2(nullFd, STDERR_FILENO);
+	if (executableFd >= 0) fcntl(executableFd, F_SETFD, 0); // keeps it open for interpreted scripts
+	execve(executable.c_str(), argv.data(), environ);
+	_exit(127); // same as the shell would return
+}
+
+void serveRequest(int control, map<pid_t, RunningCommand>& running, bool& accepting)
+{
+	vector<string> args;
+	vector<int> descriptors;
+	bool valid;
+	if (!receiveRequest(control, args, descriptors, valid)) accepting = false;
+	if (!valid)
+	{
+		for (int descriptor : descriptors) close(descriptor);
+		return;
+	}
+	int replyFd = descriptors[0];
+	pid_t pid = startCommand(args, descriptors[1], (descriptors.size() > 2) ? descriptors[2] : -1);
+	int error = errno;
+	for (size_t i = 1; i < descriptors.size(); i++) close(descriptors[i]);
+	if (pid < 0)
+	{
+		sendReply(replyFd, SpawnReplyKind::failed, error);
+		close(replyFd);
+		return;
+	}
+	setpgid(pid, pid); // also here, so the group exists even if it's killed before the child sets it
+	sendReply(replyFd, SpawnReplyKind::started, pid);
+	running[pid] = RunningCommand{ replyFd, false };
+}
+
+void reapCommands(map<pid_t, RunningCommand>& running)
+{
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		auto found = running.find(pid);
+		if (found == running.end()) continue;
+		sendReply(found->second.replyFd, SpawnReplyKind::exited, status);
+		close(found->second.replyFd);
+		running.erase(found);
+	}
+}
+
+int main()
+{
+	const int control = STDIN_FILENO;
+	sigset_t children;
+	sigemptyset(&children);
+	sigaddset(&children, SIGCHLD);
+	signal(SIGCHLD, SIG_DFL); // ignored in the module would mean children are never waited for
+	sigprocmask(SIG_BLOCK, &children, nullptr);
+	int childrenFd = signalfd(-1, &children, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (childrenFd < 0) return 1;
+	map<pid_t, RunningCommand> running;
+	bool accepting = true;
+	while (accepting || !running.empty())
+	{
+		vector<pollfd> waiting = { pollfd{ childrenFd, POLLIN, 0 }, pollfd{ accepting ? control : -1, POLLIN, 0 } };
+		vector<pid_t> waitingCommands;
+		for (auto& command : running)
+		{
+			if (command.second.killed) continue;
+			// The module never writes in the reply socket, it only closes it to stop the command
+			waiting.push_back(pollfd{ command.second.replyFd, POLLIN, 0 });
+			waitingCommands.push_back(command.first);
+		}
+		if (poll(waiting.data(), waiting.size(), -1) < 0 && errno != EINTR) return 1;
+		if (waiting[0].revents != 0)
+		{
+			signalfd_siginfo information;
+			while (read(childrenFd, &information, sizeof(information)) > 0);
+		}
+		reapCommands(running);
+		if (waiting[1].revents != 0) serveRequest(control, running, accepting);
+		for (size_t i = 0; i < waitingCommands.size(); i++)
+		{
+			if (waiting[i + 2].revents == 0) continue;
+			auto found = running.find(waitingCommands[i]);
+			if (found == running.end()) continue;
+			kill(-found->first, SIGKILL);
+			found->second.killed = true;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Prints the metrics every process using the module keeps in the shared metrics file.
+ The file is only read, so it doesn't disturb the processes updating it.
+*/
+
+#include "metrics.hpp"
+#include "configuration.hpp"
+#include <unistd.h>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace nssCommand;
+
+void usage(const char* program)
+{
+	cerr << "Usage: " << program << " [-f metrics file] [-z]" << endl;
+	cerr << "  -z  also prints the counters that are zero" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	string path = configuration().metricsPath;
+	bool zeros = false;
+	int option;
+	while ((option = getopt(argc, argv, "f:zh")) != -1)
+	{
+		switch (option)
+		{
+			case 'f':
+				path = optarg;
+				break;
+			case 'z':
+				zeros = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	unique_ptr<Metrics> shared = Metrics::openForReading(path, 0);
+	if (!shared)
+	{
+		cerr << "Can't read metrics from " << path << ", check that metrics_mode is enabled, the file is owned by root and not writable by others, and the module was built from the same version" << endl;
+		return 1;
+	}
+	MetricsSnapshot totals = shared->snapshot();
+	for (size_t i = 0; i < COUNTER_COUNT; i++)
+	{
+		if (totals.counters[i] == 0 && !zeros) continue;
+		printf("%-24s %llu\n", counterName(Counter(i)), (unsigned long long) totals.counters[i]);
+	}
+	printf("\n%-24s %12s %12s %12s %12s %12s\n", "histogram (us)", "count", "mean", "p50", "p99", "p99.9");
+	for (size_t h = 0; h < HISTOGRAM_COUNT; h++)
+	{
+		Histogram histogram = Histogram(h);
+		uint64_t count = totals.count(histogram);
+		double mean = (count > 0) ? totals.sums[h] / 1000.0 / count : 0;
+		printf("%-24s %12llu %12.1f %12.1f %12.1f %12.1f\n", histogramName(histogram), (unsigned long long) count, mean,
+			totals.percentile(histogram, 0.5) / 1000.0, totals.percentile(histogram, 0.99) / 1000.0, totals.percentile(histogram, 0.999) / 1000.0);
+	}
+	return 0;
+}
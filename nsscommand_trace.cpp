@@ -0,0 +1,171 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Prints the lookups kept in the trace buffers of the processes using the module, oldest
+ first, with the time spent in each stage of them. Reads the buffers given as arguments,
+ or every buffer next to the configured trace path, and then removes the buffers of the
+ processes no longer running.
+*/
+
+#include "trace.hpp"
+#include "configuration.hpp"
+#include <dirent.h>
+#include <nss.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace nssCommand;
+
+void usage(const char* program)
+{
+	cerr << "Usage: " << program << " [-k | -c] [trace file...]" << endl;
+	cerr << "  -k  keeps the files of processes no longer running instead of removing them after printing them" << endl;
+	cerr << "  -c  only removes the files of processes no longer running, without printing anything" << endl;
+}
+
+struct FinishedFile
+{
+	string path;
+	pid_t pid;
+	dev_t device;
+	ino_t inode;
+};
+
+// Pid the file is named after, or 0 if the name doesn't end with one
+pid_t tracePid(const string& file)
+{
+	size_t dot = file.rfind('.');
+	if (dot == string::npos || dot + 1 == file.size() || file.find_first_not_of("0123456789", dot + 1) != string::npos) return 0;
+	long pid = strtol(file.c_str() + dot + 1, nullptr, 10);
+	return (pid > 0 && pid == pid_t(pid)) ? pid_t(pid) : 0;
+}
+
+bool finishedProcess(pid_t pid)
+{
+	return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+vector<string> traceFiles(const string& tracePath)
+{
+	size_t slash = tracePath.rfind('/');
+	string directory = (slash == string::npos) ? "." : tracePath.substr(0, slash + 1);
+	string prefix = tracePath.substr(slash == string::npos ? 0 : slash + 1) + ".";
+	vector<string> files;
+	DIR* listing = opendir(directory.c_str());
+	if (listing == nullptr) return files;
+	while (dirent* item = readdir(listing))
+	{
+		string name = item->d_name;
+		if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > prefix.size()) files.push_back(directory + name);
+	}
+	closedir(listing);
+	sort(files.begin(), files.end());
+	return files;
+}
+
+const char* statusName(int status)
+{
+	switch (status)
+	{
+		case NSS_STATUS_TRYAGAIN: return "TRYAGAIN";
+		case NSS_STATUS_UNAVAIL: return "UNAVAIL";
+		case NSS_STATUS_NOTFOUND: return "NOTFOUND";
+		case NSS_STATUS_SUCCESS: return "SUCCESS";
+		default: return "UNKNOWN";
+	}
+}
+
+void printEvent(const TraceEvent& event)
+{
+	time_t seconds = event.startTime / 1000000000;
+	tm local;
+	localtime_r(&seconds, &local);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+	printf("%s.%06lld pid=%d %s %s status=%s errno=%d herrno=%d rc=%d bytes=%u total=%.1fus",
+		when, (long long) (event.startTime % 1000000000) / 1000, event.pid, traceEntryPointName(event.entryPoint), event.query,
+		statusName(event.status), event.errorNumber, event.hostError, event.returnCode, event.outputSize, event.duration / 1000.0);
+	// Each stage took from the last stage reached before it
+	uint64_t previous = 0;
+	for (size_t stage = 0; stage < TRACE_STAGES; stage++)
+	{
+		if (event.stages[stage] == 0) continue;
+		printf(" %s=%.1f", traceStageName(stage), (event.stages[stage] - min(previous, event.stages[stage])) / 1000.0);
+		previous = event.stages[stage];
+	}
+	if (event.readTime != 0) printf(" (reading=%.1f)", event.readTime / 1000.0);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	bool removeFinished = true;
+	bool print = true;
+	int option;
+	while ((option = getopt(argc, argv, "kch")) != -1)
+	{
+		switch (option)
+		{
+			case 'k':
+				removeFinished = false;
+				break;
+			case 'c':
+				print = false;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	vector<string> files(argv + optind, argv + argc);
+	if (files.empty()) files = traceFiles(configuration().tracePath);
+	if (!print && !removeFinished)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	vector<TraceEvent> events;
+	vector<FinishedFile> finished;
+	for (auto& file : files)
+	{
+		// Checked before opening it, a process started later with the same pid replaces the file
+		pid_t pid = tracePid(file);
+		struct stat properties;
+		bool removable = finishedProcess(pid) && stat(file.c_str(), &properties) == 0;
+		unique_ptr<TraceBuffer> buffer = TraceBuffer::openForReading(file);
+		if (!buffer)
+		{
+			cerr << "Ignoring " << file << ", it isn't a trace file" << endl;
+			continue;
+		}
+		if (removable && buffer->pid() == pid) finished.push_back(FinishedFile{ file, pid, properties.st_dev, properties.st_ino });
+		if (!print) continue;
+		vector<TraceEvent> found = buffer->read();
+		events.insert(events.end(), found.begin(), found.end());
+	}
+	stable_sort(events.begin(), events.end(), [](const TraceEvent& lhs, const TraceEvent& rhs) { return lhs.startTime < rhs.startTime; });
+	for (auto& event : events) printEvent(event);
+	if (removeFinished)
+	{
+		for (auto& file : finished)
+		{
+			struct stat properties;
+			if (stat(file.path.c_str(), &properties) != 0 || properties.st_dev != file.device || properties.st_ino != file.inode) continue;
+			if (finishedProcess(file.pid)) unlink(file.path.c_str());
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "nss_command.hpp"
+#include "cache.hpp"
+#include "configuration.hpp"
+#include "resolver_socket.hpp"
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+using namespace nssCommand;
+
+const unsigned DEFAULT_MAX_CLIENTS = 64;
+// Wait after a failed accept, doubled on each further failure, in milliseconds
+const int ACCEPT_BACKOFF = 10;
+const int MAX_ACCEPT_BACKOFF = 1000;
+
+void usage(const char* program)
+{
+	cerr << "Usage: " << program << " [-s socket] [-n gethostbyname command] [-a gethostbyaddr command] [-c max clients]" << endl;
+}
+
+// Bounds the clients served at the same time, each one takes a thread
+class ClientSlots
+{
+public:
+	explicit ClientSlots(unsigned limit) : limit(limit), used(0) {}
+	void acquire()
+	{
+		unique_lock<mutex> guard(lock);
+		released.wait(guard, [this]() { return used < limit; });
+		used++;
+	}
+	void release()
+	{
+		lock_guard<mutex> guard(lock);
+		used--;
+		released.notify_one();
+	}
+private:
+	unsigned limit;
+	unsigned used;
+	mutex lock;
+	condition_variable released;
+};
+
+int main(int argc, char** argv)
+{
+	string socketPath = configuration().socketPath;
+	string gethostbynameCommand = configuration().gethostbynameCommand;
+	string gethostbyaddrCommand = configuration().gethostbyaddrCommand;
+	unsigned maxClients = (configuration().concurrencyLimit > 0) ? configuration().concurrencyLimit : DEFAULT_MAX_CLIENTS;
+	int option;
+	while ((option = getopt(argc, argv, "s:n:a:c:h")) != -1)
+	{
+		switch (option)
+		{
+			case 's':
+				socketPath = optarg;
+				break;
+			case 'n':
+				gethostbynameCommand = optarg;
+				break;
+			case 'a':
+				gethostbyaddrCommand = optarg;
+				break;
+			case 'c':
+				maxClients = strtoul(optarg, nullptr, 10);
+				if (maxClients > 0) break;
+				usage(argv[0]);
+				return 2;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	int listening = listenSocket(socketPath);
+	if (listening < 0)
+	{
+		cerr << "Can't listen on " << socketPath << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	ResolverService service(gethostbynameCommand, gethostbyaddrCommand, resultCache(), true);
+	ClientSlots slots(maxClients);
+	// A client must send its queries and take the answers within this time
+	int clientTimeout = configuration().socketTimeout + configuration().commandTimeout;
+	int backoff = ACCEPT_BACKOFF;
+	while (true)
+	{
+		// Further clients wait in the listen queue, and give up after their own timeout
+		slots.acquire();
+		int client = accept4(listening, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0)
+		{
+			slots.release();
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			// Out of descriptors or memory for now, the clients already served will free them
+			cerr << "accept: " << strerror(errno) << endl;
+			this_thread::sleep_for(chrono::milliseconds(backoff));
+			backoff = min(backoff * 2, MAX_ACCEPT_BACKOFF);
+			continue;
+		}
+		backoff = ACCEPT_BACKOFF;
+		setSocketTimeouts(client, clientTimeout);
+		try
+		{
+			thread([&service, &slots, client]() {
+				service.serveClient(client);
+				slots.release();
+			}).detach();
+		}
+		catch (const system_error&)
+		{
+			close(client);
+			slots.release();
+		}
+	}
+}
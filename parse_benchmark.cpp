@@ -0,0 +1,51 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Compares the time spent parsing command outputs of growing size by the scanner in
+ parseCommandOutput and by the former regex based parser.
+*/
+
+#include "nss_command.hpp"
+#include "reference_parser.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace nssCommand;
+
+template <typename Function>
+double averageMicroseconds(int iterations, Function function)
+{
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) function();
+	chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / iterations;
+}
+
+string sampleOutput(int addresses)
+{
+	string output = "name: myhost.domain.tld.\nalias: myhost\nalias: myalias.domain.tld.\n";
+	for (int i = 0; i < addresses; i++) output += "ip4: 10." + to_string(i / 65536 % 256) + "." + to_string(i / 256 % 256) + "." + to_string(i % 256) + "\n";
+	output += "# ignored comment line\n";
+	return output;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+	size_t checksum = 0;
+	cout << "ip4_lines\tregex_us\tscanner_us" << endl;
+	for (int addresses : { 1, 10, 100, 1000 })
+	{
+		string output = sampleOutput(addresses);
+		double regexLatency = averageMicroseconds(iterations, [&]() { checksum += parseCommandOutputWithRegex(output).addresses.size(); });
+		double scannerLatency = averageMicroseconds(iterations, [&]() { checksum += parseCommandOutput(output).addresses.size(); });
+		cout << addresses << "\t" << regexLatency << "\t" << scannerLatency << endl;
+	}
+	return checksum == 0;
+}
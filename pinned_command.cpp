@@ -0,0 +1,123 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "pinned_command.hpp"
+#include "configuration.hpp"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include "nss_command.hpp"
+
+using namespace std;
+
+namespace nssCommand
+{
+	shared_ptr<PinnedCommand> PinnedCommand::open(const string& path, uid_t owner)
+	{
+		int fd = ::open(path.c_str(), O_PATH | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || properties.st_mode != 0100755 || properties.st_uid != owner)
+		{
+			close(fd);
+			return nullptr;
+		}
+		return shared_ptr<PinnedCommand>(new PinnedCommand(path, fd, properties));
+	}
+	PinnedCommand::PinnedCommand(const string& path, int fd, const struct stat& properties) : path(path), fd(fd), properties(properties)
+	{
+	}
+	PinnedCommand::~PinnedCommand()
+	{
+		close(fd);
+	}
+	bool PinnedCommand::changed() const
+	{
+		struct stat current;
+		if (stat(path.c_str(), &current) != 0) return true;
+		return current.st_dev != properties.st_dev || current.st_ino != properties.st_ino
+			|| current.st_mtim.tv_sec != properties.st_mtim.tv_sec || current.st_mtim.tv_nsec != properties.st_mtim.tv_nsec
+			|| current.st_ctim.tv_sec != properties.st_ctim.tv_sec || current.st_ctim.tv_nsec != properties.st_ctim.tv_nsec;
+	}
+	string PinnedCommand::executablePath() const
+	{
+		return "/proc/self/fd/" + to_string(fd);
+	}
+
+	struct TrustedCommand
+	{
+		TrustedCommand(const shared_ptr<PinnedCommand>& pinned, uid_t owner, int64_t nextCheck) : pinned(pinned), owner(owner), nextCheck(nextCheck) {}
+		const shared_ptr<PinnedCommand> pinned;
+		const uid_t owner;
+		// In milliseconds of the steady clock
+		atomic<int64_t> nextCheck;
+	};
+	typedef map<string, shared_ptr<TrustedCommand>> TrustedCommands;
+	/*
+	 The pinned commands are published as an immutable snapshot, replaced only when a
+	 command is added or its file changes. Each thread keeps its own reference to the last
+	 snapshot it used and only takes the lock, which is never held across a system call,
+	 to pick up a new one. Once the revalidation interval of a command has elapsed a
+	 single thread checks it again, the others keep using its current pin meanwhile.
+	*/
+	mutex trustedCommandsLock;
+	// Never destroyed, background refreshes may look up commands while the process exits
+	shared_ptr<const TrustedCommands>& trustedCommands = *new shared_ptr<const TrustedCommands>();
+	atomic<unsigned> trustedCommandsGeneration(0);
+	atomic<bool> trustedCommandsChecking(false);
+	void publishTrustedCommand(const string& path, const shared_ptr<TrustedCommand>& trusted)
+	{
+		// Released once the lock is, it may close the last reference to a replaced pin
+		shared_ptr<const TrustedCommands> previous;
+		lock_guard<mutex> guard(trustedCommandsLock);
+		previous = trustedCommands;
+		TrustedCommands* next = previous ? new TrustedCommands(*previous) : new TrustedCommands();
+		(*next)[path] = trusted;
+		trustedCommands.reset(next);
+		trustedCommandsGeneration.fetch_add(1, memory_order_release);
+	}
+	shared_ptr<PinnedCommand> trustedCommand(const string& path, uid_t owner)
+	{
+		static pthread_once_t atforkRegistered = PTHREAD_ONCE_INIT;
+		pthread_once(&atforkRegistered, []() {
+			pthread_atfork([]() { trustedCommandsLock.lock(); }, []() { trustedCommandsLock.unlock(); }, []() {
+				trustedCommandsLock.unlock();
+				trustedCommandsChecking.store(false, memory_order_relaxed); // the checking thread doesn't exist in the child
+			});
+		});
+		static thread_local shared_ptr<const TrustedCommands> used;
+		static thread_local unsigned usedGeneration = 0;
+		if (usedGeneration != trustedCommandsGeneration.load(memory_order_acquire))
+		{
+			lock_guard<mutex> guard(trustedCommandsLock);
+			used = trustedCommands;
+			usedGeneration = trustedCommandsGeneration.load(memory_order_relaxed);
+		}
+		int64_t now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t nextCheck = now + int64_t(configuration().commandRevalidationInterval) * 1000;
+		shared_ptr<TrustedCommand> trusted;
+		if (used)
+		{
+			auto found = used->find(path);
+			if (found != used->end() && found->second->owner == owner) trusted = found->second;
+		}
+		if (!trusted)
+		{
+			shared_ptr<PinnedCommand> pinned = PinnedCommand::open(path, owner);
+			publishTrustedCommand(path, make_shared<TrustedCommand>(pinned, owner, nextCheck));
+			return pinned;
+		}
+		if (now < trusted->nextCheck.load(memory_order_relaxed) || trustedCommandsChecking.exchange(true, memory_order_acquire)) return trusted->pinned;
+		trusted->nextCheck.store(nextCheck, memory_order_relaxed);
+		shared_ptr<PinnedCommand> pinned = (trusted->pinned && !trusted->pinned->changed()) ? trusted->pinned : PinnedCommand::open(path, owner);
+		if (pinned != trusted->pinned) publishTrustedCommand(path, make_shared<TrustedCommand>(pinned, owner, nextCheck));
+		trustedCommandsChecking.store(false, memory_order_release);
+		return pinned;
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_PINNED_COMMAND_H
+#define _NSSCOMMAND_PINNED_COMMAND_H 1
+
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Command file opened with O_PATH once its owner and permissions have been checked.
+	 The command is executed through the descriptor, so replacing the file after the
+	 check doesn't change what gets executed.
+	*/
+	class PinnedCommand
+	{
+	public:
+		static shared_ptr<PinnedCommand> open(const string& path, uid_t owner);
+		PinnedCommand(const PinnedCommand&) = delete;
+		PinnedCommand& operator = (const PinnedCommand&) = delete;
+		~PinnedCommand();
+		bool changed() const;
+		int descriptor() const { return fd; }
+		string executablePath() const;
+	private:
+		PinnedCommand(const string& path, int fd, const struct stat& properties);
+		string path;
+		int fd;
+		struct stat properties;
+	};
+
+	/*
+	 Returns the pinned command for path if it's owned by owner and has modes 755, or
+	 nullptr otherwise. The result is reused for command_revalidation_interval
+	 seconds, after that the file is checked again only if it has changed.
+	*/
+	shared_ptr<PinnedCommand> trustedCommand(const string& path, uid_t owner = 0);
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "protocol.hpp"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdlib>
+
+using namespace std;
+
+namespace nssCommand
+{
+	bool formatRequest(QueryKind kind, const string& argument, string& request)
+	{
+		if (argument.empty() || argument.find_first_of(" \t\r\n") != string::npos) return false;
+		request = (kind == QueryKind::byName ? "byname " : "byaddr ") + argument + "\n";
+		return true;
+	}
+	bool parseRequest(const string& line, QueryKind& kind, string& argument)
+	{
+		if (line.compare(0, 7, "byname ") == 0) kind = QueryKind::byName;
+		else if (line.compare(0, 7, "byaddr ") == 0) kind = QueryKind::byAddress;
+		else return false;
+		argument = line.substr(7);
+		return !argument.empty() && argument.find_first_of(" \t\r\n") == string::npos;
+	}
+	string formatHostEntry(const HostEntry& entry)
+	{
+		string text;
+		if (!entry.name.empty()) text += "name: " + entry.name + "\n";
+		for (auto& alias : entry.aliases) text += "alias: " + alias + "\n";
+		for (auto& address : entry.addresses)
+		{
+			char buffer[INET_ADDRSTRLEN];
+			if (inet_ntop(AF_INET, &address, buffer, sizeof(buffer)) != nullptr) text += string("ip4: ") + buffer + "\n";
+		}
+		for (auto& address : entry.addresses6)
+		{
+			char buffer[INET6_ADDRSTRLEN];
+			if (inet_ntop(AF_INET6, &address, buffer, sizeof(buffer)) != nullptr) text += string("ip6: ") + buffer + "\n";
+		}
+		if (entry.ttl >= 0) text += "ttl: " + to_string(entry.ttl) + "\n";
+		return text;
+	}
+	string formatResponse(int returnCode, const string& output)
+	{
+		return output + "status: " + to_string(returnCode) + "\n";
+	}
+	bool sendAll(int fd, const string& data)
+	{
+		size_t sent = 0;
+		while (sent < data.size())
+		{
+			ssize_t written = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (written < 0 && errno == EINTR) continue;
+			if (written <= 0) return false;
+			sent += written;
+		}
+		return true;
+	}
+	Reception readLine(int fd, string& pending, string& line, chrono::steady_clock::time_point deadline, size_t maxSize)
+	{
+		bool bounded = (deadline != chrono::steady_clock::time_point::max());
+		size_t newline;
+		while ((newline = pending.find('\n')) == string::npos)
+		{
+			if (pending.size() > maxSize) return Reception::tooBig;
+			if (bounded)
+			{
+				auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+				if (left <= 0) return Reception::timedOut;
+				pollfd waiting = { fd, POLLIN, 0 };
+				int ready = poll(&waiting, 1, int(left) + 1);
+				if (ready < 0 && errno != EINTR) return Reception::closed;
+				if (ready <= 0) continue;
+			}
+			char buffer[4096];
+			ssize_t received = read(fd, buffer, sizeof(buffer));
+			if (received < 0 && errno == EINTR) continue;
+			if (received <= 0) return Reception::closed;
+			pending.append(buffer, received);
+		}
+		line.assign(pending, 0, newline);
+		pending.erase(0, newline + 1);
+		return Reception::complete;
+	}
+	Reception receiveResponse(int fd, string& pending, string& output, int& returnCode, chrono::steady_clock::time_point deadline, size_t maxSize)
+	{
+		output.clear();
+		string line;
+		Reception result;
+		while ((result = readLine(fd, pending, line, deadline, maxSize)) == Reception::complete)
+		{
+			if (line.compare(0, 7, "status:") == 0)
+			{
+				returnCode = atoi(line.c_str() + 7);
+				return Reception::complete;
+			}
+			if (output.size() + line.size() + 1 > maxSize) return Reception::tooBig;
+			output.append(line);
+			output.push_back('\n');
+		}
+		return result;
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_PROTOCOL_H
+#define _NSSCOMMAND_PROTOCOL_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "nss_command.hpp"
+
+/*
+ Line protocol shared by the coprocess and the resolver daemon. A request is a single
+ line "byname <name>" or "byaddr <address>". The answer is the host data in the same
+ format written by the commands, terminated by a "status: <code>" line.
+*/
+namespace nssCommand
+{
+	using namespace std;
+
+	// Longest request line: the kind prefix and a name of up to 255 characters, or an address
+	const size_t MAX_REQUEST_SIZE = 7 + 255;
+
+	bool formatRequest(QueryKind kind, const string& argument, string& request);
+	bool parseRequest(const string& line, QueryKind& kind, string& argument);
+	string formatHostEntry(const HostEntry& entry);
+	string formatResponse(int returnCode, const string& output);
+	bool sendAll(int fd, const string& data);
+
+	enum class Reception { complete, closed, timedOut, tooBig };
+	/*
+	 Reads the next line, polling the descriptor so it never waits past the deadline, and
+	 giving up once more than maxSize bytes are pending without a line end.
+	*/
+	Reception readLine(int fd, string& pending, string& line, chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max(), size_t maxSize = SIZE_MAX);
+	// Reads a response until its status line, with at most maxSize bytes of host data
+	Reception receiveResponse(int fd, string& pending, string& output, int& returnCode, chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max(), size_t maxSize = SIZE_MAX);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_REFERENCE_PARSER_H
+#define _NSSCOMMAND_REFERENCE_PARSER_H 1
+
+#include <regex>
+#include <sstream>
+#include <string>
+#include "nss_command.hpp"
+
+/*
+ Original std::regex based parser of the command output. It's no longer used by the
+ module, it is kept as the reference the scanner in parseCommandOutput is checked and
+ benchmarked against.
+*/
+namespace nssCommand
+{
+	using namespace std;
+
+	inline HostEntry parseCommandOutputWithRegex(const string& text)
+	{
+		static const regex namere("^name:\\s*([a-zA-Z0-9\\-\\.]+)$");
+		static const regex aliasre("^alias:\\s*([a-zA-Z0-9\\-\\.]+)$");
+		static const regex ip4re("^ip4:\\s*([0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+)$");
+		stringstream textStream(text);
+		HostEntry result;
+		string currentLine;
+		while (getline( textStream, currentLine))
+		{
+			smatch matchResult;
+			if (regex_match(currentLine, matchResult, namere))
+			{
+				result.name = matchResult[1];
+			}
+			else if (regex_match(currentLine, matchResult, aliasre))
+			{
+				result.aliases.emplace_back(matchResult[1]);
+			}
+			else if (regex_match(currentLine, matchResult, ip4re))
+			{
+				in_addr ip;
+				if ( 0 != inet_aton(matchResult[1].str().c_str(), &ip))  result.addresses.emplace_back(ip);
+			}
+		}
+		return result;
+	}
+}
+
+#endif
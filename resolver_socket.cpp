@@ -0,0 +1,132 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "resolver_socket.hpp"
+#include "protocol.hpp"
+#include "pinned_command.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+
+using namespace std;
+
+namespace nssCommand
+{
+	bool fillSocketAddress(const string& path, sockaddr_un& address)
+	{
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) return false;
+		memcpy(address.sun_path, path.c_str(), path.size());
+		return true;
+	}
+	int connectSocket(const string& path, int timeoutMilliseconds)
+	{
+		sockaddr_un address;
+		if (!fillSocketAddress(path, address)) return -1;
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (fd < 0) return -1;
+		if (connect(fd, (sockaddr*) &address, sizeof(address)) != 0)
+		{
+			if (errno != EINPROGRESS)
+			{
+				close(fd);
+				return -1;
+			}
+			pollfd waiting = { fd, POLLOUT, 0 };
+			int error = 0;
+			socklen_t errorSize = sizeof(error);
+			if (poll(&waiting, 1, timeoutMilliseconds) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorSize) != 0 || error != 0)
+			{
+				close(fd);
+				return -1;
+			}
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		return fd;
+	}
+	void setSocketTimeouts(int fd, int timeoutMilliseconds)
+	{
+		timeval timeout = { timeoutMilliseconds / 1000, (timeoutMilliseconds % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+	bool querySocket(const string& path, uid_t trustedUid, int timeoutMilliseconds, int answerTimeoutMilliseconds, size_t maxOutputSize, QueryKind kind, const string& argument, string& output, int& returnCode)
+	{
+		string request;
+		if (!formatRequest(kind, argument, request)) return false;
+		int fd = connectSocket(path, timeoutMilliseconds);
+		if (fd < 0) return false;
+		setSocketTimeouts(fd, timeoutMilliseconds);
+		ucred peer;
+		socklen_t peerSize = sizeof(peer);
+		bool answered = false;
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerSize) == 0 && peer.uid == trustedUid)
+		{
+			string pending;
+			auto deadline = chrono::steady_clock::now() + chrono::milliseconds(answerTimeoutMilliseconds);
+			answered = sendAll(fd, request) && receiveResponse(fd, pending, output, returnCode, deadline, maxOutputSize) == Reception::complete;
+		}
+		close(fd);
+		return answered;
+	}
+	int listenSocket(const string& path)
+	{
+		sockaddr_un address;
+		if (!fillSocketAddress(path, address)) return -1;
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		unlink(path.c_str());
+		if (bind(fd, (sockaddr*) &address, sizeof(address)) != 0 || chmod(path.c_str(), 0666) != 0 || listen(fd, SOMAXCONN) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	ResolverService::ResolverService(const string& gethostbynameCommand, const string& gethostbyaddrCommand, ResultCache& cache, bool verifyCommands)
+		: gethostbynameCommand(gethostbynameCommand), gethostbyaddrCommand(gethostbyaddrCommand), cache(cache), verifyCommands(verifyCommands)
+	{
+	}
+	void ResolverService::serveClient(int fd)
+	{
+		string pending;
+		string line;
+		// A client sending more than a request without a line end is dropped
+		while (readLine(fd, pending, line, chrono::steady_clock::time_point::max(), MAX_REQUEST_SIZE) == Reception::complete && line.size() <= MAX_REQUEST_SIZE)
+		{
+			QueryKind kind;
+			string argument;
+			string output;
+			int returnCode = 3;
+			if (parseRequest(line, kind, argument)) returnCode = resolve(kind, argument, output);
+			if (!sendAll(fd, formatResponse(returnCode, output))) break;
+		}
+		close(fd);
+	}
+	int ResolverService::resolve(QueryKind kind, const string& argument, string& output)
+	{
+		const string& command = (kind == QueryKind::byName) ? gethostbynameCommand : gethostbyaddrCommand;
+		shared_ptr<PinnedCommand> pinned = verifyCommands ? trustedCommand(command) : nullptr;
+		if (verifyCommands && !pinned) return 3;
+		string key = ResultCache::makeKey(kind, command, argument);
+		HostEntry entry;
+		int returnCode;
+		if (!cache.find(key, returnCode, entry))
+		{
+			returnCode = runCommand(kind, command.c_str(), argument, entry, pinned);
+			cache.insert(key, returnCode, entry);
+		}
+		output = (returnCode == 0) ? formatHostEntry(entry) : string();
+		return returnCode;
+	}
+}
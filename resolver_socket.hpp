@@ -0,0 +1,45 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_RESOLVER_SOCKET_H
+#define _NSSCOMMAND_RESOLVER_SOCKET_H 1
+
+#include <string>
+#include <sys/types.h>
+#include "nss_command.hpp"
+#include "cache.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Sends a query to the resolver daemon listening in the unix socket at path, using the
+	 line protocol described in protocol.hpp. Returns false without a result when the
+	 daemon can't be reached or take the query within timeoutMilliseconds, when it isn't
+	 run by trustedUid, when it doesn't answer within answerTimeoutMilliseconds or with
+	 at most maxOutputSize bytes, or when the connection breaks, so the caller can
+	 execute the command itself.
+	*/
+	bool querySocket(const string& path, uid_t trustedUid, int timeoutMilliseconds, int answerTimeoutMilliseconds, size_t maxOutputSize, QueryKind kind, const string& argument, string& output, int& returnCode);
+	int listenSocket(const string& path);
+	// Bounds every blocking send and receive in the socket by timeoutMilliseconds
+	void setSocketTimeouts(int fd, int timeoutMilliseconds);
+
+	class ResolverService
+	{
+	public:
+		ResolverService(const string& gethostbynameCommand, const string& gethostbyaddrCommand, ResultCache& cache, bool verifyCommands);
+		void serveClient(int fd);
+		int resolve(QueryKind kind, const string& argument, string& output);
+	private:
+		string gethostbynameCommand;
+		string gethostbyaddrCommand;
+		ResultCache& cache;
+		bool verifyCommands;
+	};
+}
+
+#endif
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+
+# Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+# This file is licensed under MIT license. See file LICENSE for details.
+
+# Script version of benchmark_stub, for lookup_benchmark. A name like
+# host<N>-<anything> resolves to N IPv4 and N IPv6 addresses, and an
+# address resolves to itself.
+
+function main()
+{
+	if [ $# -lt 1 ]
+	then
+		return 3
+	fi
+	local query="$1"
+	case "${query}" in
+		(host*)
+			local count="${query#host}"
+			count="${count%%-*}"
+			echo "name: ${query}.bench."
+			echo "alias: ${query}"
+			local i
+			for (( i = 0; i < count; i++ ))
+			do
+				echo "ip4: 10.$(( (i >> 16) & 255 )).$(( (i >> 8) & 255 )).$(( i & 255 ))"
+				printf "ip6: fd00::%x\n" $(( i + 1 ))
+			done
+			;;
+		(*:*)
+			echo "name: reverse.bench."
+			echo "ip6: ${query}"
+			;;
+		(*)
+			echo "name: reverse.bench."
+			echo "ip4: ${query}"
+			;;
+	esac
+	return 0
+}
+
+main "$@"
+exit $?
@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+
+# Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+# This file is licensed under MIT license. See file LICENSE for details.
+
+function myhost()
+{
+	echo "name: myhost.local."
+	echo "alias: myhost"
+	echo "alias: myalias.local."
+	echo "ip4: 127.0.0.1"
+	echo "ip4: 127.0.0.2"
+	echo "status: 0"
+}
+
+function main()
+{
+	local kind
+	local query
+	while read -r kind query
+	do
+		case "${kind} ${query}" in
+			("byname myhost"|"byname myhost.local"|"byname myhost.local."|"byname myalias.local"|"byname myalias.local.")
+				myhost
+				;;
+			("byaddr 127.0.0.2")
+				myhost
+				;;
+			("byname crash")
+				return 3
+				;;
+			("byname hang")
+				sleep 30
+				;;
+			("byname flood")
+				while true; do echo "alias: flood.local."; done
+				;;
+			(*)
+				echo "status: 1"
+		esac
+	done
+	return 0
+}
+
+main "$@"
+exit $?
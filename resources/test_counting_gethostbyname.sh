@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+
+# Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+# This file is licensed under MIT license. See file LICENSE for details.
+
+# Resolves any name to a long list of addresses, appending a line to
+# /tmp/nsscommand_count_<name> each time it is executed. Names starting
+# with slow take half a second.
+
+function main()
+{
+	if [ $# -lt 1 ]
+	then
+		return 3
+	fi
+	local name="$1"
+	echo "${name}" >> "/tmp/nsscommand_count_${name}"
+	case "${name}" in
+		(slow*)
+			sleep 0.5
+	esac
+	echo "name: ${name}.local."
+	local i
+	for i in $(seq 1 100)
+	do
+		echo "ip4: 10.0.0.${i}"
+	done
+	return 0
+}
+
+main "$@"
+exit $?
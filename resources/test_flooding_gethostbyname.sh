@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+
+# Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+# This file is licensed under MIT license. See file LICENSE for details.
+
+# Writes addresses without end, like a resolver stuck in a loop.
+
+echo "name: flooding.local."
+while true
+do
+	echo "ip4: 127.0.0.1"
+done
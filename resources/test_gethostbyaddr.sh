@@ -23,6 +23,10 @@ function main()
 			echo "ip4: 127.0.0.2"
 			return 0
 			;;
+		(fe80::1)
+			echo "name: dualstack.local."
+			return 0
+			;;
 		(*)
 			return 1
 	esac
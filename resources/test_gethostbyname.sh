@@ -21,6 +21,19 @@ function main()
 			echo "alias: myalias.local."
 			echo "ip4: 127.0.0.1"
 			echo "ip4: 127.0.0.2"
+			echo "ttl: 300"
+			return 0
+			;;
+		(dualstack|dualstack.local|dualstack.local.)
+			echo "name: dualstack.local."
+			echo "ip4: 127.0.0.1"
+			echo "ip6: ::1"
+			echo "ip6: fe80::1"
+			return 0
+			;;
+		(ip6only|ip6only.local|ip6only.local.)
+			echo "name: ip6only.local."
+			echo "ip6: ::1"
 			return 0
 			;;
 		(*)
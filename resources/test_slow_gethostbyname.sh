@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+
+# Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+# This file is licensed under MIT license. See file LICENSE for details.
+
+# Hangs for a long time before answering, like a resolver waiting for a dead server.
+
+echo "name: slow.local."
+sleep 30
+echo "ip4: 127.0.0.1"
+exit 0
@@ -0,0 +1,174 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "shared_cache.hpp"
+#include "protocol.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+
+namespace nssCommand
+{
+	const uint64_t SHARED_CACHE_MAGIC = 0x31434d435353454eULL; // "NESSCMC1"
+	const size_t SHARED_CACHE_PAYLOAD = 480;
+	const size_t SHARED_CACHE_PROBES = 8;
+
+	struct SharedCacheHeader
+	{
+		uint64_t magic;
+		uint64_t bucketCount;
+	};
+	struct SharedCacheBucket
+	{
+		atomic<uint32_t> sequence;
+		int32_t returnCode;
+		uint64_t keyHash;
+		int64_t expiration;
+		uint16_t keySize;
+		uint16_t dataSize;
+		char payload[SHARED_CACHE_PAYLOAD];
+	};
+	static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t) && ATOMIC_INT_LOCK_FREE == 2, "shared buckets need address free atomics");
+
+	uint64_t hashKey(const string& key)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for (unsigned char c : key) hash = (hash ^ c) * 1099511628211ULL;
+		return hash;
+	}
+	int64_t now()
+	{
+		timespec current;
+		clock_gettime(CLOCK_REALTIME_COARSE, &current);
+		return current.tv_sec;
+	}
+
+	unique_ptr<SharedCache> SharedCache::open(const string& path, size_t bucketCount, uid_t owner, unsigned positiveTtl, unsigned negativeTtl)
+	{
+		bool writable = (geteuid() == owner);
+		size_t mappingSize = sizeof(SharedCacheHeader) + bucketCount * sizeof(SharedCacheBucket);
+		int fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0 && writable)
+		{
+			// Create it fully initialized under a temporary name, so it appears atomically
+			string temporaryPath = path + "." + to_string(getpid());
+			fd = ::open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+			if (fd < 0) return nullptr;
+			SharedCacheHeader initial = { SHARED_CACHE_MAGIC, bucketCount };
+			if (fchmod(fd, 0644) != 0 || ftruncate(fd, mappingSize) != 0 || pwrite(fd, &initial, sizeof(initial), 0) != sizeof(initial) || link(temporaryPath.c_str(), path.c_str()) != 0)
+			{
+				close(fd);
+				unlink(temporaryPath.c_str());
+				fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC); // someone else created it first
+				if (fd < 0) return nullptr;
+			}
+			else
+			{
+				unlink(temporaryPath.c_str());
+			}
+		}
+		if (fd < 0) return nullptr;
+		struct stat properties;
+		SharedCacheHeader header;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || properties.st_uid != owner || (properties.st_mode & 022) != 0
+			|| size_t(properties.st_size) != mappingSize || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| header.magic != SHARED_CACHE_MAGIC || header.bucketCount != bucketCount)
+		{
+			close(fd);
+			return nullptr;
+		}
+		void* mapping = mmap(nullptr, mappingSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return nullptr;
+		return unique_ptr<SharedCache>(new SharedCache(mapping, mappingSize, writable, positiveTtl, negativeTtl));
+	}
+	SharedCache::SharedCache(void* mapping, size_t mappingSize, bool writable, unsigned positiveTtl, unsigned negativeTtl)
+		: mapping(mapping), mappingSize(mappingSize), header((SharedCacheHeader*) mapping), bucketCount(header->bucketCount),
+		writable(writable), positiveTtl(positiveTtl), negativeTtl(negativeTtl)
+	{
+	}
+	SharedCache::~SharedCache()
+	{
+		munmap(mapping, mappingSize);
+	}
+	SharedCacheBucket* SharedCache::bucket(size_t index) const
+	{
+		return (SharedCacheBucket*) ((char*) mapping + sizeof(SharedCacheHeader)) + (index % bucketCount);
+	}
+	bool SharedCache::find(const string& key, int& returnCode, HostEntry& entry) const
+	{
+		uint64_t hash = hashKey(key);
+		int64_t currentTime = now();
+		for (size_t probe = 0; probe < SHARED_CACHE_PROBES; probe++)
+		{
+			SharedCacheBucket* current = bucket(hash + probe);
+			for (int attempt = 0; attempt < 4; attempt++)
+			{
+				uint32_t sequence = current->sequence.load(memory_order_acquire);
+				if (sequence & 1) continue;
+				if (current->keyHash != hash) break;
+				int32_t foundReturnCode = current->returnCode;
+				int64_t expiration = current->expiration;
+				size_t keySize = current->keySize;
+				size_t dataSize = current->dataSize;
+				char payload[SHARED_CACHE_PAYLOAD];
+				if (keySize + dataSize > SHARED_CACHE_PAYLOAD) continue;
+				memcpy(payload, current->payload, keySize + dataSize);
+				atomic_thread_fence(memory_order_acquire);
+				if (current->sequence.load(memory_order_relaxed) != sequence) continue;
+				if (keySize != key.size() || memcmp(payload, key.data(), keySize) != 0) break;
+				if (expiration <= currentTime) return false;
+				returnCode = foundReturnCode;
+				entry = HostEntry();
+				parseCommandOutput(payload + keySize, dataSize, entry);
+				if (entry.ttl >= 0) entry.ttl = int32_t(expiration - currentTime);
+				return true;
+			}
+		}
+		return false;
+	}
+	bool SharedCache::insert(const string& key, int returnCode, const HostEntry& entry)
+	{
+		if (!writable || returnCode == 2) return false;
+		unsigned ttl = (returnCode == 0) ? positiveTtl : negativeTtl;
+		if (ttl == 0) return false;
+		if (returnCode == 0 && entry.ttl >= 0) ttl = entry.ttl;
+		if (ttl == 0) return false;
+		string data = (returnCode == 0) ? formatHostEntry(entry) : string();
+		if (key.size() + data.size() > SHARED_CACHE_PAYLOAD) return false;
+		uint64_t hash = hashKey(key);
+		int64_t currentTime = now();
+		// Reuse the bucket of the same key, or an expired one, or else the one closest to expire
+		SharedCacheBucket* target = nullptr;
+		for (size_t probe = 0; probe < SHARED_CACHE_PROBES; probe++)
+		{
+			SharedCacheBucket* current = bucket(hash + probe);
+			if (current->keyHash == hash || current->expiration <= currentTime)
+			{
+				target = current;
+				break;
+			}
+			if (target == nullptr || current->expiration < target->expiration) target = current;
+		}
+		uint32_t sequence = target->sequence.load(memory_order_relaxed);
+		if ((sequence & 1) || !target->sequence.compare_exchange_strong(sequence, sequence + 1, memory_order_acquire)) return false;
+		atomic_thread_fence(memory_order_release);
+		target->returnCode = returnCode;
+		target->keyHash = hash;
+		target->expiration = currentTime + ttl;
+		target->keySize = key.size();
+		target->dataSize = data.size();
+		memcpy(target->payload, key.data(), key.size());
+		memcpy(target->payload + key.size(), data.data(), data.size());
+		target->sequence.store(sequence + 2, memory_order_release);
+		return true;
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_SHARED_CACHE_H
+#define _NSSCOMMAND_SHARED_CACHE_H 1
+
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include "nss_command.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	struct SharedCacheHeader;
+	struct SharedCacheBucket;
+
+	/*
+	 Cache of command results shared by every process in the host through a memory mapped
+	 file. It is a fixed size, open addressed hash table of buckets holding the query key
+	 and the entry in the command output format. Each bucket has a sequence number that
+	 is odd while it's being written: readers copy the bucket and retry if the sequence
+	 changed meanwhile, so they never block, and writers lock a single bucket by making
+	 its sequence odd. Only processes running as the owner of the file can write to it,
+	 and the file is ignored unless it's owned by that user and not writable by others.
+	*/
+	class SharedCache
+	{
+	public:
+		static unique_ptr<SharedCache> open(const string& path, size_t bucketCount, uid_t owner, unsigned positiveTtl, unsigned negativeTtl);
+		SharedCache(const SharedCache&) = delete;
+		SharedCache& operator = (const SharedCache&) = delete;
+		~SharedCache();
+		bool find(const string& key, int& returnCode, HostEntry& entry) const;
+		bool insert(const string& key, int returnCode, const HostEntry& entry);
+		bool isWritable() const { return writable; }
+	private:
+		SharedCache(void* mapping, size_t mappingSize, bool writable, unsigned positiveTtl, unsigned negativeTtl);
+		SharedCacheBucket* bucket(size_t index) const;
+		void* mapping;
+		size_t mappingSize;
+		SharedCacheHeader* header;
+		size_t bucketCount;
+		bool writable;
+		unsigned positiveTtl;
+		unsigned negativeTtl;
+	};
+
+	SharedCache* sharedCache();
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Measures the latency of executing a command as the resident memory of the caller grows,
+ comparing the former popen() based execution (fork of the caller plus a shell) with the
+ posix_spawn() based execution used by run().
+*/
+
+#include "nss_command.hpp"
+#include "spawner.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace nssCommand;
+
+int runWithPopen(const string& cmd, string& output)
+{
+	char line[256];
+	FILE* p = popen(cmd.c_str(), "r");
+	if (p == NULL) return -1;
+	output.clear();
+	while (fgets(line, 255, p)) output.append(line);
+	return pclose(p);
+}
+
+int runWithSpawner(Spawner& helper, const vector<string>& args, string& output)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+	int pipeEnds[2];
+	if (pipe2(pipeEnds, O_CLOEXEC) != 0) return -1;
+	unique_ptr<SpawnedCommand> command;
+	int spawnResult = helper.spawn(args, -1, pipeEnds[1], deadline, command);
+	close(pipeEnds[1]);
+	output.clear();
+	char buffer[4096];
+	ssize_t received;
+	while (spawnResult == 0 && (received = read(pipeEnds[0], buffer, sizeof(buffer))) > 0) output.append(buffer, received);
+	close(pipeEnds[0]);
+	int status;
+	return (spawnResult == 0 && command->waitExit(status, deadline)) ? status : -1;
+}
+
+template <typename Function>
+double averageMicroseconds(int iterations, Function function)
+{
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) function();
+	chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+	const char* command = (argc > 1) ? argv[1] : "./resources/test_gethostbyname.sh";
+	int iterations = (argc > 2) ? atoi(argv[2]) : 50;
+	const size_t megabyte = 1024 * 1024;
+	vector<char*> ballast;
+	size_t resident = 0;
+	string output;
+	Spawner helper((argc > 3) ? argv[3] : "./nsscommand_spawner");
+	cout << "rss_mb\tpopen_us\tposix_spawn_us\tspawner_us" << endl;
+	for (size_t target : { 0, 256, 1024, 4096 })
+	{
+		while (resident < target)
+		{
+			char* block = (char*) malloc(64 * megabyte);
+			if (block == nullptr) return 1;
+			memset(block, 1, 64 * megabyte);
+			ballast.push_back(block);
+			resident += 64;
+		}
+		double popenLatency = averageMicroseconds(iterations, [&]() { runWithPopen(string(command) + " 'myhost' 2>/dev/null", output); });
+		double spawnLatency = averageMicroseconds(iterations, [&]() { run(vector<string>{ command, "myhost" }, output); });
+		double spawnerLatency = averageMicroseconds(iterations, [&]() { runWithSpawner(helper, vector<string>{ command, "myhost" }, output); });
+		cout << resident << "\t" << popenLatency << "\t" << spawnLatency << "\t" << spawnerLatency << endl;
+	}
+	for (char* block : ballast) free(block);
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "spawner.hpp"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+
+using namespace std;
+
+namespace nssCommand
+{
+	// Receives the next reply, waiting for it until the deadline
+	bool receiveReply(int fd, SpawnReply& reply, chrono::steady_clock::time_point deadline)
+	{
+		while (true)
+		{
+			ssize_t received = recv(fd, &reply, sizeof(reply), MSG_DONTWAIT);
+			if (received == sizeof(reply)) return true;
+			if (received >= 0 || (errno != EAGAIN && errno != EINTR)) return false;
+			auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+			if (left <= 0) return false;
+			pollfd waiting = { fd, POLLIN, 0 };
+			poll(&waiting, 1, int(left) + 1);
+		}
+	}
+	bool sendRequest(int fd, const string& request, const int* descriptors, size_t descriptorCount)
+	{
+		char control[CMSG_SPACE(3 * sizeof(int))];
+		memset(control, 0, sizeof(control));
+		iovec data = { const_cast<char*>(request.data()), request.size() };
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &data;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(descriptorCount * sizeof(int));
+		cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(descriptorCount * sizeof(int));
+		memcpy(CMSG_DATA(header), descriptors, descriptorCount * sizeof(int));
+		while (true)
+		{
+			ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+			if (sent >= 0) return size_t(sent) == request.size();
+			if (errno != EINTR) return false;
+		}
+	}
+
+	SpawnedCommand::~SpawnedCommand()
+	{
+		close(fd);
+	}
+	bool SpawnedCommand::waitExit(int& status, chrono::steady_clock::time_point deadline)
+	{
+		SpawnReply reply;
+		if (!receiveReply(fd, reply, deadline) || reply.kind != SpawnReplyKind::exited) return false;
+		status = reply.value;
+		return true;
+	}
+
+	// The helper exits once its socket is closed and the commands it started have ended
+	Spawner::Spawner(const string& helper) : process(helper, SOCK_SEQPACKET, false, SIGTERM)
+	{
+	}
+	int Spawner::spawn(const vector<string>& args, int executableFd, int outputFd, chrono::steady_clock::time_point deadline, unique_ptr<SpawnedCommand>& command, const shared_ptr<PinnedCommand>& pinnedHelper)
+	{
+		if (args.empty()) return -1;
+		SpawnRequest header = { uint32_t(args.size()), executableFd >= 0 };
+		string request((const char*) &header, sizeof(header));
+		for (auto& arg : args)
+		{
+			request += arg;
+			request.push_back('\0');
+		}
+		if (request.size() > MAX_SPAWN_REQUEST_SIZE) return -1;
+		// A second attempt with a new helper if the request can't be sent or the helper dies before answering
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			int replySockets[2];
+			if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, replySockets) != 0) return -1;
+			int descriptors[] = { replySockets[1], outputFd, executableFd };
+			bool usable, sent = false;
+			pid_t helperPid;
+			{
+				lock_guard<timed_mutex> guard(process.lock);
+				usable = process.ensureStarted(pinnedHelper);
+				if (usable)
+				{
+					sent = sendRequest(process.descriptor(), request, descriptors, (executableFd >= 0) ? 3 : 2);
+					if (!sent) process.stop();
+				}
+				helperPid = process.processId();
+			}
+			close(replySockets[1]);
+			SpawnReply reply;
+			bool replied = sent && receiveReply(replySockets[0], reply, deadline);
+			if (replied && reply.kind == SpawnReplyKind::started)
+			{
+				command.reset(new SpawnedCommand(reply.value, replySockets[0]));
+				return 0;
+			}
+			// Closing the socket kills the command if the helper started it after all
+			close(replySockets[0]);
+			if (replied) return (reply.kind == SpawnReplyKind::failed) ? reply.value : -1;
+			if (!usable || chrono::steady_clock::now() >= deadline) return -1;
+			if (sent)
+			{
+				lock_guard<timed_mutex> guard(process.lock);
+				if (process.processId() == helperPid) process.stop();
+			}
+		}
+		return -1;
+	}
+	Spawner& spawner(const string& helper)
+	{
+		return helperInstance<Spawner>(helper);
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_SPAWNER_H
+#define _NSSCOMMAND_SPAWNER_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "helper_process.hpp"
+
+namespace nssCommand
+{
+	using namespace std;
+
+	/*
+	 Messages between the module and the spawner helper, over unix sockets of type
+	 SOCK_SEQPACKET. A request is a SpawnRequest followed by the arguments, each one
+	 terminated by a null character, and carries the descriptors of the reply socket,
+	 the standard output of the command and, when hasExecutable is set, the pinned
+	 command file to execute instead of the first argument. The helper answers in the
+	 reply socket with a started or failed reply, and later with an exited reply holding
+	 the wait status. Closing the reply socket before that kills the process group of
+	 the command.
+	*/
+	struct SpawnRequest
+	{
+		uint32_t arguments;
+		uint32_t hasExecutable;
+	};
+	enum class SpawnReplyKind : int32_t { started, failed, exited };
+	struct SpawnReply
+	{
+		SpawnReplyKind kind;
+		int32_t value; // pid, errno or wait status
+	};
+	const size_t MAX_SPAWN_REQUEST_SIZE = 65536;
+
+	/*
+	 Command started by the spawner helper. Destroying it before the command exits makes
+	 the helper kill its process group.
+	*/
+	class SpawnedCommand
+	{
+	public:
+		SpawnedCommand(pid_t pid, int fd) : pid(pid), fd(fd) {}
+		SpawnedCommand(const SpawnedCommand&) = delete;
+		SpawnedCommand& operator = (const SpawnedCommand&) = delete;
+		~SpawnedCommand();
+		pid_t processId() const { return pid; }
+		// Waits for the wait status of the command until the deadline
+		bool waitExit(int& status, chrono::steady_clock::time_point deadline);
+	private:
+		pid_t pid;
+		int fd;
+	};
+
+	/*
+	 Small helper process that forks and executes the commands, so the cost of starting
+	 them doesn't grow with the memory and threads of the process doing the lookups. The
+	 helper is started on first use and restarted if it dies. A process created with
+	 fork(), or one that changed its user or group, starts its own helper, so the
+	 commands always run with the credentials of the process asking for them.
+	*/
+	class Spawner
+	{
+	public:
+		explicit Spawner(const string& helper);
+		Spawner(const Spawner&) = delete;
+		Spawner& operator = (const Spawner&) = delete;
+		/*
+		 Starts args with its standard output in outputFd, executing executableFd instead
+		 of args[0] unless it's -1. The helper itself is started from pinnedHelper when
+		 given, or by its path otherwise. Returns 0 when it's started, the errno of the
+		 failure when the helper couldn't start it, or -1 when the helper can't be used,
+		 and then nothing has been started.
+		*/
+		int spawn(const vector<string>& args, int executableFd, int outputFd, chrono::steady_clock::time_point deadline, unique_ptr<SpawnedCommand>& command, const shared_ptr<PinnedCommand>& pinnedHelper = nullptr);
+		pid_t processId() const { return process.processId(); }
+	private:
+		HelperProcess process;
+	};
+
+	Spawner& spawner(const string& helper);
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+/*
+ Measures what the module costs a new process: loading it with dlopen, as glibc does the
+ first time the process resolves a host, and its first and second lookups through the
+ exported gethostbyname4 entry point. Each sample is taken in a new child process. It's
+ written in C so libstdc++ isn't loaded before the module, as in most programs resolving
+ names, and reports whether loading the module loaded it.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <netdb.h>
+#include <nss.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum nss_status (*Gethostbyname4)(const char*, struct gaih_addrtuple**, char*, size_t, int*, int*, int32_t*);
+
+struct Sample
+{
+	long long load;
+	long long firstLookup;
+	long long secondLookup;
+	int runtimeLoaded;
+	int failed;
+};
+
+static long long nanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static long long lookup(Gethostbyname4 gethostbyname4, const char* name)
+{
+	char buffer[16384];
+	struct gaih_addrtuple* tuples;
+	int error, herror;
+	int32_t ttl;
+	long long start = nanoseconds();
+	gethostbyname4(name, &tuples, buffer, sizeof(buffer), &error, &herror, &ttl);
+	return nanoseconds() - start;
+}
+
+static struct Sample measure(const char* library, const char* name)
+{
+	struct Sample sample;
+	memset(&sample, 0, sizeof(sample));
+	long long start = nanoseconds();
+	void* module = dlopen(library, RTLD_LAZY);
+	sample.load = nanoseconds() - start;
+	Gethostbyname4 gethostbyname4 = (module != NULL) ? (Gethostbyname4) dlsym(module, "_nss_command_gethostbyname4_r") : NULL;
+	if (gethostbyname4 == NULL)
+	{
+		sample.failed = 1;
+		return sample;
+	}
+	sample.runtimeLoaded = (dlopen("libstdc++.so.6", RTLD_LAZY | RTLD_NOLOAD) != NULL);
+	sample.firstLookup = lookup(gethostbyname4, name);
+	sample.secondLookup = lookup(gethostbyname4, name);
+	return sample;
+}
+
+static int compare(const void* lhs, const void* rhs)
+{
+	long long left = *(const long long*) lhs;
+	long long right = *(const long long*) rhs;
+	return (left > right) - (left < right);
+}
+
+static void printLatencies(const char* name, long long* values, int count, int last)
+{
+	long long total = 0;
+	for (int i = 0; i < count; i++) total += values[i];
+	qsort(values, count, sizeof(long long), compare);
+	printf("  {\"name\": \"%s\", \"operations\": %d, \"latency_ns\": {\"mean\": %lld, \"p50\": %lld, \"p99\": %lld, \"max\": %lld}}%s\n",
+		name, count, total / count, values[count / 2], values[(count * 99) / 100], values[count - 1], last ? "" : ",");
+}
+
+int main(int argc, char** argv)
+{
+	const char* library = "./libnss_command.so";
+	const char* name = "localhost";
+	int iterations = 200;
+	int option;
+	while ((option = getopt(argc, argv, "l:n:q:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'l':
+				library = optarg;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				if (iterations < 1) iterations = 1;
+				break;
+			case 'q':
+				name = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-l library] [-n iterations] [-q name]\n", argv[0]);
+				return 2;
+		}
+	}
+	long long* loads = calloc(iterations, sizeof(long long));
+	long long* firstLookups = calloc(iterations, sizeof(long long));
+	long long* secondLookups = calloc(iterations, sizeof(long long));
+	int runtimeLoaded = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		int pipeEnds[2];
+		if (pipe(pipeEnds) != 0) return 1;
+		pid_t child = fork();
+		if (child < 0) return 1;
+		if (child == 0)
+		{
+			close(pipeEnds[0]);
+			struct Sample sample = measure(library, name);
+			_exit(write(pipeEnds[1], &sample, sizeof(sample)) == sizeof(sample) ? 0 : 1);
+		}
+		close(pipeEnds[1]);
+		struct Sample sample;
+		ssize_t received = read(pipeEnds[0], &sample, sizeof(sample));
+		close(pipeEnds[0]);
+		waitpid(child, NULL, 0);
+		if (received != sizeof(sample) || sample.failed)
+		{
+			fprintf(stderr, "Can't load %s: %s\n", library, (received == sizeof(sample)) ? "missing entry point" : "child failed");
+			return 1;
+		}
+		loads[i] = sample.load;
+		firstLookups[i] = sample.firstLookup;
+		secondLookups[i] = sample.secondLookup;
+		runtimeLoaded |= sample.runtimeLoaded;
+	}
+	printf("{\"benchmark\": \"startup_benchmark\", \"library\": \"%s\", \"query\": \"%s\", \"loads_libstdcxx\": %s, \"results\": [\n", library, name, runtimeLoaded ? "true" : "false");
+	printLatencies("dlopen", loads, iterations, 0);
+	printLatencies("first_lookup", firstLookups, iterations, 0);
+	printLatencies("second_lookup", secondLookups, iterations, 1);
+	printf("]}\n");
+	free(loads);
+	free(firstLookups);
+	free(secondLookups);
+	return 0;
+}
@@ -6,18 +6,55 @@
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 #include "nss_command.hpp"
+#include "cache.hpp"
+#include "coprocess.hpp"
+#include "protocol.hpp"
+#include "resolver_socket.hpp"
+#include "reference_parser.hpp"
+#include "pinned_command.hpp"
+#include "shared_cache.hpp"
+#include "host_database.hpp"
+#include "admission_filter.hpp"
+#include "configuration.hpp"
+#include "concurrency_limiter.hpp"
+#include "circuit_breaker.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "spawner.hpp"
 
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <cstring>
 #include <string>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <fstream>
 
 using namespace std;
 using namespace nssCommand;
 
+int executionCount(const string& name)
+{
+	ifstream counter("/tmp/nsscommand_count_" + name);
+	string line;
+	int lines = 0;
+	while (getline(counter, line)) lines++;
+	return lines;
+}
+void resetExecutionCount(const string& name)
+{
+	unlink(("/tmp/nsscommand_count_" + name).c_str());
+}
 char* formatAddr(const char* addr)
 {
 	if (addr == nullptr) return nullptr;
@@ -173,7 +210,7 @@ TEST_CASE("runNssCommandGethostbyname returns UNAVAILABLE when the command fails
 	REQUIRE( herror == NO_RECOVERY );
 	delete[] buffer;
 }
-TEST_CASE("runNssCommandGethostbyaddr returns NOTFOUND if asked for a ipv6 address")
+TEST_CASE("runNssCommandGethostbyaddr returns NOTFOUND when the command doesn't know an ipv6 address")
 {
 	const char* address = "::1";
 	in6_addr ip6address;
@@ -405,3 +442,1482 @@ TEST_CASE("fileHasRightPerms returns false if the given file can't be accessed")
 
 	CHECK_FALSE( fileHasRightPerms(filename) );
 }
+TEST_CASE("ResultCache returns the stored result of a query until it expires")
+{
+	ResultCache cache(16, 1, 1);
+	HostEntry entry;
+	entry.name = "myhost.domain.tld.";
+	in_addr address;
+	inet_aton("127.0.0.3", &address);
+	entry.addresses = { address };
+	string key = ResultCache::makeKey(QueryKind::byName, "./resources/test_gethostbyname.sh", "myhost");
+	int returnCode = -1;
+	HostEntry cached;
+
+	CHECK_FALSE( cache.find(key, returnCode, cached) );
+	cache.insert(key, 0, entry);
+	REQUIRE( cache.find(key, returnCode, cached) );
+	CHECK( returnCode == 0 );
+	CHECK( cached == entry );
+	this_thread::sleep_for(chrono::milliseconds(1100));
+	CHECK_FALSE( cache.find(key, returnCode, cached) );
+	CHECK( cache.hits() == 1 );
+	CHECK( cache.misses() == 2 );
+}
+TEST_CASE("ResultCache keeps negative results and never keeps temporary failures")
+{
+	ResultCache cache(16, 60, 60);
+	HostEntry entry;
+	int returnCode = -1;
+	string notFoundKey = ResultCache::makeKey(QueryKind::byName, "cmd", "notfound");
+	string tryAgainKey = ResultCache::makeKey(QueryKind::byName, "cmd", "tryagain");
+
+	cache.insert(notFoundKey, 1, entry);
+	cache.insert(tryAgainKey, 2, entry);
+
+	REQUIRE( cache.find(notFoundKey, returnCode, entry) );
+	CHECK( returnCode == 1 );
+	CHECK_FALSE( cache.find(tryAgainKey, returnCode, entry) );
+}
+TEST_CASE("ResultCache evicts the least recently used entry when it is full")
+{
+	ResultCache cache(2, 60, 60);
+	HostEntry entry;
+	int returnCode;
+	string key1 = ResultCache::makeKey(QueryKind::byName, "cmd", "host1");
+	string key2 = ResultCache::makeKey(QueryKind::byName, "cmd", "host2");
+	string key3 = ResultCache::makeKey(QueryKind::byAddress, "cmd", "host1");
+
+	cache.insert(key1, 0, entry);
+	cache.insert(key2, 0, entry);
+	REQUIRE( cache.find(key1, returnCode, entry) );
+	cache.insert(key3, 0, entry);
+
+	CHECK( cache.size() == 2 );
+	CHECK( cache.find(key1, returnCode, entry) );
+	CHECK_FALSE( cache.find(key2, returnCode, entry) );
+	CHECK( cache.find(key3, returnCode, entry) );
+}
+TEST_CASE("runNssCommandGethostbyname and runNssCommandGethostbyname4 serve repeated queries from the result cache")
+{
+	resultCache().clear();
+	const char* hostname = "myhost";
+	const char* command = "./resources/test_gethostbyname.sh";
+	hostent result;
+	gaih_addrtuple* tuples;
+	size_t bufferSize = 1024;
+	char* buffer = new char[bufferSize];
+	int error, herror, ttl;
+
+	REQUIRE( runNssCommandGethostbyname(hostname, &result, buffer, bufferSize, &error, &herror, command) == NSS_STATUS_SUCCESS );
+	REQUIRE( runNssCommandGethostbyname4(hostname, &tuples, buffer, bufferSize, &error, &herror, &ttl, command) == NSS_STATUS_SUCCESS );
+	REQUIRE( runNssCommandGethostbyname("somethingthatdoesntexist", &result, buffer, bufferSize, &error, &herror, command) == NSS_STATUS_NOTFOUND );
+	REQUIRE( runNssCommandGethostbyname("somethingthatdoesntexist", &result, buffer, bufferSize, &error, &herror, command) == NSS_STATUS_NOTFOUND );
+
+	CHECK( string(tuples->name) == "myhost.local." );
+	CHECK( resultCache().misses() == 2 );
+	CHECK( resultCache().hits() == 2 );
+	delete[] buffer;
+}
+TEST_CASE("Coprocess answers several queries with a single helper process")
+{
+	Coprocess helper("./resources/test_coprocess.sh");
+	string output;
+
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	pid_t firstPid = helper.processId();
+	HostEntry entry = parseCommandOutput(output);
+	CHECK( entry.name == "myhost.local." );
+	CHECK( entry.aliases.size() == 2 );
+	CHECK( entry.addresses.size() == 2 );
+	REQUIRE( helper.query(QueryKind::byAddress, "127.0.0.2", output) == 0 );
+	CHECK( parseCommandOutput(output).name == "myhost.local." );
+	CHECK( helper.query(QueryKind::byName, "somethingthatdoesntexist", output) == 1 );
+	CHECK( helper.processId() == firstPid );
+}
+TEST_CASE("Coprocess restarts the helper when it dies")
+{
+	Coprocess helper("./resources/test_coprocess.sh");
+	string output;
+
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	pid_t firstPid = helper.processId();
+	CHECK( helper.query(QueryKind::byName, "crash", output) == 3 );
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	CHECK( helper.processId() != firstPid );
+}
+TEST_CASE("Coprocess kills a helper that doesn't answer in time or answers too much")
+{
+	Coprocess helper("./resources/test_coprocess.sh");
+	string output;
+
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output, 1000, 1024) == 0 );
+	pid_t firstPid = helper.processId();
+	auto start = chrono::steady_clock::now();
+	CHECK( helper.query(QueryKind::byName, "hang", output, 200, 1024) == 2 );
+	CHECK( chrono::steady_clock::now() - start < chrono::seconds(2) );
+	CHECK( output.empty() );
+	CHECK( helper.processId() == -1 );
+	CHECK( kill(firstPid, 0) != 0 );
+
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output, 1000, 1024) == 0 );
+	CHECK( parseCommandOutput(output).name == "myhost.local." );
+	CHECK( helper.query(QueryKind::byName, "flood", output, 1000, 1024) == 3 );
+	CHECK( output.empty() );
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output, 1000, 1024) == 0 );
+}
+TEST_CASE("Coprocess starts a new helper in a forked child")
+{
+	Coprocess& helper = coprocess("./resources/test_coprocess.sh");
+	string output;
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	pid_t parentHelper = helper.processId();
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		string childOutput;
+		bool ok = helper.query(QueryKind::byName, "myhost", childOutput) == 0 && helper.processId() != parentHelper;
+		_exit(ok ? 0 : 1);
+	}
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	CHECK( helper.processId() == parentHelper );
+}
+TEST_CASE("Coprocess doesn't make fork() wait for a busy helper")
+{
+	Coprocess& helper = coprocess("./resources/test_coprocess.sh");
+	string output;
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+	thread busy([&]() {
+		string hangOutput;
+		helper.query(QueryKind::byName, "hang", hangOutput, 2000, 1024);
+	});
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	auto start = chrono::steady_clock::now();
+	pid_t child = fork();
+	if (child == 0)
+	{
+		string childOutput;
+		_exit((helper.query(QueryKind::byName, "myhost", childOutput, 1000, 1024) == 0) ? 0 : 1);
+	}
+	CHECK( chrono::steady_clock::now() - start < chrono::milliseconds(1000) );
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	busy.join();
+	REQUIRE( helper.query(QueryKind::byName, "myhost", output) == 0 );
+}
+// Runs args through the spawner and reads its output, returns the wait status or -1
+int spawnAndWait(Spawner& helper, const vector<string>& args, string& output)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+	int pipeEnds[2];
+	if (pipe2(pipeEnds, O_CLOEXEC) != 0) return -1;
+	unique_ptr<SpawnedCommand> command;
+	int spawnResult = helper.spawn(args, -1, pipeEnds[1], deadline, command);
+	close(pipeEnds[1]);
+	output.clear();
+	char buffer[4096];
+	ssize_t received;
+	while (spawnResult == 0 && (received = read(pipeEnds[0], buffer, sizeof(buffer))) > 0) output.append(buffer, received);
+	close(pipeEnds[0]);
+	int status;
+	if (spawnResult != 0 || !command->waitExit(status, deadline)) return -1;
+	return status;
+}
+TEST_CASE("Spawner runs commands through a single helper process and restarts it when it dies")
+{
+	Spawner helper("./nsscommand_spawner");
+	string output;
+
+	int status = spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "myhost" }, output);
+	REQUIRE( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	HostEntry entry = parseCommandOutput(output);
+	CHECK( entry.name == "myhost.local." );
+	CHECK( entry.addresses.size() == 2 );
+	pid_t firstPid = helper.processId();
+	status = spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "somethingthatdoesntexist" }, output);
+	CHECK( WEXITSTATUS(status) == 1 );
+	status = spawnAndWait(helper, vector<string>{ "./resources/somethingthatdoesntexist.sh" }, output);
+	CHECK( WEXITSTATUS(status) == 127 );
+	CHECK( helper.processId() == firstPid );
+
+	kill(firstPid, SIGKILL);
+	status = spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "myhost" }, output);
+	CHECK( WEXITSTATUS(status) == 0 );
+	CHECK( parseCommandOutput(output).name == "myhost.local." );
+	CHECK( helper.processId() != firstPid );
+}
+TEST_CASE("Spawner kills the process group of a command when it's given up")
+{
+	Spawner helper("./nsscommand_spawner");
+	int pipeEnds[2];
+	REQUIRE( pipe2(pipeEnds, O_CLOEXEC) == 0 );
+	unique_ptr<SpawnedCommand> command;
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(200);
+
+	REQUIRE( helper.spawn(vector<string>{ "./resources/test_slow_gethostbyname.sh", "slow" }, -1, pipeEnds[1], deadline, command) == 0 );
+	close(pipeEnds[1]);
+	int status;
+	CHECK_FALSE( command->waitExit(status, deadline) );
+	command.reset();
+	// Once the group is killed nobody holds the write end of the pipe
+	pollfd waiting = { pipeEnds[0], POLLIN, 0 };
+	char buffer[256];
+	bool closed = false;
+	while (!closed && poll(&waiting, 1, 2000) == 1) closed = (read(pipeEnds[0], buffer, sizeof(buffer)) == 0);
+	CHECK( closed );
+	close(pipeEnds[0]);
+}
+TEST_CASE("Spawner starts a new helper in a forked child")
+{
+	Spawner& helper = spawner("./nsscommand_spawner");
+	string output;
+	REQUIRE( spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "myhost" }, output) == 0 );
+	pid_t parentHelper = helper.processId();
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		string childOutput;
+		bool ok = spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "myhost" }, childOutput) == 0 && helper.processId() != parentHelper;
+		_exit(ok ? 0 : 1);
+	}
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	REQUIRE( spawnAndWait(helper, vector<string>{ "./resources/test_gethostbyname.sh", "myhost" }, output) == 0 );
+	CHECK( helper.processId() == parentHelper );
+}
+TEST_CASE("querySocket resolves queries through a resolver daemon listening in a unix socket")
+{
+	string path = "/tmp/nsscommand_test_" + to_string(getpid()) + ".sock";
+	int listening = listenSocket(path);
+	REQUIRE( listening >= 0 );
+	ResultCache cache(16, 60, 60);
+	ResolverService service("./resources/test_gethostbyname.sh", "./resources/test_gethostbyaddr.sh", cache, false);
+	thread server([&]() {
+		for (int i = 0; i < 2; i++) service.serveClient(accept(listening, nullptr, nullptr));
+	});
+	string output;
+	int returnCode = -1;
+
+	REQUIRE( querySocket(path, getuid(), 100, 5000, 1024 * 1024, QueryKind::byName, "myhost", output, returnCode) );
+	CHECK( returnCode == 0 );
+	HostEntry entry = parseCommandOutput(output);
+	CHECK( entry.name == "myhost.local." );
+	CHECK( entry.aliases.size() == 2 );
+	CHECK( entry.addresses.size() == 2 );
+	REQUIRE( querySocket(path, getuid(), 100, 5000, 1024 * 1024, QueryKind::byAddress, "127.0.0.3", output, returnCode) );
+	CHECK( returnCode == 1 );
+	CHECK( output.empty() );
+
+	server.join();
+	close(listening);
+	unlink(path.c_str());
+}
+TEST_CASE("ResolverService drops a client sending a request longer than any name")
+{
+	int sockets[2];
+	REQUIRE( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == 0 );
+	ResultCache cache(16, 60, 60);
+	ResolverService service("./resources/test_gethostbyname.sh", "./resources/test_gethostbyaddr.sh", cache, false);
+	thread server([&]() { service.serveClient(sockets[1]); });
+
+	string request = "byname " + string(16384, 'a');
+	send(sockets[0], request.data(), request.size(), MSG_NOSIGNAL);
+	pollfd waiting = { sockets[0], POLLIN, 0 };
+	REQUIRE( poll(&waiting, 1, 2000) == 1 );
+	char buffer[256];
+	CHECK( read(sockets[0], buffer, sizeof(buffer)) <= 0 ); // closed, or reset with the rest of the request unread
+
+	server.join();
+	close(sockets[0]);
+}
+TEST_CASE("querySocket fails when the resolver daemon is absent or not trusted")
+{
+	string path = "/tmp/nsscommand_test_" + to_string(getpid()) + ".sock";
+	string output;
+	int returnCode;
+
+	CHECK_FALSE( querySocket("/tmp/somethingthatshouldnotexist.sock", getuid(), 100, 5000, 1024 * 1024, QueryKind::byName, "myhost", output, returnCode) );
+
+	int listening = listenSocket(path);
+	REQUIRE( listening >= 0 );
+	CHECK_FALSE( querySocket(path, getuid() + 1, 100, 5000, 1024 * 1024, QueryKind::byName, "myhost", output, returnCode) );
+	close(listening);
+	unlink(path.c_str());
+}
+TEST_CASE("querySocket gives up on a resolver daemon that doesn't answer in time")
+{
+	string path = "/tmp/nsscommand_test_" + to_string(getpid()) + ".sock";
+	int listening = listenSocket(path);
+	REQUIRE( listening >= 0 );
+	string output;
+	int returnCode;
+	auto start = chrono::steady_clock::now();
+
+	CHECK_FALSE( querySocket(path, getuid(), 100, 200, 1024 * 1024, QueryKind::byName, "myhost", output, returnCode) );
+	CHECK( chrono::steady_clock::now() - start < chrono::seconds(2) );
+	close(listening);
+	unlink(path.c_str());
+}
+TEST_CASE("formatHostEntry writes a HostEntry in the command output format")
+{
+	string text = "name: myhost.domain.tld.\nalias: myalias.domain.tld.\nip4: 127.0.0.3\nip4: 127.0.0.4\n";
+
+	CHECK( formatHostEntry(parseCommandOutput(text)) == text );
+}
+TEST_CASE("run executes the command without a shell and passes the arguments untouched")
+{
+	string output;
+
+	CHECK( run(vector<string>{ "/bin/echo", "it's $HOME; exit 3" }, output) == 0 );
+	CHECK( output == "it's $HOME; exit 3\n" );
+	CHECK( run(vector<string>{ "/bin/sh", "-c", "echo out; echo err >&2; exit 4" }, output) == 4 );
+	CHECK( output == "out\n" );
+	CHECK( run(vector<string>{ "./resources/nonexistantcommand.sh", "myhost" }, output) == 127 );
+	CHECK( output.empty() );
+}
+TEST_CASE("parseCommandOutput accepts the same lines than the former regex parser")
+{
+	vector<string> samples = {
+		"name: myhost.domain.tld.\nalias: myalias\nip4: 127.0.0.3\n",
+		"name:\t \tmyhost\nalias:a-b.c\nip4:10.0.0.1",
+		"name: my host\nalias: \nalias:\nip4: 1.2.3\nip4: 1.2.3.4.5\nip4: 256.0.0.1\n",
+		"ip4: 010.0.0.1\nip4: 08.0.0.1\nip4: 0.0.0.0\nip4: 00000000000000000001.2.3.4\nip4: 99999999999999999999.1.1.1\n",
+		"name: first\nname: second\r\nname: third\n\n\nNAME: fourth\n name: fifth\n",
+		"alias: a_b\nalias: a\tb\nip4: 1.2.3.4 \nip4:\v1.2.3.4\nfoo: bar\n:\nname:",
+		string("name: nul\0byte\nip4: 1.1.1.1\0\n", 30),
+		""
+	};
+	for (auto& sample : samples)
+	{
+		CHECK( parseCommandOutput(sample) == parseCommandOutputWithRegex(sample) );
+	}
+}
+TEST_CASE("parseCommandOutput matches the former regex parser on random input")
+{
+	const vector<string> tokens = { "name:", "alias:", "ip4:", " ", "\t", "\r", "\n", ".", "-", "_", "0", "1", "7", "8", "9", "25", "255", "256", "a", "Z", "x" };
+	mt19937 generator(20171017);
+	uniform_int_distribution<size_t> tokenChoice(0, tokens.size() - 1);
+	uniform_int_distribution<int> lengthChoice(0, 40);
+	for (int i = 0; i < 2000; i++)
+	{
+		string sample;
+		for (int length = lengthChoice(generator); length > 0; length--) sample += tokens[tokenChoice(generator)];
+		INFO( sample );
+		CHECK( parseCommandOutput(sample) == parseCommandOutputWithRegex(sample) );
+	}
+}
+TEST_CASE("copyHostEntryToBuffer lays out the hostent data in the buffer without writing past the needed size")
+{
+	HostEntry entry = parseCommandOutput("name: myhost.domain.tld.\nalias: myalias\nalias: a\nip4: 127.0.0.3\nip4: 127.0.0.4\n");
+	size_t needed = calculateBufferSize(entry);
+	vector<char> storage(needed + 64, '#');
+	char* buffer = storage.data() + 1; // deliberately misaligned
+	size_t padding = (sizeof(char*) - (reinterpret_cast<uintptr_t>(buffer) % sizeof(char*))) % sizeof(char*);
+	hostent result;
+
+	CHECK_FALSE( copyHostEntryToBuffer(entry, &result, buffer, padding + needed - 1) );
+	REQUIRE( copyHostEntryToBuffer(entry, &result, buffer, padding + needed) );
+
+	char** aliases = (char**) (buffer + padding);
+	char** addressList = aliases + 3;
+	char* data = (char*) (addressList + 3);
+	CHECK( result.h_aliases == aliases );
+	CHECK( result.h_addr_list == addressList );
+	CHECK( result.h_addrtype == AF_INET );
+	CHECK( result.h_length == sizeof(in_addr) );
+	CHECK( addressList[0] == data );
+	CHECK( addressList[1] == data + 4 );
+	CHECK( addressList[2] == nullptr );
+	CHECK( memcmp(data, &entry.addresses[0], 4) == 0 );
+	CHECK( memcmp(data + 4, &entry.addresses[1], 4) == 0 );
+	CHECK( result.h_name == data + 8 );
+	CHECK( memcmp(data + 8, "myhost.domain.tld.\0myalias\0a", 29) == 0 );
+	CHECK( aliases[0] == data + 27 );
+	CHECK( aliases[1] == data + 35 );
+	CHECK( aliases[2] == nullptr );
+	CHECK( data + 37 == buffer + padding + needed );
+	for (char* guard = buffer + padding + needed; guard < storage.data() + storage.size(); guard++) CHECK( *guard == '#' );
+	for (char* guard = storage.data(); guard < buffer + padding; guard++) CHECK( *guard == '#' );
+}
+TEST_CASE("copyHostEntryToGaihBuffer lays out the address tuples in the buffer without writing past the needed size")
+{
+	HostEntry entry = parseCommandOutput("name: myhost\nalias: myalias\nip4: 127.0.0.3\nip4: 127.0.0.4\n");
+	size_t needed = calculateGaihBufferSize(entry);
+	vector<char> storage(needed + 64, '#');
+	char* buffer = storage.data() + 3;
+	size_t padding = (alignof(gaih_addrtuple) - (reinterpret_cast<uintptr_t>(buffer) % alignof(gaih_addrtuple))) % alignof(gaih_addrtuple);
+	gaih_addrtuple* result = nullptr;
+
+	CHECK_FALSE( copyHostEntryToGaihBuffer(entry, &result, buffer, padding + needed - 1) );
+	REQUIRE( copyHostEntryToGaihBuffer(entry, &result, buffer, padding + needed) );
+
+	gaih_addrtuple* tuples = (gaih_addrtuple*) (buffer + padding);
+	char* name = (char*) (tuples + 2);
+	CHECK( result == tuples );
+	CHECK( tuples[0].next == &tuples[1] );
+	CHECK( tuples[1].next == nullptr );
+	CHECK( tuples[0].name == name );
+	CHECK( tuples[1].name == name );
+	CHECK( tuples[0].addr[0] == entry.addresses[0].s_addr );
+	CHECK( tuples[1].addr[0] == entry.addresses[1].s_addr );
+	CHECK( tuples[1].addr[3] == 0 );
+	CHECK( tuples[1].scopeid == 0 );
+	CHECK( memcmp(name, "myhost\0", 7) == 0 );
+	for (char* guard = buffer + padding + needed; guard < storage.data() + storage.size(); guard++) CHECK( *guard == '#' );
+}
+TEST_CASE("runNssCommandGethostbyname and runNssCommandGethostbyname4 don't execute the command again when glibc retries with a bigger buffer")
+{
+	const char* command = "./resources/test_counting_gethostbyname.sh";
+	string hostname = "retry" + to_string(getpid());
+	resetExecutionCount(hostname);
+	resultCache().clear();
+	int error, herror, ttl;
+	hostent result;
+	gaih_addrtuple* tuples;
+	size_t bufferSize = 64;
+	nss_status returncode;
+	do
+	{
+		vector<char> buffer(bufferSize);
+		returncode = runNssCommandGethostbyname(hostname.c_str(), &result, buffer.data(), bufferSize, &error, &herror, command);
+		bufferSize *= 2;
+	} while (returncode == NSS_STATUS_TRYAGAIN && error == ERANGE);
+	CHECK( returncode == NSS_STATUS_SUCCESS );
+	CHECK( bufferSize > 1024 );
+	CHECK( executionCount(hostname) == 1 );
+	CHECK( resultCache().hits() == 0 );
+
+	resultCache().clear();
+	bufferSize = 64;
+	do
+	{
+		vector<char> buffer(bufferSize);
+		returncode = runNssCommandGethostbyname4(hostname.c_str(), &tuples, buffer.data(), bufferSize, &error, &herror, &ttl, command);
+		bufferSize *= 2;
+	} while (returncode == NSS_STATUS_TRYAGAIN && error == ERANGE);
+	CHECK( returncode == NSS_STATUS_SUCCESS );
+	CHECK( executionCount(hostname) == 2 );
+	CHECK( resultCache().hits() == 0 );
+	resetExecutionCount(hostname);
+}
+TEST_CASE("run kills the command and returns 2 when it doesn't finish before the deadline")
+{
+	string output;
+	auto start = chrono::steady_clock::now();
+
+	int returnCode = run(vector<string>{ "./resources/test_slow_gethostbyname.sh", "slow" }, output, 200, 1024 * 1024);
+
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+	CHECK( returnCode == 2 );
+	CHECK( output.empty() );
+	CHECK( elapsed >= 200 );
+	CHECK( elapsed < 2000 );
+}
+TEST_CASE("run kills the command and returns 3 when its output exceeds the maximum size")
+{
+	string output;
+
+	int returnCode = run(vector<string>{ "./resources/test_flooding_gethostbyname.sh", "flooding" }, output, 5000, 64 * 1024);
+
+	CHECK( returnCode == 3 );
+	CHECK( output.empty() );
+}
+TEST_CASE("trustedCommand pins commands owned by root with modes 755 and reuses the result")
+{
+	shared_ptr<PinnedCommand> pinned = trustedCommand("/bin/ls");
+
+	REQUIRE( pinned );
+	CHECK( trustedCommand("/bin/ls") == pinned );
+	CHECK_FALSE( pinned->changed() );
+	CHECK_FALSE( trustedCommand("/somethingthatshouldnotexist") );
+	CHECK_FALSE( trustedCommand("./resources/test_gethostbyname.sh", getuid() + 1) );
+}
+TEST_CASE("run executes the pinned command even if the file is replaced after being checked")
+{
+	string path = "/tmp/nsscommand_pinned_" + to_string(getpid()) + ".sh";
+	string output;
+	run("printf '#!/bin/sh\\necho first\\n' > " + path + "; chmod 755 " + path, output);
+	shared_ptr<PinnedCommand> pinned = trustedCommand(path, getuid());
+	REQUIRE( pinned );
+
+	run("printf '#!/bin/sh\\necho second\\n' > " + path + ".new; chmod 755 " + path + ".new; mv " + path + ".new " + path, output);
+
+	CHECK( pinned->changed() );
+	CHECK( run(vector<string>{ path }, output, 5000, 1024 * 1024, pinned) == 0 );
+	CHECK( output == "first\n" );
+	CHECK( run(vector<string>{ path }, output) == 0 );
+	CHECK( output == "second\n" );
+	unlink(path.c_str());
+}
+TEST_CASE("parseCommandOutput reads the ttl of the entry")
+{
+	CHECK( parseCommandOutput("name: myhost\nttl: 60\n").ttl == 60 );
+	CHECK( parseCommandOutput("name: myhost\nttl:99999999999\n").ttl == INT32_MAX );
+	CHECK( parseCommandOutput("name: myhost\nttl: -5\nttl: 6s\n").ttl == -1 );
+	CHECK( parseCommandOutput("name: myhost\n").ttl == -1 );
+}
+TEST_CASE("runNssCommandGethostbyname3 and runNssCommandGethostbyname4 return the ttl given by the command")
+{
+	resultCache().clear();
+	const char* command = "./resources/test_gethostbyname.sh";
+	hostent result;
+	gaih_addrtuple* tuples;
+	size_t bufferSize = 16384;
+	char* buffer = new char[bufferSize];
+	int error, herror;
+	int32_t ttl = INT32_MAX;
+	char* canonical = nullptr;
+
+	REQUIRE( runNssCommandGethostbyname3("myhost", AF_INET, &result, buffer, bufferSize, &error, &herror, &ttl, &canonical, command) == NSS_STATUS_SUCCESS );
+	CHECK( ttl == 300 );
+	CHECK( canonical == result.h_name );
+	ttl = INT32_MAX;
+	REQUIRE( runNssCommandGethostbyname4("myhost", &tuples, buffer, bufferSize, &error, &herror, &ttl, command) == NSS_STATUS_SUCCESS );
+	CHECK( ttl > 290 );
+	CHECK( ttl <= 300 );
+	CHECK( resultCache().hits() == 1 );
+	ttl = INT32_MAX;
+	REQUIRE( runNssCommandGethostbyname4("myhost", &tuples, buffer, bufferSize, &error, &herror, &ttl, "./resources/test_counting_gethostbyname.sh") == NSS_STATUS_SUCCESS );
+	CHECK( ttl == INT32_MAX );
+	resetExecutionCount("myhost");
+	delete[] buffer;
+}
+TEST_CASE("ResultCache keeps successful results for the ttl given by the command")
+{
+	ResultCache cache(16, 60, 60);
+	HostEntry entry;
+	entry.ttl = 0;
+	int returnCode;
+	string key = ResultCache::makeKey(QueryKind::byName, "cmd", "host");
+
+	cache.insert(key, 0, entry);
+	CHECK_FALSE( cache.find(key, returnCode, entry) );
+	entry.ttl = 1000;
+	cache.insert(key, 0, entry);
+	REQUIRE( cache.find(key, returnCode, entry) );
+	CHECK( entry.ttl > 990 );
+	CHECK( entry.ttl <= 1000 );
+}
+TEST_CASE("parseCommandOutput reads ip6 addresses")
+{
+	in6_addr loopback;
+	in6_addr mapped;
+	inet_pton(AF_INET6, "::1", &loopback);
+	inet_pton(AF_INET6, "::ffff:10.0.0.1", &mapped);
+
+	HostEntry entry = parseCommandOutput("name: myhost\nip6: ::1\nip6:\t::ffff:10.0.0.1\nip6: ::g\nip6: 1::2::3\nip6: ::1 \nip4: 10.0.0.1\n");
+
+	REQUIRE( entry.addresses6.size() == 2 );
+	CHECK( entry.addresses6[0] == loopback );
+	CHECK( entry.addresses6[1] == mapped );
+	CHECK( entry.addresses.size() == 1 );
+	CHECK( parseCommandOutput(formatHostEntry(entry)) == entry );
+}
+TEST_CASE("runNssCommandGethostbyname3 returns the ip6 addresses when asked for AF_INET6")
+{
+	in6_addr expectedAddress1;
+	in6_addr expectedAddress2;
+	inet_pton(AF_INET6, "::1", &expectedAddress1);
+	inet_pton(AF_INET6, "fe80::1", &expectedAddress2);
+	const char* command = "./resources/test_gethostbyname.sh";
+	hostent result;
+	size_t bufferSize = 1024;
+	char* buffer = new char[bufferSize];
+	int error, herror;
+
+	REQUIRE( runNssCommandGethostbyname3("dualstack", AF_INET6, &result, buffer, bufferSize, &error, &herror, nullptr, nullptr, command) == NSS_STATUS_SUCCESS );
+	CHECK( string(result.h_name) == "dualstack.local." );
+	CHECK( result.h_addrtype == AF_INET6 );
+	CHECK( result.h_length == sizeof(in6_addr) );
+	CHECK( *(in6_addr*) result.h_addr_list[0] == expectedAddress1 );
+	CHECK( *(in6_addr*) result.h_addr_list[1] == expectedAddress2 );
+	CHECK( result.h_addr_list[2] == nullptr );
+
+	REQUIRE( runNssCommandGethostbyname3("dualstack", AF_INET, &result, buffer, bufferSize, &error, &herror, nullptr, nullptr, command) == NSS_STATUS_SUCCESS );
+	CHECK( result.h_addrtype == AF_INET );
+	CHECK( result.h_addr_list[1] == nullptr );
+	CHECK( runNssCommandGethostbyname3("ip6only", AF_INET, &result, buffer, bufferSize, &error, &herror, nullptr, nullptr, command) == NSS_STATUS_UNAVAIL );
+	CHECK( herror == NO_DATA );
+	CHECK( runNssCommandGethostbyname3("dualstack", AF_UNIX, &result, buffer, bufferSize, &error, &herror, nullptr, nullptr, command) == NSS_STATUS_NOTFOUND );
+	delete[] buffer;
+}
+TEST_CASE("runNssCommandGethostbyname4 returns ip4 and ip6 tuples from a single command execution")
+{
+	resultCache().clear();
+	in_addr expectedAddress1;
+	in6_addr expectedAddress2;
+	inet_aton("127.0.0.1", &expectedAddress1);
+	inet_pton(AF_INET6, "::1", &expectedAddress2);
+	gaih_addrtuple* result;
+	size_t bufferSize = 1024;
+	char* buffer = new char[bufferSize];
+	int error, herror, ttl;
+
+	REQUIRE( runNssCommandGethostbyname4("dualstack", &result, buffer, bufferSize, &error, &herror, &ttl, "./resources/test_gethostbyname.sh") == NSS_STATUS_SUCCESS );
+
+	REQUIRE( result != nullptr );
+	CHECK( result->family == AF_INET );
+	CHECK( result->addr[0] == expectedAddress1.s_addr );
+	REQUIRE( result->next != nullptr );
+	CHECK( result->next->family == AF_INET6 );
+	CHECK( memcmp(result->next->addr, &expectedAddress2, sizeof(in6_addr)) == 0 );
+	REQUIRE( result->next->next != nullptr );
+	CHECK( result->next->next->family == AF_INET6 );
+	CHECK( result->next->next->next == nullptr );
+	CHECK( string(result->next->next->name) == "dualstack.local." );
+	CHECK( resultCache().misses() == 1 );
+	delete[] buffer;
+}
+TEST_CASE("runNssCommandGethostbyaddr resolves ip6 addresses")
+{
+	in6_addr address;
+	inet_pton(AF_INET6, "fe80::1", &address);
+	hostent result;
+	size_t bufferSize = 1024;
+	char* buffer = new char[bufferSize];
+	int error, herror;
+
+	REQUIRE( runNssCommandGethostbyaddr(&address, sizeof(address), AF_INET6, &result, buffer, bufferSize, &error, &herror, "./resources/test_gethostbyaddr.sh") == NSS_STATUS_SUCCESS );
+	CHECK( string(result.h_name) == "dualstack.local." );
+	CHECK( result.h_addrtype == AF_INET6 );
+	CHECK( *(in6_addr*) result.h_addr_list[0] == address );
+	CHECK( result.h_addr_list[1] == nullptr );
+	CHECK( runNssCommandGethostbyaddr(&address, 4, AF_INET6, &result, buffer, bufferSize, &error, &herror, "./resources/test_gethostbyaddr.sh") == NSS_STATUS_NOTFOUND );
+	delete[] buffer;
+}
+TEST_CASE("concurrent lookups of the same name execute the command only once")
+{
+	resultCache().clear();
+	const char* command = "./resources/test_counting_gethostbyname.sh";
+	string hostname = "slow" + to_string(getpid());
+	resetExecutionCount(hostname);
+	unsigned long coalescedBefore = requestCoalescer().coalesced();
+	const int threadCount = 16;
+	vector<thread> threads;
+	vector<nss_status> results(threadCount);
+	vector<string> names(threadCount);
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		threads.emplace_back([&, i]() {
+			vector<char> buffer(16384);
+			gaih_addrtuple* tuples;
+			int error, herror, ttl;
+			results[i] = runNssCommandGethostbyname4(hostname.c_str(), &tuples, buffer.data(), buffer.size(), &error, &herror, &ttl, command);
+			if (results[i] == NSS_STATUS_SUCCESS) names[i] = tuples->name;
+		});
+	}
+	for (auto& running : threads) running.join();
+
+	CHECK( executionCount(hostname) == 1 );
+	CHECK( requestCoalescer().coalesced() > coalescedBefore );
+	for (int i = 0; i < threadCount; i++)
+	{
+		CHECK( results[i] == NSS_STATUS_SUCCESS );
+		CHECK( names[i] == hostname + ".local." );
+	}
+	resetExecutionCount(hostname);
+}
+TEST_CASE("RequestCoalescer waiters give up when the execution they wait for should have finished")
+{
+	RequestCoalescer coalescer;
+	atomic<bool> executing(false), release(false);
+	thread leader([&]() {
+		HostEntry entry;
+		coalescer.run("key", entry, 100, [&](HostEntry&) {
+			executing = true;
+			while (!release) this_thread::sleep_for(chrono::milliseconds(5));
+			return 0;
+		});
+	});
+	while (!executing) this_thread::sleep_for(chrono::milliseconds(1));
+	HostEntry entry;
+	auto start = chrono::steady_clock::now();
+	int returnCode = coalescer.run("key", entry, 10000, [](HostEntry&) { return 1; });
+
+	CHECK( coalescer.coalesced() == 1 );
+	CHECK( returnCode == 2 );
+	CHECK( chrono::steady_clock::now() - start < chrono::seconds(1) );
+	release = true;
+	leader.join();
+}
+TEST_CASE("RequestCoalescer forgets in a forked child the executions of its parent")
+{
+	RequestCoalescer& coalescer = requestCoalescer();
+	atomic<bool> started(false);
+	atomic<bool> release(false);
+	thread leader([&]() {
+		HostEntry entry;
+		coalescer.run("forked", entry, 1000, [&](HostEntry&) {
+			started = true;
+			while (!release) this_thread::sleep_for(chrono::milliseconds(5));
+			return 0;
+		});
+	});
+	while (!started) this_thread::sleep_for(chrono::milliseconds(1));
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		HostEntry entry;
+		bool executed = false;
+		int returnCode = coalescer.run("forked", entry, 10000, [&](HostEntry&) { executed = true; return 1; });
+		_exit((executed && returnCode == 1) ? 0 : 1);
+	}
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	release = true;
+	leader.join();
+}
+TEST_CASE("SharedCache shares results between every mapping of the file")
+{
+	string path = "/tmp/nsscommand_shared_" + to_string(getpid()) + ".cache";
+	unlink(path.c_str());
+	unique_ptr<SharedCache> writer = SharedCache::open(path, 64, getuid(), 60, 60);
+	REQUIRE( writer );
+	REQUIRE( writer->isWritable() );
+	unique_ptr<SharedCache> reader = SharedCache::open(path, 64, getuid(), 60, 60);
+	REQUIRE( reader );
+	HostEntry entry = parseCommandOutput("name: myhost.local.\nalias: myhost\nip4: 127.0.0.1\nip6: ::1\n");
+	string key = ResultCache::makeKey(QueryKind::byName, "cmd", "myhost");
+	string notFoundKey = ResultCache::makeKey(QueryKind::byName, "cmd", "notfound");
+	int returnCode = -1;
+	HostEntry found;
+
+	CHECK_FALSE( reader->find(key, returnCode, found) );
+	CHECK( writer->insert(key, 0, entry) );
+	CHECK( writer->insert(notFoundKey, 1, HostEntry()) );
+	CHECK_FALSE( writer->insert(ResultCache::makeKey(QueryKind::byName, "cmd", "tryagain"), 2, HostEntry()) );
+
+	REQUIRE( reader->find(key, returnCode, found) );
+	CHECK( returnCode == 0 );
+	CHECK( found == entry );
+	REQUIRE( reader->find(notFoundKey, returnCode, found) );
+	CHECK( returnCode == 1 );
+	CHECK_FALSE( reader->find(ResultCache::makeKey(QueryKind::byAddress, "cmd", "myhost"), returnCode, found) );
+	unlink(path.c_str());
+}
+TEST_CASE("SharedCache refuses files not owned by the expected user")
+{
+	string path = "/tmp/nsscommand_shared_" + to_string(getpid()) + ".cache";
+	unlink(path.c_str());
+	REQUIRE( SharedCache::open(path, 64, getuid(), 60, 60) );
+
+	CHECK_FALSE( SharedCache::open(path, 64, getuid() + 1, 60, 60) );
+	CHECK_FALSE( SharedCache::open(path, 128, getuid(), 60, 60) );
+	chmod(path.c_str(), 0666);
+	CHECK_FALSE( SharedCache::open(path, 64, getuid(), 60, 60) );
+	unlink(path.c_str());
+}
+TEST_CASE("SharedCache readers never see partially written entries")
+{
+	string path = "/tmp/nsscommand_shared_" + to_string(getpid()) + ".cache";
+	unlink(path.c_str());
+	unique_ptr<SharedCache> cache = SharedCache::open(path, 4, getuid(), 60, 60);
+	REQUIRE( cache );
+	HostEntry first = parseCommandOutput("name: first.local.\nalias: a\nip4: 10.0.0.1\nip4: 10.0.0.2\n");
+	HostEntry second = parseCommandOutput("name: second.local.\nalias: bb\nalias: cc\nip4: 10.0.0.3\n");
+	string key = ResultCache::makeKey(QueryKind::byName, "cmd", "flapping");
+	atomic<bool> stop(false);
+	atomic<int> torn(0);
+	atomic<int> reads(0);
+
+	thread writer([&]() {
+		for (int i = 0; i < 20000; i++) cache->insert(key, 0, (i % 2) ? first : second);
+		stop = true;
+	});
+	vector<thread> readers;
+	for (int i = 0; i < 3; i++)
+	{
+		readers.emplace_back([&]() {
+			while (!stop)
+			{
+				int returnCode;
+				HostEntry found;
+				if (!cache->find(key, returnCode, found)) continue;
+				reads++;
+				if (!(found == first) && !(found == second)) torn++;
+			}
+		});
+	}
+	writer.join();
+	for (auto& reader : readers) reader.join();
+
+	CHECK( torn == 0 );
+	CHECK( reads > 0 );
+	unlink(path.c_str());
+}
+TEST_CASE("parseHostList splits the output of several hosts at each name line")
+{
+	vector<HostEntry> entries = parseHostList("ignored: line\nname: first.local.\nalias: first\nip4: 10.0.0.1\n\nname: second.local.\nip6: ::1\nname: third.local.");
+
+	REQUIRE( entries.size() == 3 );
+	CHECK( entries[0] == parseCommandOutput("name: first.local.\nalias: first\nip4: 10.0.0.1\n") );
+	CHECK( entries[1] == parseCommandOutput("name: second.local.\nip6: ::1\n") );
+	CHECK( entries[2].name == "third.local." );
+}
+TEST_CASE("HostDatabase finds hosts by name, alias and address without running commands")
+{
+	string path = "/tmp/nsscommand_hosts_" + to_string(getpid()) + ".db";
+	HostEntry first = parseCommandOutput("name: first.local.\nalias: First\nip4: 10.0.0.1\nip4: 10.0.0.2\nip6: fe80::1\nttl: 60\n");
+	HostEntry second = parseCommandOutput("name: second.local.\nalias: first\nip4: 10.0.0.2\nip4: 192.168.0.1\n");
+	REQUIRE( HostDatabase::write(path, vector<HostEntry>{ first, second }) );
+	unique_ptr<HostDatabase> database = HostDatabase::open(path, getuid());
+	REQUIRE( database );
+	HostEntry found;
+
+	CHECK( database->nameCount() == 3 );
+	CHECK( database->addressCount() == 4 );
+	REQUIRE( database->find(QueryKind::byName, "first.local.", found) );
+	CHECK( found == first );
+	REQUIRE( database->find(QueryKind::byName, "FIRST", found) );
+	CHECK( found == first );
+	REQUIRE( database->find(QueryKind::byName, "second.local.", found) );
+	CHECK( found == second );
+	REQUIRE( database->find(QueryKind::byAddress, "10.0.0.2", found) );
+	CHECK( found == first );
+	REQUIRE( database->find(QueryKind::byAddress, "192.168.0.1", found) );
+	CHECK( found == second );
+	REQUIRE( database->find(QueryKind::byAddress, "fe80::1", found) );
+	CHECK( found == first );
+	CHECK_FALSE( database->find(QueryKind::byName, "second", found) );
+	CHECK_FALSE( database->find(QueryKind::byName, "first.local", found) );
+	CHECK_FALSE( database->find(QueryKind::byAddress, "10.0.0.3", found) );
+	CHECK_FALSE( database->find(QueryKind::byAddress, "::1", found) );
+	unlink(path.c_str());
+}
+TEST_CASE("HostDatabase is replaced atomically and refused with wrong owner or permissions")
+{
+	string path = "/tmp/nsscommand_hosts_" + to_string(getpid()) + ".db";
+	REQUIRE( HostDatabase::write(path, vector<HostEntry>{ parseCommandOutput("name: old.local.\nip4: 10.0.0.1\n") }) );
+	unique_ptr<HostDatabase> oldDatabase = HostDatabase::open(path, getuid());
+	REQUIRE( oldDatabase );
+	CHECK_FALSE( oldDatabase->changed() );
+
+	REQUIRE( HostDatabase::write(path, vector<HostEntry>{ parseCommandOutput("name: new.local.\nip4: 10.0.0.1\n") }) );
+	CHECK( oldDatabase->changed() );
+	HostEntry found;
+	REQUIRE( oldDatabase->find(QueryKind::byAddress, "10.0.0.1", found) );
+	CHECK( found.name == "old.local." );
+	unique_ptr<HostDatabase> newDatabase = HostDatabase::open(path, getuid());
+	REQUIRE( newDatabase );
+	REQUIRE( newDatabase->find(QueryKind::byAddress, "10.0.0.1", found) );
+	CHECK( found.name == "new.local." );
+
+	CHECK_FALSE( HostDatabase::open(path, getuid() + 1) );
+	chmod(path.c_str(), 0664);
+	CHECK_FALSE( HostDatabase::open(path, getuid()) );
+	unlink(path.c_str());
+	CHECK_FALSE( HostDatabase::open(path, getuid()) );
+}
+TEST_CASE("AdmissionFilter admits exact names and names below a domain")
+{
+	AdmissionFilter filter("gateway.mycompany.com, .local. .internal.mycompany.com", "");
+
+	CHECK( filter.admitsName("gateway.mycompany.com") );
+	CHECK( filter.admitsName("Gateway.MyCompany.com.") );
+	CHECK( filter.admitsName("myhost.local") );
+	CHECK( filter.admitsName("a.b.local.") );
+	CHECK( filter.admitsName("db.internal.mycompany.com") );
+	CHECK_FALSE( filter.admitsName("local") );
+	CHECK_FALSE( filter.admitsName("internal.mycompany.com") );
+	CHECK_FALSE( filter.admitsName("www.mycompany.com") );
+	CHECK_FALSE( filter.admitsName("mycompany.com") );
+	CHECK_FALSE( filter.admitsName("gateway.mycompany.com.evil.org") );
+	CHECK_FALSE( filter.admitsName("myhost..local") );
+	CHECK_FALSE( filter.admitsName("") );
+	CHECK( filter.admitsAddress("8.8.8.8") );
+}
+TEST_CASE("AdmissionFilter admits addresses inside the networks")
+{
+	AdmissionFilter filter("", "10.0.0.0/8 192.168.1.128/25 172.16.0.1 fd00::/8 fe80::/10");
+
+	CHECK( filter.admitsAddress("10.1.2.3") );
+	CHECK( filter.admitsAddress("192.168.1.200") );
+	CHECK( filter.admitsAddress("172.16.0.1") );
+	CHECK( filter.admitsAddress("fd12::1") );
+	CHECK( filter.admitsAddress("febf::1") );
+	CHECK_FALSE( filter.admitsAddress("11.0.0.1") );
+	CHECK_FALSE( filter.admitsAddress("192.168.1.127") );
+	CHECK_FALSE( filter.admitsAddress("172.16.0.2") );
+	CHECK_FALSE( filter.admitsAddress("fec0::1") );
+	CHECK_FALSE( filter.admitsAddress("::1") );
+	CHECK( filter.admitsName("anything.example.com") );
+}
+TEST_CASE("AdmissionFilter ignores invalid patterns and counts rejected queries")
+{
+	AdmissionFilter empty("..", "10.0.0.0/33 nonsense 10.0.0.0/ 10.0.0.0/x");
+	CHECK( empty.admits(QueryKind::byName, "myhost") );
+	CHECK( empty.admits(QueryKind::byAddress, "127.0.0.1") );
+	CHECK( empty.rejected() == 0 );
+
+	AdmissionFilter filter(".local", "127.0.0.0/8");
+	CHECK( filter.admits(QueryKind::byName, "myhost.local") );
+	CHECK_FALSE( filter.admits(QueryKind::byName, "myhost.example.com") );
+	CHECK( filter.admits(QueryKind::byAddress, "127.0.0.1") );
+	CHECK_FALSE( filter.admits(QueryKind::byAddress, "::1") );
+	CHECK( filter.rejected() == 2 );
+}
+TEST_CASE("parseConfiguration applies known settings and ignores the rest")
+{
+	Configuration settings;
+	settings.gethostbynameCommand = "/default/byname";
+	settings.commandTimeout = 5000;
+	settings.socketMode = false;
+	settings.cacheCapacity = 1024;
+	settings.cachePositiveTtl = 10;
+	size_t applied = parseConfiguration(
+		"# comment = ignored\n"
+		"gethostbyname_command = /usr/bin/my resolver\n"
+		"  command_timeout=250  \r\n"
+		"socket_mode = yes\n"
+		"cache_capacity = -5\n"
+		"cache_positive_ttl = 99999999999\n"
+		"unknown_setting = 1\n"
+		"no equals sign\n"
+		"admitted_names = .local, .mycompany.com", settings);
+
+	CHECK( applied == 4 );
+	CHECK( settings.gethostbynameCommand == "/usr/bin/my resolver" );
+	CHECK( settings.commandTimeout == 250 );
+	CHECK( settings.socketMode );
+	CHECK( settings.cacheCapacity == 1024 );
+	CHECK( settings.cachePositiveTtl == 10 );
+	CHECK( settings.admittedNames == ".local, .mycompany.com" );
+}
+TEST_CASE("ConfigurationSource reloads the file when it changes and ignores unsafe files")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".conf";
+	unlink(path.c_str());
+	Configuration defaults;
+	defaults.commandTimeout = 5000;
+	defaults.admittedNames = "";
+	defaults.admittedNetworks = "";
+	ConfigurationSource source(path, getuid(), 0, defaults);
+
+	const Configuration& missing = source.current();
+	CHECK( missing.commandTimeout == 5000 );
+	REQUIRE( missing.admissionFilter );
+	CHECK( missing.admissionFilter->admitsName("anything.example.com") );
+	CHECK( &source.current() == &missing );
+
+	ofstream(path) << "command_timeout = 100\nadmitted_names = .local\n";
+	chmod(path.c_str(), 0644);
+	const Configuration& loaded = source.current();
+	CHECK( loaded.commandTimeout == 100 );
+	CHECK( loaded.generation > missing.generation );
+	CHECK_FALSE( loaded.admissionFilter->admitsName("anything.example.com") );
+	CHECK( &source.current() == &loaded );
+
+	ofstream(path) << "command_timeout = 2000\n";
+	CHECK( source.current().commandTimeout == 2000 );
+	chmod(path.c_str(), 0666);
+	CHECK( source.current().commandTimeout == 5000 );
+
+	ConfigurationSource otherOwner(path, getuid() + 1, 0, defaults);
+	chmod(path.c_str(), 0644);
+	CHECK( otherOwner.current().commandTimeout == 5000 );
+	unlink(path.c_str());
+	CHECK( source.current().commandTimeout == 5000 );
+}
+TEST_CASE("ConfigurationSource checks the file at most once per interval")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".conf";
+	ofstream(path) << "command_timeout = 100\n";
+	chmod(path.c_str(), 0644);
+	Configuration defaults;
+	defaults.commandTimeout = 5000;
+	ConfigurationSource source(path, getuid(), 60, defaults);
+
+	CHECK( source.current().commandTimeout == 100 );
+	ofstream(path) << "command_timeout = 2000\n";
+	CHECK( source.current().commandTimeout == 100 );
+	unlink(path.c_str());
+}
+TEST_CASE("ConcurrencyLimiter lets only limit executions run at the same time")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".slots";
+	unlink(path.c_str());
+	ConcurrencyLimiter limiter;
+	int first, second, third;
+	uint64_t waitsBefore = metrics().snapshot().count(Histogram::concurrencyWaitTime);
+
+	REQUIRE( limiter.acquire(path, geteuid(), 2, 100, first) );
+	REQUIRE( limiter.acquire(path, geteuid(), 2, 100, second) );
+	CHECK( first >= 0 );
+	CHECK( second >= 0 );
+	auto start = chrono::steady_clock::now();
+	CHECK_FALSE( limiter.acquire(path, geteuid(), 2, 50, third) );
+	CHECK( chrono::steady_clock::now() - start >= chrono::milliseconds(50) );
+	CHECK( limiter.timedOut() == 1 );
+	CHECK( limiter.waiting() == 0 );
+
+	thread releaser([&]() {
+		this_thread::sleep_for(chrono::milliseconds(30));
+		limiter.release(first);
+	});
+	CHECK( limiter.acquire(path, geteuid(), 2, 1000, third) );
+	releaser.join();
+	CHECK( limiter.acquired() == 3 );
+	CHECK( limiter.waited() == 2 );
+	CHECK( limiter.maxWaiting() == 1 );
+	CHECK( limiter.maxWaitMicroseconds() >= 25000 );
+	CHECK( limiter.waitMicroseconds() >= limiter.maxWaitMicroseconds() );
+	MetricsSnapshot totals = metrics().snapshot();
+	CHECK( totals.count(Histogram::concurrencyWaitTime) == waitsBefore + 2 );
+	CHECK( totals.counter(Counter::concurrencyWaiting) == 0 );
+	CHECK( totals.counter(Counter::concurrencyMaxWaiting) >= 1 );
+	limiter.release(second);
+	limiter.release(third);
+	unlink(path.c_str());
+}
+TEST_CASE("ConcurrencyLimiter doesn't limit when disabled")
+{
+	ConcurrencyLimiter limiter;
+	int slot;
+
+	CHECK( limiter.acquire("/tmp/unused.slots", geteuid(), 0, 0, slot) );
+	CHECK( slot == -1 );
+	CHECK( limiter.acquired() == 0 );
+}
+TEST_CASE("ConcurrencyLimiter limits each process on its own when the lock file can't be used or isn't trusted")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".slots";
+	unlink(path.c_str());
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+	REQUIRE( fd >= 0 );
+	REQUIRE( fchmod(fd, 0666) == 0 );
+	close(fd);
+	vector<pair<string, uid_t>> untrusted = { { "/nonexistent/directory/nsscommand.slots", geteuid() }, { "/dev/null", geteuid() },
+		{ path, geteuid() }, { "/tmp/nsscommand_other_" + to_string(getpid()) + ".slots", geteuid() + 1 } };
+	for (auto& file : untrusted)
+	{
+		ConcurrencyLimiter limiter;
+		int first, second;
+
+		REQUIRE( limiter.acquire(file.first, file.second, 1, 0, first) );
+		CHECK( first < -1 );
+		CHECK_FALSE( limiter.acquire(file.first, file.second, 1, 20, second) );
+		limiter.release(first);
+		REQUIRE( limiter.acquire(file.first, file.second, 1, 0, second) );
+		limiter.release(second);
+		CHECK( limiter.acquired() == 2 );
+	}
+	CHECK( access(("/tmp/nsscommand_other_" + to_string(getpid()) + ".slots").c_str(), F_OK) != 0 );
+	unlink(path.c_str());
+}
+TEST_CASE("CircuitBreaker fails fast after consecutive failures and probes after the cool-down")
+{
+	CircuitBreaker breaker;
+	int returnCode = -1;
+
+	for (int i = 0; i < 2; i++)
+	{
+		CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+		breaker.record("cmd", 3, 100, 3);
+	}
+	breaker.record("cmd", 3, 100, 1);
+	for (int i = 0; i < 3; i++)
+	{
+		CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+		breaker.record("cmd", 3, 100, (i == 2) ? 2 : 3);
+	}
+	CHECK_FALSE( breaker.allow("cmd", 3, 100, returnCode) );
+	CHECK( returnCode == 2 );
+	CHECK( breaker.allow("other", 3, 100, returnCode) );
+	CHECK( breaker.rejected() == 1 );
+
+	this_thread::sleep_for(chrono::milliseconds(120));
+	CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+	CHECK_FALSE( breaker.allow("cmd", 3, 100, returnCode) );
+	breaker.record("cmd", 3, 100, 127);
+	CHECK_FALSE( breaker.allow("cmd", 3, 100, returnCode) );
+	CHECK( returnCode == 127 );
+
+	this_thread::sleep_for(chrono::milliseconds(120));
+	CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+	breaker.record("cmd", 3, 100, 0);
+	CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+	CHECK( breaker.allow("cmd", 3, 100, returnCode) );
+}
+TEST_CASE("CircuitBreaker is disabled by a threshold of 0")
+{
+	CircuitBreaker breaker;
+	int returnCode = -1;
+	for (int i = 0; i < 10; i++) breaker.record("cmd", 0, 100, 3);
+	CHECK( breaker.allow("cmd", 0, 100, returnCode) );
+	CHECK( returnCode == -1 );
+}
+TEST_CASE("CircuitBreaker state is shared by every mapping of the file")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".breaker";
+	unlink(path.c_str());
+	unique_ptr<CircuitBreaker> first = CircuitBreaker::open(path, geteuid());
+	unique_ptr<CircuitBreaker> second = CircuitBreaker::open(path, geteuid());
+	REQUIRE( first );
+	REQUIRE( second );
+	int returnCode = -1;
+
+	first->record("cmd", 2, 1000, 3);
+	CHECK( second->allow("cmd", 2, 1000, returnCode) );
+	second->record("cmd", 2, 1000, 3);
+	CHECK_FALSE( first->allow("cmd", 2, 1000, returnCode) );
+	CHECK( returnCode == 3 );
+
+	CHECK( first->isWritable() );
+	truncate(path.c_str(), 10);
+	CHECK_FALSE( CircuitBreaker::open(path, geteuid()) );
+	unlink(path.c_str());
+}
+TEST_CASE("CircuitBreaker refuses files not owned by the expected user or writable by others")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".breaker";
+	unlink(path.c_str());
+	REQUIRE( CircuitBreaker::open(path, geteuid()) );
+
+	CHECK_FALSE( CircuitBreaker::open(path, geteuid() + 1) );
+	chmod(path.c_str(), 0666);
+	CHECK_FALSE( CircuitBreaker::open(path, geteuid()) );
+	unlink(path.c_str());
+	CHECK_FALSE( CircuitBreaker::open(path, geteuid() + 1) ); // only the owner creates it
+	CHECK( access(path.c_str(), F_OK) != 0 );
+}
+TEST_CASE("ResultCache serves expired successful results during the stale window")
+{
+	ResultCache cache(16, 1, 1, 5);
+	HostEntry entry = parseCommandOutput("name: myhost.local.\nip4: 127.0.0.1\nttl: 1\n");
+	string key = ResultCache::makeKey(QueryKind::byName, "cmd", "myhost");
+	string notFoundKey = ResultCache::makeKey(QueryKind::byName, "cmd", "notfound");
+	int returnCode;
+	HostEntry found;
+	bool refresh;
+	cache.insert(key, 0, entry);
+	cache.insert(notFoundKey, 1, HostEntry());
+
+	REQUIRE( cache.find(key, returnCode, found, refresh) );
+	CHECK_FALSE( refresh );
+	this_thread::sleep_for(chrono::milliseconds(1100));
+	CHECK_FALSE( cache.find(key, returnCode, found) );
+	REQUIRE( cache.find(key, returnCode, found, refresh) );
+	CHECK( refresh );
+	CHECK( returnCode == 0 );
+	CHECK( found.name == "myhost.local." );
+	CHECK( found.ttl == 0 );
+	REQUIRE( cache.find(key, returnCode, found, refresh) );
+	CHECK_FALSE( refresh );
+	CHECK( cache.staleHits() == 2 );
+	CHECK_FALSE( cache.find(notFoundKey, returnCode, found, refresh) );
+
+	cache.insert(key, 2, HostEntry());
+	REQUIRE( cache.find(key, returnCode, found, refresh) );
+	CHECK( refresh );
+	cache.insert(key, 3, HostEntry());
+	REQUIRE( cache.find(key, returnCode, found, refresh) );
+	CHECK( returnCode == 3 );
+	CHECK_FALSE( refresh );
+}
+TEST_CASE("lookups of an expired name don't wait for the command during the stale window")
+{
+	const Configuration& settings = configuration();
+	resultCache().clear();
+	resultCache().configure(settings.cacheCapacity, 1, settings.cacheNegativeTtl, 10);
+	const char* command = "./resources/test_counting_gethostbyname.sh";
+	string hostname = "slowstale" + to_string(getpid());
+	resetExecutionCount(hostname);
+	vector<char> buffer(16384);
+	gaih_addrtuple* tuples;
+	int error, herror, ttl;
+
+	REQUIRE( runNssCommandGethostbyname4(hostname.c_str(), &tuples, buffer.data(), buffer.size(), &error, &herror, &ttl, command) == NSS_STATUS_SUCCESS );
+	this_thread::sleep_for(chrono::milliseconds(1100));
+	auto start = chrono::steady_clock::now();
+	REQUIRE( runNssCommandGethostbyname4(hostname.c_str(), &tuples, buffer.data(), buffer.size(), &error, &herror, &ttl, command) == NSS_STATUS_SUCCESS );
+	CHECK( chrono::steady_clock::now() - start < chrono::milliseconds(200) );
+	CHECK( string(tuples->name) == hostname + ".local." );
+	CHECK( resultCache().staleHits() == 1 );
+	for (int i = 0; i < 50 && executionCount(hostname) < 2; i++) this_thread::sleep_for(chrono::milliseconds(50));
+	this_thread::sleep_for(chrono::milliseconds(700)); // the refresh takes half a second after it starts
+	CHECK( executionCount(hostname) == 2 );
+	start = chrono::steady_clock::now();
+	REQUIRE( runNssCommandGethostbyname4(hostname.c_str(), &tuples, buffer.data(), buffer.size(), &error, &herror, &ttl, command) == NSS_STATUS_SUCCESS );
+	CHECK( chrono::steady_clock::now() - start < chrono::milliseconds(200) );
+	CHECK( resultCache().staleHits() == 1 );
+	CHECK( executionCount(hostname) == 2 );
+
+	resultCache().configure(settings.cacheCapacity, settings.cachePositiveTtl, settings.cacheNegativeTtl, settings.cacheStaleWindow);
+	resultCache().clear();
+	resetExecutionCount(hostname);
+}
+TEST_CASE("a child created with fork() refreshes the stale results its parent was refreshing")
+{
+	const Configuration& settings = configuration();
+	resultCache().clear();
+	resultCache().configure(16, 60, 60, 60);
+	HostEntry entry = parseCommandOutput("name: myhost\nip4: 127.0.0.3\nttl: 1\n");
+	resultCache().insert("stalekey", 0, entry);
+	this_thread::sleep_for(chrono::milliseconds(1100));
+	int returnCode;
+	bool refresh;
+
+	REQUIRE( resultCache().find("stalekey", returnCode, entry, refresh) );
+	CHECK( refresh );
+	REQUIRE( resultCache().find("stalekey", returnCode, entry, refresh) );
+	CHECK_FALSE( refresh );
+	pid_t child = fork();
+	if (child == 0)
+	{
+		bool found = resultCache().find("stalekey", returnCode, entry, refresh);
+		_exit((found && refresh) ? 0 : 1);
+	}
+	REQUIRE( child > 0 );
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+
+	resultCache().configure(settings.cacheCapacity, settings.cachePositiveTtl, settings.cacheNegativeTtl, settings.cacheStaleWindow);
+	resultCache().clear();
+}
+TEST_CASE("exit() doesn't wait for the running background refreshes")
+{
+	auto start = chrono::steady_clock::now();
+	pid_t child = fork();
+	if (child == 0)
+	{
+		backgroundRefreshes().start([]() {
+			auto end = chrono::steady_clock::now() + chrono::seconds(5);
+			int returnCode;
+			HostEntry entry;
+			bool refresh;
+			while (chrono::steady_clock::now() < end) resultCache().find("exitkey", returnCode, entry, refresh);
+		});
+		exit((backgroundRefreshes().active() == 1) ? 0 : 1);
+	}
+	REQUIRE( child > 0 );
+	int status;
+	REQUIRE( waitpid(child, &status, 0) == child );
+	CHECK( WIFEXITED(status) );
+	CHECK( WEXITSTATUS(status) == 0 );
+	CHECK( chrono::steady_clock::now() - start < chrono::seconds(2) );
+}
+TEST_CASE("reverse lookups of addresses resolved forward don't execute the gethostbyaddr command")
+{
+	resultCache().clear();
+	reverseIndex().clear();
+	reverseIndex().configure(16, 60, 0);
+	const char* bynameCommand = "./resources/test_counting_gethostbyname.sh";
+	string hostname = "forward" + to_string(getpid());
+	vector<char> buffer(16384);
+	hostent result;
+	int error, herror;
+	in_addr address;
+	inet_aton("10.0.0.99", &address); // the first addresses don't fit in the index
+
+	REQUIRE( runNssCommandGethostbyname(hostname.c_str(), &result, buffer.data(), buffer.size(), &error, &herror, bynameCommand) == NSS_STATUS_SUCCESS );
+	REQUIRE( runNssCommandGethostbyaddr(&address, sizeof(address), AF_INET, &result, buffer.data(), buffer.size(), &error, &herror, "./resources/nonexistent_command.sh") == NSS_STATUS_SUCCESS );
+	CHECK( string(result.h_name) == hostname + ".local." );
+	CHECK( *(in_addr*) result.h_addr_list[98] == address );
+	CHECK( reverseIndex().size() == 16 );
+	CHECK( reverseIndex().hits() == 1 );
+	inet_aton("10.0.0.1", &address);
+	CHECK( runNssCommandGethostbyaddr(&address, sizeof(address), AF_INET, &result, buffer.data(), buffer.size(), &error, &herror, "./resources/nonexistent_command.sh") != NSS_STATUS_SUCCESS );
+	CHECK( reverseIndex().hits() == 1 );
+
+	reverseIndex().configure(0, 60, 0);
+	reverseIndex().clear();
+	resultCache().clear();
+	resetExecutionCount(hostname);
+}
+TEST_CASE("parseCommandOutput counts the lines it can't understand")
+{
+	string output = "name: host.local.\nip4: 10.0.0.1\nip4: 10.0.0.300\nip6: zz::1\nttl: soon\nsomething else\n\nalias: host\n";
+	HostEntry entry;
+	CHECK( parseCommandOutput(output.data(), output.size(), entry) == 4 );
+	CHECK( entry.addresses.size() == 1 );
+	CHECK( entry.aliases.size() == 1 );
+}
+TEST_CASE("Metrics adds up the counters and histograms of every thread")
+{
+	Metrics local;
+	vector<thread> threads;
+	for (int t = 0; t < 8; t++)
+	{
+		threads.emplace_back([&local]() {
+			for (int i = 0; i < 1000; i++)
+			{
+				local.add(Counter::spawns);
+				local.record(Histogram::spawnTime, 1500);
+			}
+			local.add(Counter::parseRejects, 3);
+		});
+	}
+	for (auto& thread : threads) thread.join();
+	MetricsSnapshot totals = local.snapshot();
+	CHECK( totals.counter(Counter::spawns) == 8000 );
+	CHECK( totals.counter(Counter::parseRejects) == 24 );
+	CHECK( totals.counter(Counter::timeouts) == 0 );
+	CHECK( totals.count(Histogram::spawnTime) == 8000 );
+	CHECK( totals.sums[size_t(Histogram::spawnTime)] == 8000 * 1500 );
+	CHECK( totals.percentile(Histogram::spawnTime, 0.99) == 2048 );
+	CHECK( totals.count(Histogram::readTime) == 0 );
+	CHECK( Metrics::bucket(0) == 0 );
+	CHECK( Metrics::bucket(1024) == 10 );
+	CHECK( Metrics::bucket(UINT64_MAX) == HISTOGRAM_BUCKETS - 1 );
+	CHECK( string(counterName(Counter::rangeRetries)) == "range_retries" );
+}
+TEST_CASE("Metrics in the shared file are seen by every mapping and refused with another layout")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".metrics";
+	unlink(path.c_str());
+	unique_ptr<Metrics> first = Metrics::open(path, geteuid());
+	unique_ptr<Metrics> second = Metrics::open(path, geteuid());
+	REQUIRE( first );
+	REQUIRE( second );
+
+	first->add(Counter::cacheHits, 2);
+	second->add(Counter::cacheHits);
+	second->record(Histogram::parseTime, 100);
+	unique_ptr<Metrics> reader = Metrics::openForReading(path, geteuid());
+	REQUIRE( reader );
+	CHECK( reader->snapshot().counter(Counter::cacheHits) == 3 );
+	CHECK( reader->snapshot().count(Histogram::parseTime) == 1 );
+
+	int fd = open(path.c_str(), O_WRONLY);
+	REQUIRE( fd >= 0 );
+	CHECK( pwrite(fd, "X", 1, 0) == 1 );
+	close(fd);
+	CHECK_FALSE( Metrics::openForReading(path, geteuid()) );
+	CHECK_FALSE( Metrics::open(path, geteuid()) );
+	unlink(path.c_str());
+}
+TEST_CASE("Metrics refuses files not owned by the expected user or writable by others")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".metrics";
+	unlink(path.c_str());
+
+	CHECK_FALSE( Metrics::open(path, geteuid() + 1) );
+	CHECK( access(path.c_str(), F_OK) != 0 );
+	REQUIRE( Metrics::open(path, geteuid()) );
+	struct stat properties;
+	REQUIRE( stat(path.c_str(), &properties) == 0 );
+	CHECK( (properties.st_mode & 0777) == 0644 );
+	CHECK_FALSE( Metrics::openForReading(path, geteuid() + 1) );
+	REQUIRE( chmod(path.c_str(), 0666) == 0 );
+	CHECK_FALSE( Metrics::open(path, geteuid()) );
+	CHECK_FALSE( Metrics::openForReading(path, geteuid()) );
+	unlink(path.c_str());
+}
+TEST_CASE("lookups count their entry point, how they were answered and how long the command took")
+{
+	resultCache().clear();
+	MetricsSnapshot before = metrics().snapshot();
+	vector<char> buffer(16384);
+	hostent result;
+	int error, herror;
+	const char* command = "./resources/test_gethostbyname.sh";
+
+	CHECK( runNssCommandGethostbyname("myhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_SUCCESS );
+	CHECK( runNssCommandGethostbyname("myhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_SUCCESS );
+	CHECK( runNssCommandGethostbyname("unknownhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_NOTFOUND );
+	CHECK( runNssCommandGethostbyname("dualstack", &result, buffer.data(), 8, &error, &herror, command) == NSS_STATUS_TRYAGAIN );
+	CHECK( error == ERANGE );
+	CHECK( _nss_command_gethostbyname_r("myhost", &result, buffer.data(), buffer.size(), &error, &herror) != NSS_STATUS_SUCCESS );
+
+	MetricsSnapshot after = metrics().snapshot();
+	auto grew = [&](Counter counter) { return after.counter(counter) - before.counter(counter); };
+	CHECK( grew(Counter::gethostbynameLookups) == 1 );
+	CHECK( grew(Counter::spawns) == 3 );
+	CHECK( grew(Counter::cacheHits) == 1 );
+	CHECK( grew(Counter::exitCode0) == 2 );
+	CHECK( grew(Counter::exitCode1) == 1 );
+	CHECK( grew(Counter::successResults) == 2 );
+	CHECK( grew(Counter::notFoundResults) == 1 );
+	CHECK( grew(Counter::rangeRetries) == 1 );
+	CHECK( after.count(Histogram::executionTime) - before.count(Histogram::executionTime) == 3 );
+	CHECK( after.count(Histogram::spawnTime) - before.count(Histogram::spawnTime) == 3 );
+	CHECK( after.count(Histogram::parseTime) - before.count(Histogram::parseTime) == 2 );
+	resultCache().clear();
+}
+TEST_CASE("TraceBuffer keeps the last events in order and refuses other files")
+{
+	string path = "/tmp/nsscommand_" + to_string(getpid()) + ".trace";
+	unique_ptr<TraceBuffer> buffer = TraceBuffer::create(path, 4);
+	REQUIRE( buffer );
+	CHECK( buffer->pid() == getpid() );
+	TraceEvent event;
+	memset(&event, 0, sizeof(event));
+	for (int i = 0; i < 6; i++)
+	{
+		event.returnCode = i;
+		snprintf(event.query, sizeof(event.query), "host%d", i);
+		buffer->write(event);
+	}
+	unique_ptr<TraceBuffer> reader = TraceBuffer::openForReading(path);
+	REQUIRE( reader );
+	vector<TraceEvent> events = reader->read();
+	REQUIRE( events.size() == 4 );
+	CHECK( events[0].returnCode == 2 );
+	CHECK( events[3].returnCode == 5 );
+	CHECK( string(events[3].query) == "host5" );
+
+	truncate(path.c_str(), 1000);
+	CHECK_FALSE( TraceBuffer::openForReading(path) );
+	unlink(path.c_str());
+}
+TEST_CASE("traced lookups record the query, the result and the time of each stage")
+{
+	resultCache().clear();
+	configuration();
+	tracing = true;
+	vector<char> buffer(16384);
+	hostent result;
+	int error, herror;
+	const char* command = "./resources/test_gethostbyname.sh";
+
+	CHECK( runNssCommandGethostbyname("myhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_SUCCESS );
+	CHECK( runNssCommandGethostbyname("myhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_SUCCESS );
+	CHECK( runNssCommandGethostbyname("unknownhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_NOTFOUND );
+	tracing = false;
+	CHECK( runNssCommandGethostbyname("myhost", &result, buffer.data(), buffer.size(), &error, &herror, command) == NSS_STATUS_SUCCESS );
+
+	REQUIRE( traceBuffer() != nullptr );
+	vector<TraceEvent> events = traceBuffer()->read();
+	REQUIRE( events.size() == 3 );
+	const TraceEvent& executed = events[0];
+	CHECK( string(executed.query) == "myhost" );
+	CHECK( executed.entryPoint == uint8_t(TraceEntryPoint::gethostbyname) );
+	CHECK( executed.status == NSS_STATUS_SUCCESS );
+	CHECK( executed.returnCode == 0 );
+	CHECK( executed.pid == getpid() );
+	CHECK( executed.outputSize > 0 );
+	CHECK( executed.readTime > 0 );
+	CHECK( executed.stages[size_t(TraceStage::permissionChecked)] == 0 );
+	CHECK( executed.stages[size_t(TraceStage::executing)] > 0 );
+	CHECK( executed.stages[size_t(TraceStage::spawned)] > executed.stages[size_t(TraceStage::executing)] );
+	CHECK( executed.stages[size_t(TraceStage::exited)] >= executed.stages[size_t(TraceStage::outputRead)] );
+	CHECK( executed.stages[size_t(TraceStage::copied)] > executed.stages[size_t(TraceStage::parsed)] );
+	CHECK( executed.duration >= executed.stages[size_t(TraceStage::copied)] );
+	const TraceEvent& cached = events[1];
+	CHECK( cached.stages[size_t(TraceStage::spawned)] == 0 );
+	CHECK( cached.stages[size_t(TraceStage::copied)] > 0 );
+	CHECK( events[2].status == NSS_STATUS_NOTFOUND );
+	CHECK( events[2].returnCode == 1 );
+	CHECK( events[2].hostError == HOST_NOT_FOUND );
+
+	unlink((configuration().tracePath + "." + to_string(getpid())).c_str());
+	resultCache().clear();
+}
@@ -0,0 +1,209 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#include "trace.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+namespace nssCommand
+{
+	const uint64_t TRACE_MAGIC = 0x3145434152544e4eULL; // "NNTRACE1"
+
+	struct alignas(64) TraceHeader
+	{
+		uint64_t magic;
+		uint32_t slotSize;
+		uint32_t capacity;
+		int32_t pid;
+		atomic<uint64_t> next;
+	};
+	struct alignas(64) TraceSlot
+	{
+		atomic<uint64_t> sequence; // 0 while being written, otherwise the number of the event plus 1
+		TraceEvent event;
+	};
+	static_assert(sizeof(TraceSlot) == 256, "trace records have a fixed size");
+
+	const char* ENTRY_POINT_NAMES[] = { "gethostbyname", "gethostbyname2", "gethostbyname3", "gethostbyname4", "gethostbyaddr" };
+	// Name of the time between the stage before and each stage
+	const char* STAGE_NAMES[] = { "permission", "lookup", "spawn", "child", "exit", "parse", "copy" };
+	static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == TRACE_STAGES, "every stage needs a name");
+
+	atomic<bool> tracing(false);
+
+	// Trivial, so the thread local needs no constructor
+	struct ActiveTrace
+	{
+		bool active;
+		int64_t start; // steady clock nanoseconds
+		TraceEvent event;
+	};
+	thread_local ActiveTrace activeTrace;
+
+	int64_t steadyNanoseconds()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	const char* traceEntryPointName(uint8_t entryPoint)
+	{
+		return (entryPoint < size_t(TraceEntryPoint::count)) ? ENTRY_POINT_NAMES[entryPoint] : "unknown";
+	}
+	const char* traceStageName(size_t stage)
+	{
+		return (stage < TRACE_STAGES) ? STAGE_NAMES[stage] : "unknown";
+	}
+
+	TraceBuffer::TraceBuffer(void* mapping, size_t mappingSize, pid_t owner)
+		: mapping(mapping), mappingSize(mappingSize), owner(owner)
+	{
+	}
+	unique_ptr<TraceBuffer> TraceBuffer::create(const string& path, size_t records)
+	{
+		if (records == 0) return nullptr;
+		size_t mappingSize = sizeof(TraceHeader) + records * sizeof(TraceSlot);
+		unlink(path.c_str()); // left by an earlier process with the same pid
+		int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (fd < 0) return nullptr;
+		if (ftruncate(fd, mappingSize) != 0)
+		{
+			close(fd);
+			unlink(path.c_str());
+			return nullptr;
+		}
+		void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED)
+		{
+			unlink(path.c_str());
+			return nullptr;
+		}
+		TraceHeader* header = (TraceHeader*) mapping;
+		header->slotSize = sizeof(TraceSlot);
+		header->capacity = records;
+		header->pid = getpid();
+		header->next.store(0);
+		header->magic = TRACE_MAGIC;
+		return unique_ptr<TraceBuffer>(new TraceBuffer(mapping, mappingSize, header->pid));
+	}
+	unique_ptr<TraceBuffer> TraceBuffer::openForReading(const string& path)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		struct stat properties;
+		if (fstat(fd, &properties) != 0 || !S_ISREG(properties.st_mode) || size_t(properties.st_size) < sizeof(TraceHeader))
+		{
+			close(fd);
+			return nullptr;
+		}
+		size_t mappingSize = properties.st_size;
+		void* mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return nullptr;
+		const TraceHeader* header = (const TraceHeader*) mapping;
+		if (header->magic != TRACE_MAGIC || header->slotSize != sizeof(TraceSlot) || mappingSize != sizeof(TraceHeader) + size_t(header->capacity) * sizeof(TraceSlot))
+		{
+			munmap(mapping, mappingSize);
+			return nullptr;
+		}
+		return unique_ptr<TraceBuffer>(new TraceBuffer(mapping, mappingSize, header->pid));
+	}
+	TraceBuffer::~TraceBuffer()
+	{
+		munmap(mapping, mappingSize);
+	}
+	void TraceBuffer::write(const TraceEvent& event)
+	{
+		TraceHeader* header = (TraceHeader*) mapping;
+		TraceSlot* slots = (TraceSlot*) (header + 1);
+		uint64_t number = header->next.fetch_add(1, memory_order_relaxed);
+		TraceSlot& slot = slots[number % header->capacity];
+		slot.sequence.store(0, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		memcpy(&slot.event, &event, sizeof(event));
+		slot.sequence.store(number + 1, memory_order_release);
+	}
+	vector<TraceEvent> TraceBuffer::read() const
+	{
+		const TraceHeader* header = (const TraceHeader*) mapping;
+		const TraceSlot* slots = (const TraceSlot*) (header + 1);
+		vector<pair<uint64_t, TraceEvent>> found;
+		for (size_t i = 0; i < header->capacity; i++)
+		{
+			uint64_t before = slots[i].sequence.load(memory_order_acquire);
+			if (before == 0) continue;
+			TraceEvent event;
+			memcpy(&event, &slots[i].event, sizeof(event));
+			atomic_thread_fence(memory_order_acquire);
+			if (slots[i].sequence.load(memory_order_relaxed) != before) continue;
+			event.query[TRACE_QUERY_SIZE - 1] = '\0';
+			found.emplace_back(before, event);
+		}
+		sort(found.begin(), found.end(), [](const pair<uint64_t, TraceEvent>& lhs, const pair<uint64_t, TraceEvent>& rhs) { return lhs.first < rhs.first; });
+		vector<TraceEvent> events;
+		for (auto& item : found) events.push_back(item.second);
+		return events;
+	}
+
+	uint64_t nanosecondsSinceStart()
+	{
+		uint64_t elapsed = steadyNanoseconds() - activeTrace.start;
+		return max<uint64_t>(elapsed, 1); // 0 marks stages not reached
+	}
+	bool beginTrace(TraceEntryPoint entryPoint, const char* query)
+	{
+		if (activeTrace.active)
+		{
+			if (activeTrace.event.query[0] == '\0' && query != nullptr) strncpy(activeTrace.event.query, query, TRACE_QUERY_SIZE - 1);
+			return false;
+		}
+		activeTrace.active = true;
+		activeTrace.start = steadyNanoseconds();
+		TraceEvent& event = activeTrace.event;
+		memset(&event, 0, sizeof(event));
+		event.startTime = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+		event.returnCode = -1;
+		event.entryPoint = uint8_t(entryPoint);
+		if (query != nullptr) strncpy(event.query, query, TRACE_QUERY_SIZE - 1);
+		return true;
+	}
+	void endTrace()
+	{
+		TraceEvent& event = activeTrace.event;
+		event.duration = nanosecondsSinceStart();
+		event.pid = getpid();
+		activeTrace.active = false;
+		TraceBuffer* buffer = traceBuffer();
+		if (buffer != nullptr) buffer->write(event);
+	}
+	void markTraceStage(TraceStage stage)
+	{
+		if (activeTrace.active) activeTrace.event.stages[size_t(stage)] = nanosecondsSinceStart();
+	}
+	void setTraceOutput(size_t outputSize, uint64_t readTime)
+	{
+		if (!activeTrace.active) return;
+		activeTrace.event.outputSize = uint32_t(min<size_t>(outputSize, UINT32_MAX));
+		activeTrace.event.readTime = readTime;
+	}
+	void setTraceResult(int status, int errorNumber, int hostError)
+	{
+		if (!activeTrace.active) return;
+		activeTrace.event.status = status;
+		activeTrace.event.errorNumber = errorNumber;
+		activeTrace.event.hostError = hostError;
+	}
+	void setTraceReturnCode(int returnCode)
+	{
+		if (activeTrace.active) activeTrace.event.returnCode = returnCode;
+	}
+}
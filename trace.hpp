@@ -0,0 +1,132 @@
+/*
+ Copyright (c) 2017 Jose Manuel Sanchez Madrid.
+ This file is licensed under MIT license. See file LICENSE for details.
+*/
+
+#ifndef _NSSCOMMAND_TRACE_H
+#define _NSSCOMMAND_TRACE_H 1
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nssCommand
+{
+	using namespace std;
+
+	enum class TraceEntryPoint : uint8_t { gethostbyname, gethostbyname2, gethostbyname3, gethostbyname4, gethostbyaddr, count };
+	// Points a lookup goes through, in order. A lookup answered without executing a command skips the middle ones.
+	enum class TraceStage : uint8_t { permissionChecked, executing, spawned, outputRead, exited, parsed, copied, count };
+
+	const size_t TRACE_STAGES = size_t(TraceStage::count);
+	const size_t TRACE_QUERY_SIZE = 128;
+
+	/*
+	 Record of one lookup. Stage times are nanoseconds since the lookup started, 0 for the
+	 stages it didn't go through.
+	*/
+	struct TraceEvent
+	{
+		int64_t startTime; // nanoseconds since the epoch
+		uint64_t duration;
+		uint64_t stages[TRACE_STAGES];
+		uint64_t readTime; // nanoseconds spent reading the output of the command
+		int32_t status; // nss_status returned
+		int32_t errorNumber;
+		int32_t hostError;
+		int32_t returnCode; // of the command, or of the cache entry that answered
+		uint32_t outputSize;
+		int32_t pid;
+		uint8_t entryPoint;
+		char query[TRACE_QUERY_SIZE]; // truncated, always null terminated
+	};
+
+	struct TraceSlot;
+
+	/*
+	 Ring buffer of the last lookups of a process, in a file mapped in memory so it can be
+	 read while the process runs and after it dies. Writers take the next slot with an
+	 atomic increment and mark it as being written while they fill it, so readers skip
+	 slots they catch half written.
+	*/
+	class TraceBuffer
+	{
+	public:
+		static unique_ptr<TraceBuffer> create(const string& path, size_t records);
+		static unique_ptr<TraceBuffer> openForReading(const string& path);
+		TraceBuffer(const TraceBuffer&) = delete;
+		TraceBuffer& operator = (const TraceBuffer&) = delete;
+		~TraceBuffer();
+		void write(const TraceEvent& event);
+		// Events still in the buffer, oldest first
+		vector<TraceEvent> read() const;
+		pid_t pid() const { return owner; }
+	private:
+		TraceBuffer(void* mapping, size_t mappingSize, pid_t owner);
+		void* mapping;
+		size_t mappingSize;
+		pid_t owner;
+	};
+
+	/*
+	 Set while tracing is enabled in the configuration. Everything below checks it first,
+	 so tracing costs a single branch on it while disabled.
+	*/
+	extern atomic<bool> tracing;
+
+	bool beginTrace(TraceEntryPoint entryPoint, const char* query);
+	void endTrace();
+	void markTraceStage(TraceStage stage);
+	void setTraceOutput(size_t outputSize, uint64_t readTime);
+	void setTraceResult(int status, int errorNumber, int hostError);
+	void setTraceReturnCode(int returnCode);
+
+	/*
+	 Traces the lookup of its scope on this thread. Scopes nested in the one that started
+	 the trace don't start another, they only give the query if it's still missing.
+	*/
+	class LookupTrace
+	{
+	public:
+		LookupTrace(TraceEntryPoint entryPoint, const char* query)
+			: started(tracing.load(memory_order_relaxed) && beginTrace(entryPoint, query))
+		{
+		}
+		LookupTrace(const LookupTrace&) = delete;
+		LookupTrace& operator = (const LookupTrace&) = delete;
+		~LookupTrace()
+		{
+			if (started) endTrace();
+		}
+	private:
+		bool started;
+	};
+
+	inline void traceStage(TraceStage stage)
+	{
+		if (tracing.load(memory_order_relaxed)) markTraceStage(stage);
+	}
+	inline void traceOutput(size_t outputSize, uint64_t readTime)
+	{
+		if (tracing.load(memory_order_relaxed)) setTraceOutput(outputSize, readTime);
+	}
+	inline void traceResult(int status, int errorNumber, int hostError)
+	{
+		if (tracing.load(memory_order_relaxed)) setTraceResult(status, errorNumber, hostError);
+	}
+	inline void traceReturnCode(int returnCode)
+	{
+		if (tracing.load(memory_order_relaxed)) setTraceReturnCode(returnCode);
+	}
+
+	const char* traceEntryPointName(uint8_t entryPoint);
+	const char* traceStageName(size_t stage);
+
+	// Buffer of this process, or nullptr if it can't be created
+	TraceBuffer* traceBuffer();
+}
+
+#endif